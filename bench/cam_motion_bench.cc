@@ -0,0 +1,151 @@
+//
+// Motion detector benchmark: runs motion_detector_process over a recorded inline motion vector
+// dump (raspivid -x, or motion_cb writing the vectors of each frame as they come) with the NEON and
+// the scalar pass, times both and checks they agree on every frame: the blocks counted, the
+// macroblock history and the motion state.
+//
+// cam_motion_bench <file.imv> <width> <height> [repeats]
+//
+
+#include "../cam.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+/// Runs over the dump when no repeat count is given
+#define MOTION_BENCH_REPEATS 100
+
+typedef struct {
+    std::vector<uint32_t> blocks;   /// blocks with motion, per frame of the last run
+    std::vector<uint8_t> history;   /// macroblock history after each frame of the last run
+    std::vector<uint8_t> active;    /// motion state after each frame of the last run
+    double frame_us;                /// mean time per frame
+} MOTION_BENCH_RESULT;
+
+/**
+ * Run a detector over the dump repeats times
+ *
+ * @param neon !0 for the NEON pass, 0 for the scalar one
+ * @return 0 if the NEON pass was asked for and is not available, !0 otherwise
+ */
+static int motion_bench_run(const std::vector<uint8_t> &dump, uint32_t columns, uint32_t rows, uint32_t repeats,
+                            int neon, MOTION_BENCH_RESULT *result) {
+    MOTION_DETECT_PARAMETERS parameters{};
+    size_t frame_size = (size_t) columns * rows * sizeof(CAM_MOTION_VECTOR);
+    size_t frames = dump.size() / frame_size;
+    uint64_t elapsed = 0;
+
+    parameters.magnitude_threshold = 2;
+    parameters.sad_threshold = 0;
+    parameters.min_blocks = 10;
+    parameters.start_frames = 2;
+    parameters.stop_frames = 10;
+
+    for (uint32_t repeat = 0; repeat < repeats; repeat++) {
+        MOTION_DETECTOR *detector = motion_detector_create(&parameters, nullptr);
+        int last = repeat == repeats - 1;
+
+        if (!detector) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        if (motion_detector_use_neon(detector, neon) != neon) {
+            motion_detector_destroy(detector);
+            return 0;
+        }
+        if (last) {
+            result->blocks.clear();
+            result->history.clear();
+            result->active.clear();
+        }
+
+        for (size_t frame = 0; frame < frames; frame++) {
+            auto *vectors = (const CAM_MOTION_VECTOR *) &dump[frame * frame_size];
+            auto start = std::chrono::steady_clock::now();
+            uint32_t blocks = motion_detector_process(detector, (int64_t) frame, vectors, columns, rows);
+            elapsed += (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+
+            if (last) {
+                uint32_t history_columns, history_rows;
+                const uint8_t *history = motion_detector_history(detector, &history_columns, &history_rows);
+
+                result->blocks.push_back(blocks);
+                result->history.insert(result->history.end(), history, history + history_columns * history_rows);
+                result->active.push_back((uint8_t) motion_detector_active(detector));
+            }
+        }
+        motion_detector_destroy(detector);
+    }
+
+    result->frame_us = (double) elapsed / 1000.0 / ((double) frames * repeats);
+    return 1;
+}
+
+/**
+ * @return The first frame the two runs disagree on, or the number of frames if they agree
+ */
+static size_t motion_bench_compare(const MOTION_BENCH_RESULT *a, const MOTION_BENCH_RESULT *b, size_t blocks) {
+    for (size_t frame = 0; frame < a->blocks.size(); frame++) {
+        if (a->blocks[frame] != b->blocks[frame] || a->active[frame] != b->active[frame] ||
+            memcmp(&a->history[frame * blocks], &b->history[frame * blocks], blocks) != 0)
+            return frame;
+    }
+    return a->blocks.size();
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s <file.imv> <width> <height> [repeats]\n", argv[0]);
+        return 2;
+    }
+
+    uint32_t width = (uint32_t) strtoul(argv[2], nullptr, 10), height = (uint32_t) strtoul(argv[3], nullptr, 10);
+    uint32_t repeats = argc > 4 ? (uint32_t) strtoul(argv[4], nullptr, 10) : MOTION_BENCH_REPEATS;
+    // one vector per 16x16 macroblock, plus a padding column per row
+    uint32_t columns = (width + 15) / 16 + 1, rows = (height + 15) / 16;
+    size_t frame_size = (size_t) columns * rows * sizeof(CAM_MOTION_VECTOR);
+    std::vector<uint8_t> dump;
+    FILE *file = fopen(argv[1], "rb");
+
+    if (!file) {
+        perror(argv[1]);
+        return 1;
+    }
+    uint8_t chunk[65536];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        dump.insert(dump.end(), chunk, chunk + read);
+    fclose(file);
+
+    if (!width || !height || !repeats || dump.size() < frame_size) {
+        fprintf(stderr, "%s: no complete %ux%u frame of motion vectors\n", argv[1], width, height);
+        return 1;
+    }
+    if (dump.size() % frame_size)
+        fprintf(stderr, "%s: %zu trailing bytes ignored\n", argv[1], dump.size() % frame_size);
+
+    MOTION_BENCH_RESULT scalar, neon;
+    size_t frames = dump.size() / frame_size;
+
+    motion_bench_run(dump, columns, rows, repeats, 0, &scalar);
+    printf("%zu frames of %ux%u macroblocks, %u runs\n", frames, columns, rows, repeats);
+    printf("scalar: %.2f us/frame\n", scalar.frame_us);
+
+    if (!motion_bench_run(dump, columns, rows, repeats, 1, &neon)) {
+        printf("NEON:   not available in this build\n");
+        return 0;
+    }
+    printf("NEON:   %.2f us/frame (%.1fx)\n", neon.frame_us, scalar.frame_us / neon.frame_us);
+
+    size_t mismatch = motion_bench_compare(&scalar, &neon, (size_t) columns * rows);
+    if (mismatch != frames) {
+        printf("NEON and scalar differ from frame %zu on: %u and %u blocks\n", mismatch, neon.blocks[mismatch],
+               scalar.blocks[mismatch]);
+        return 1;
+    }
+    printf("NEON and scalar agree on all frames\n");
+    return 0;
+}
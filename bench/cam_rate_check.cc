@@ -0,0 +1,173 @@
+//
+// Rate control check: runs the video pipeline with rateControlTarget and sends the stream into a
+// synthetic link, a queue draining at a fixed capacity that drops from 4 to 1.2 Mbit/s halfway.
+// The backlog goes to report_rate_control_queue as the stream arrives, and the target follows the
+// capacity as an uplink estimate would. At the end of each phase the bitrate has to have settled:
+//  - the stream within 60% to 110% of the capacity;
+//  - the backlog under half a second of data;
+//  - at most one bitrate change, rather than hunting around the capacity.
+// With "emulated" the emulated backend provides the camera and encoder, whose frames follow the
+// bitrate, so the check runs on a host.
+//
+// cam_rate_check [seconds per phase] [emulated]
+//
+
+#include "../cam.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+/// Length of each phase if none is given, in s
+#define RATE_CHECK_SECONDS 15
+/// Seconds at the end of each phase the bitrate has to have settled in
+#define RATE_CHECK_SETTLED 4
+
+/// Link capacity of each phase, in bytes/s
+static const uint32_t rate_check_capacity[] = {500000, 150000};
+
+typedef struct {
+    std::mutex lock;
+    double capacity;            /// bytes/s
+    double backlog;             /// bytes queued
+    uint64_t bytes;             /// bytes sent into the link
+    uint64_t last;              /// time of the last drain, in us
+} RATE_CHECK_LINK;
+
+/**
+ * Drain the link up to now, with the lock held
+ */
+static void rate_check_drain(RATE_CHECK_LINK *link, uint64_t now) {
+    link->backlog = vcos_max(link->backlog - link->capacity * (double) (now - link->last) / 1000000, 0.0);
+    link->last = now;
+}
+
+typedef struct {
+    double rate_min;            /// lowest stream bytes/s in the settled seconds
+    double rate_max;            /// highest stream bytes/s in the settled seconds
+    double backlog;             /// highest backlog in the settled seconds
+    uint32_t changes;           /// bitrate changes in the settled seconds
+} RATE_CHECK_PHASE;
+
+int main(int argc, char **argv) {
+    uint32_t seconds = argc > 1 ? (uint32_t) strtoul(argv[1], nullptr, 10) : RATE_CHECK_SECONDS;
+    const uint32_t phases = sizeof(rate_check_capacity) / sizeof(rate_check_capacity[0]);
+    RATE_CHECK_PHASE results[phases];
+    RATE_CHECK_LINK link;
+    CAM_STATE state;
+    MMAL_STATUS_T status = MMAL_SUCCESS;
+    int ok = 1;
+
+    if (seconds <= RATE_CHECK_SETTLED) {
+        fprintf(stderr, "Usage: %s [seconds per phase, more than %d] [emulated]\n", argv[0], RATE_CHECK_SETTLED);
+        return 2;
+    }
+    if (argc > 2 && !strcmp(argv[2], "emulated"))
+        set_backend(&emulated_backend);
+    get_backend()->host_init();
+
+    link.capacity = rate_check_capacity[0];
+    link.backlog = 0;
+    link.bytes = 0;
+    link.last = get_microseconds64();
+
+    default_state(&state);
+    state.callback_data.pstate = &state;
+    state.common_settings.width = 1280;
+    state.common_settings.height = 720;
+    state.framerate = 30;
+    state.intraperiod = 30;
+    state.bitrate = (int) rate_check_capacity[0] * 8;
+    state.rateControlTarget = rate_check_capacity[0];
+    state.waitMethod = WAIT_METHOD_NONE;
+    // stopped by capture_request_stop once the phases are over
+    state.timeout = (int) (seconds * phases + 5) * 1000;
+    state.callback_data.video_cb = [&state, &link](int64_t timestamp, uint8_t *data, uint32_t length,
+                                                   uint32_t offset) {
+        double backlog;
+        {
+            std::lock_guard<std::mutex> guard(link.lock);
+            rate_check_drain(&link, get_microseconds64());
+            link.backlog += length;
+            link.bytes += length;
+            backlog = link.backlog;
+        }
+        report_rate_control_queue(&state, (uint32_t) backlog);
+    };
+
+    if ((status = init(&state)) != MMAL_SUCCESS) {
+        fprintf(stderr, "Unable to set up the pipeline: %s\n", mmal_status_to_string(status));
+        return 1;
+    }
+    std::thread capturing([&state, &status]() { status = capture(&state); });
+
+    printf("%s backend, %u s per phase\n", get_backend()->name, seconds);
+    printf("   s  capacity   bitrate    stream   backlog\n");
+    uint64_t last_bytes = 0;
+    int last_bitrate = state.bitrate;
+    for (uint32_t phase = 0; phase < phases; phase++) {
+        RATE_CHECK_PHASE *result = &results[phase];
+
+        *result = RATE_CHECK_PHASE{1e12, 0, 0, 0};
+        {
+            std::lock_guard<std::mutex> guard(link.lock);
+            rate_check_drain(&link, get_microseconds64());
+            link.capacity = rate_check_capacity[phase];
+        }
+        set_rate_control_target(&state, rate_check_capacity[phase]);
+
+        for (uint32_t second = 0; second < seconds; second++) {
+            vcos_sleep(1000);
+
+            double backlog;
+            uint64_t bytes;
+            {
+                std::lock_guard<std::mutex> guard(link.lock);
+                rate_check_drain(&link, get_microseconds64());
+                backlog = link.backlog;
+                bytes = link.bytes;
+            }
+            vcos_mutex_lock(&state.encoder_control_lock);
+            int bitrate = state.bitrate;
+            vcos_mutex_unlock(&state.encoder_control_lock);
+            auto rate = (double) (bytes - last_bytes);
+
+            printf("%4u %9u %9d %9.0f %9.0f\n", phase * seconds + second + 1, rate_check_capacity[phase], bitrate,
+                   rate, backlog);
+            // the first second of the window counts changes but not the rate it was made in
+            if (second >= seconds - RATE_CHECK_SETTLED) {
+                result->changes += bitrate != last_bitrate;
+                if (second > seconds - RATE_CHECK_SETTLED) {
+                    result->rate_min = vcos_min(result->rate_min, rate);
+                    result->rate_max = vcos_max(result->rate_max, rate);
+                }
+                result->backlog = vcos_max(result->backlog, backlog);
+            }
+            last_bytes = bytes;
+            last_bitrate = bitrate;
+        }
+    }
+
+    capture_request_stop(&state);
+    capturing.join();
+    destroy(&state);
+
+    if (status != MMAL_SUCCESS) {
+        fprintf(stderr, "Capture failed: %s\n", mmal_status_to_string(status));
+        ok = 0;
+    }
+    for (uint32_t phase = 0; phase < phases; phase++) {
+        const RATE_CHECK_PHASE *result = &results[phase];
+        double capacity = rate_check_capacity[phase];
+        int settled = result->rate_min >= capacity * 0.60 && result->rate_max <= capacity * 1.10 &&
+                      result->backlog < capacity / 2 && result->changes <= 1;
+
+        printf("phase %u at %.1f Mbit/s: stream %.0f%% to %.0f%% of it, backlog up to %.0f ms, %u changes: %s\n",
+               phase + 1, capacity * 8 / 1000000, result->rate_min * 100 / capacity, result->rate_max * 100 / capacity,
+               result->backlog * 1000 / capacity, result->changes, settled ? "settled" : "not settled");
+        ok &= settled;
+    }
+    printf(ok ? "Rate control check passed\n" : "Rate control check failed\n");
+    return ok ? 0 : 1;
+}
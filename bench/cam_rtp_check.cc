@@ -0,0 +1,219 @@
+//
+// RTP output check: runs the video pipeline with rtpDestination on a loopback UDP port and a local
+// receiver checking the stream as RFC 6184 has it:
+//  - RTP version 2 and the payload type, and sequence numbers without gaps (beyond the packets
+//    the sender reports as dropped);
+//  - one timestamp per access unit, increasing by about a frame time, the marker bit on the
+//    last packet of every access unit;
+//  - FU-A fragments starting and ending in order, without other packets in between;
+//  - the SPS and PPS in front of every IDR picture.
+// With "emulated" the emulated backend provides the camera and encoder, so the check runs on a host.
+//
+// cam_rtp_check [seconds] [port] [emulated]
+//
+
+#include "../cam.h"
+#include <arpa/inet.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+/// Capture time if none is given, in s
+#define RTP_CHECK_SECONDS 5
+/// Loopback port if none is given
+#define RTP_CHECK_PORT 15004
+#define RTP_CHECK_FRAMERATE 30
+#define RTP_CHECK_PAYLOAD_TYPE 96
+/// 90kHz ticks per frame
+#define RTP_CHECK_FRAME_TICKS (90000 / RTP_CHECK_FRAMERATE)
+
+typedef struct {
+    uint64_t packets;
+    uint64_t gaps;              /// packets missing from the sequence
+    uint64_t access_units;
+    uint64_t idr_pictures;
+    uint64_t fragments;
+    uint64_t irregular;         /// access units more than two frame times or less than half a frame time apart
+    uint64_t errors;
+
+    int started;
+    uint16_t sequence;          /// of the last packet
+    uint32_t timestamp;         /// of the current access unit
+    int marker;                 /// the last packet had the marker bit
+    int fragmenting;            /// within a FU-A NAL unit
+    int sps, pps;               /// seen in the current access unit
+} RTP_CHECK;
+
+static void rtp_check_error(RTP_CHECK *check, const char *what) {
+    if (check->errors++ < 10)
+        fprintf(stderr, "packet %llu (access unit %llu): %s\n", (unsigned long long) check->packets,
+                (unsigned long long) check->access_units, what);
+}
+
+/**
+ * Check a received RTP packet against the previous ones
+ */
+static void rtp_check_packet(RTP_CHECK *check, const uint8_t *packet, size_t length) {
+    if (length < 13 || packet[0] >> 6u != 2 || (packet[1] & 0x7fu) != RTP_CHECK_PAYLOAD_TYPE) {
+        rtp_check_error(check, "not an RTP packet of the H264 payload type");
+        return;
+    }
+
+    auto sequence = (uint16_t) (packet[2] << 8u | packet[3]);
+    uint32_t timestamp = (uint32_t) packet[4] << 24u | (uint32_t) packet[5] << 16u | (uint32_t) packet[6] << 8u |
+                         packet[7];
+    int marker = packet[1] >> 7u;
+    const uint8_t *payload = packet + 12;
+    uint32_t type = payload[0] & 0x1fu;
+
+    if (check->started && sequence != (uint16_t) (check->sequence + 1))
+        check->gaps += (uint16_t) (sequence - check->sequence - 1);
+
+    if (!check->started || timestamp != check->timestamp) {
+        auto step = (int32_t) (timestamp - check->timestamp);
+
+        if (check->started) {
+            if (!check->marker)
+                rtp_check_error(check, "access unit ended without the marker bit");
+            if (step <= 0)
+                rtp_check_error(check, "timestamp went back");
+            else if (step < RTP_CHECK_FRAME_TICKS / 2 || step > 2 * RTP_CHECK_FRAME_TICKS)
+                check->irregular++;
+            if (check->fragmenting)
+                rtp_check_error(check, "access unit ended within a FU-A NAL unit");
+        }
+        check->started = 1;
+        check->timestamp = timestamp;
+        check->access_units++;
+        check->fragmenting = 0;
+        check->sps = check->pps = 0;
+    } else if (check->marker) {
+        rtp_check_error(check, "packet after the marker bit with the same timestamp");
+    }
+
+    if (type == 28) {
+        uint8_t fu = payload[1];
+
+        check->fragments++;
+        if (fu & 0x80u) {
+            if (check->fragmenting)
+                rtp_check_error(check, "FU-A start within a FU-A NAL unit");
+            check->fragmenting = 1;
+            type = fu & 0x1fu;
+        } else if (!check->fragmenting) {
+            rtp_check_error(check, "FU-A fragment without a start");
+        } else {
+            type = 0;
+        }
+        if (fu & 0x40u)
+            check->fragmenting = 0;
+    } else if (check->fragmenting) {
+        rtp_check_error(check, "single NAL unit packet within a FU-A NAL unit");
+        check->fragmenting = 0;
+    }
+
+    if (type == H264_NAL_SPS)
+        check->sps = 1;
+    else if (type == H264_NAL_PPS)
+        check->pps = 1;
+    else if (type == H264_NAL_IDR) {
+        check->idr_pictures++;
+        if (!check->sps || !check->pps)
+            rtp_check_error(check, "IDR picture without the SPS and PPS in front");
+    }
+
+    check->sequence = sequence;
+    check->marker = marker;
+    check->packets++;
+}
+
+/**
+ * Receive and check packets until stopped
+ */
+static void rtp_check_receive(int fd, RTP_CHECK *check, const std::atomic<int> *stop) {
+    uint8_t packet[65536];
+    struct pollfd pfd = {fd, POLLIN, 0};
+
+    while (!stop->load()) {
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+        ssize_t length;
+        while ((length = recv(fd, packet, sizeof(packet), MSG_DONTWAIT)) > 0)
+            rtp_check_packet(check, packet, (size_t) length);
+    }
+}
+
+int main(int argc, char **argv) {
+    uint32_t seconds = argc > 1 ? (uint32_t) strtoul(argv[1], nullptr, 10) : RTP_CHECK_SECONDS;
+    uint32_t port = argc > 2 ? (uint32_t) strtoul(argv[2], nullptr, 10) : RTP_CHECK_PORT;
+    struct sockaddr_in address = {};
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0), size = 8 << 20;
+    char destination[32];
+    std::atomic<int> stop{0};
+    RTP_CHECK check{};
+    RTP_STATS stats{};
+    CAM_STATE state;
+    MMAL_STATUS_T status;
+
+    if (!seconds || !port || port > 65535) {
+        fprintf(stderr, "Usage: %s [seconds] [port] [emulated]\n", argv[0]);
+        return 2;
+    }
+    if (argc > 3 && !strcmp(argv[3], "emulated"))
+        set_backend(&emulated_backend);
+    get_backend()->host_init();
+
+    // the receiver is bound before the sender connects, with room for the largest keyframes
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t) port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    if (fd < 0 || bind(fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        perror("Unable to bind the receiver");
+        return 1;
+    }
+    std::thread receiver(rtp_check_receive, fd, &check, &stop);
+
+    snprintf(destination, sizeof(destination), "127.0.0.1:%u", port);
+    default_state(&state);
+    state.callback_data.pstate = &state;
+    state.common_settings.width = 1280;
+    state.common_settings.height = 720;
+    state.framerate = RTP_CHECK_FRAMERATE;
+    state.bitrate = 4000000;
+    state.intraperiod = RTP_CHECK_FRAMERATE;
+    state.rtpDestination = destination;
+    state.rtpPayloadType = RTP_CHECK_PAYLOAD_TYPE;
+    state.waitMethod = WAIT_METHOD_NONE;
+    state.timeout = (int) seconds * 1000;
+
+    if ((status = init(&state)) != MMAL_SUCCESS || (status = capture(&state)) != MMAL_SUCCESS)
+        fprintf(stderr, "Pipeline failed: %s\n", mmal_status_to_string(status));
+    get_rtp_stats(&state, &stats);
+    destroy(&state);
+
+    // the last packets are on their way
+    vcos_sleep(200);
+    stop.store(1);
+    receiver.join();
+    close(fd);
+
+    printf("%s backend: %llu packets (%llu FU-A) in %llu access units, %llu IDR pictures\n", get_backend()->name,
+           (unsigned long long) check.packets, (unsigned long long) check.fragments,
+           (unsigned long long) check.access_units, (unsigned long long) check.idr_pictures);
+    printf("sender: %llu packets sent, %llu dropped; receiver: %llu missing, %llu irregular frame times\n",
+           (unsigned long long) stats.packets_sent, (unsigned long long) stats.packets_dropped,
+           (unsigned long long) check.gaps, (unsigned long long) check.irregular);
+
+    if (status != MMAL_SUCCESS || check.errors || !check.idr_pictures || check.gaps > stats.packets_dropped) {
+        printf("RTP stream check failed: %llu errors\n", (unsigned long long) check.errors);
+        return 1;
+    }
+    printf("RTP stream check passed\n");
+    return 0;
+}
@@ -0,0 +1,117 @@
+//
+// Camera start up benchmark: times the creation of camera components and the camera parameter
+// change sets (cam_parameters.cc), and checks what each of them sends:
+//  - creation sends the full parameter set, as set_all_parameters always did;
+//  - set_camera_parameters with unchanged parameters sends nothing;
+//  - set_camera_parameters with two changed parameters sends those two.
+// Every parameter is a VideoCore round trip on the Pi; the emulated backend takes them at once, so
+// on a host only the counts are meaningful.
+//
+// cam_startup_bench [runs] [emulated]
+//
+
+#include "../cam.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/// Camera components created if no run count is given
+#define STARTUP_BENCH_RUNS 20
+
+typedef struct {
+    uint64_t create;            /// create_camera_component, parameters included
+    uint64_t create_parameters; /// the parameters sent at creation
+    uint64_t full;              /// set_all_parameters on the created camera
+    uint64_t unchanged;         /// set_camera_parameters, nothing changed
+    uint64_t changed;           /// set_camera_parameters, two parameters changed
+} STARTUP_BENCH_TIMES;
+
+/**
+ * Check the parameters a change set sent
+ *
+ * @return !0 if sent as expected and all taken
+ */
+static int startup_bench_check(const char *what, const CAM_PARAMETER_RESULT *result, int expected) {
+    int sent = __builtin_popcount(result->sent);
+
+    if (sent == expected && !result->failed)
+        return 1;
+    fprintf(stderr, "%s: %d parameters sent (%d expected), %d failed\n", what, sent, expected,
+            __builtin_popcount(result->failed));
+    return 0;
+}
+
+/**
+ * Create a camera, apply the change sets and destroy it again
+ *
+ * @return !0 if every change set sent what it should
+ */
+static int startup_bench_run(STARTUP_BENCH_TIMES *times) {
+    CAM_STATE state;
+    CAM_PARAMETER_RESULT result;
+    int ok = 1;
+
+    default_state(&state);
+    state.callback_data.pstate = &state;
+    // the application's own settings, on top of the defaults
+    state.camera_parameters.brightness = 55;
+    state.camera_parameters.sharpness = 10;
+    state.camera_parameters.exposureMode = MMAL_PARAM_EXPOSUREMODE_NIGHT;
+
+    uint64_t start = get_microseconds64();
+    if (create_camera_component(&state) != MMAL_SUCCESS) {
+        fprintf(stderr, "Unable to create the camera component\n");
+        exit(1);
+    }
+    times->create += get_microseconds64() - start;
+    times->create_parameters += state.camera_parameters_result.duration;
+    // everything but the settings events, which are off
+    ok &= startup_bench_check("creation", &state.camera_parameters_result, CAM_PARAMETER_COUNT - 1);
+
+    start = get_microseconds64();
+    if (set_all_parameters(state.camera_component, &state.camera_parameters)) {
+        fprintf(stderr, "set_all_parameters failed\n");
+        ok = 0;
+    }
+    times->full += get_microseconds64() - start;
+
+    CAM_PARAMETERS params = state.camera_parameters;
+    set_camera_parameters(&state, &params, &result);
+    times->unchanged += result.duration;
+    ok &= startup_bench_check("unchanged", &result, 0);
+
+    params.brightness = 60;
+    params.exposureCompensation = 2;
+    set_camera_parameters(&state, &params, &result);
+    times->changed += result.duration;
+    ok &= startup_bench_check("changed", &result, 2);
+
+    destroy_camera_component(&state);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    uint32_t runs = argc > 1 ? (uint32_t) strtoul(argv[1], nullptr, 10) : STARTUP_BENCH_RUNS;
+    STARTUP_BENCH_TIMES times{};
+    int ok = 1;
+
+    if (!runs) {
+        fprintf(stderr, "Usage: %s [runs] [emulated]\n", argv[0]);
+        return 2;
+    }
+    if (argc > 2 && !strcmp(argv[2], "emulated"))
+        set_backend(&emulated_backend);
+    get_backend()->host_init();
+
+    for (uint32_t i = 0; i < runs; i++)
+        ok &= startup_bench_run(&times);
+
+    printf("%u cameras on the %s backend, mean times:\n", runs, get_backend()->name);
+    printf("create_camera_component:         %8.1f us\n", (double) times.create / runs);
+    printf("  parameters at creation:        %8.1f us\n", (double) times.create_parameters / runs);
+    printf("set_all_parameters:              %8.1f us\n", (double) times.full / runs);
+    printf("set_camera_parameters unchanged: %8.1f us\n", (double) times.unchanged / runs);
+    printf("set_camera_parameters 2 changed: %8.1f us\n", (double) times.changed / runs);
+    printf(ok ? "Change sets sent what they should\n" : "Change sets did not send what they should\n");
+    return ok ? 0 : 1;
+}
@@ -16,15 +16,17 @@
  */
 
 void bcm_host_init(void) {
-    VCHIQ_INSTANCE_T vchiq_instance;
     static int initted;
-    int success;
 
     if (initted)
         return;
     initted = 1;
     vcos_init();
 
+#ifndef CAM_HOST_BUILD
+    VCHIQ_INSTANCE_T vchiq_instance;
+    int success;
+
     if (vchiq_initialise(&vchiq_instance) != VCHIQ_SUCCESS) {
         vcos_log_error("* failed to open vchiq instance\n");
         exit(-1);
@@ -49,6 +51,77 @@ void bcm_host_init(void) {
     if (success == 0) {
         vcos_assert(success == 0);
     }
+#endif
+}
+
+/**
+ * Create a VideoCore firmware component
+ *
+ * @param type Role of the component to create
+ * @param component Pointer to the created component, set if successful
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+static MMAL_STATUS_T mmal_backend_component_create(CAM_COMPONENT_TYPE_T type, MMAL_COMPONENT_T **component) {
+    switch (type) {
+        case CAM_COMPONENT_CAMERA:
+            return mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA, component);
+        case CAM_COMPONENT_CAMERA_INFO:
+            return mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA_INFO, component);
+        case CAM_COMPONENT_VIDEO_ENCODER:
+            return mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_ENCODER, component);
+        case CAM_COMPONENT_IMAGE_ENCODER:
+            return mmal_component_create(MMAL_COMPONENT_DEFAULT_IMAGE_ENCODER, component);
+        case CAM_COMPONENT_VIDEO_RENDERER:
+            return mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_RENDERER, component);
+        case CAM_COMPONENT_NULL_SINK:
+            return mmal_component_create("vc.null_sink", component);
+        case CAM_COMPONENT_SPLITTER:
+            return mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_SPLITTER, component);
+        case CAM_COMPONENT_ISP:
+            return mmal_component_create("vc.ril.isp", component);
+    }
+    return MMAL_ENOSYS;
+}
+
+const CAM_BACKEND mmal_backend = {"mmal", bcm_host_init, mmal_backend_component_create};
+
+#ifdef CAM_HOST_BUILD
+static const CAM_BACKEND *current_backend = &emulated_backend;
+#else
+static const CAM_BACKEND *current_backend = &mmal_backend;
+#endif
+
+/**
+ * Select the backend used to create components. Must be called before any component is created.
+ * @param backend Backend to use, nullptr restores the build default
+ */
+void set_backend(const CAM_BACKEND *backend) {
+    if (!backend) {
+#ifdef CAM_HOST_BUILD
+        backend = &emulated_backend;
+#else
+        backend = &mmal_backend;
+#endif
+    }
+    current_backend = backend;
+}
+
+/**
+ * @return the backend used to create components
+ */
+const CAM_BACKEND *get_backend() {
+    return current_backend;
+}
+
+/**
+ * Create a component through the current backend
+ *
+ * @param type Role of the component to create
+ * @param component Pointer to the created component, set if successful
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T create_backend_component(CAM_COMPONENT_TYPE_T type, MMAL_COMPONENT_T **component) {
+    return current_backend->component_create(type, component);
 }
 
 int set_stereo_mode(MMAL_PORT_T *port, MMAL_PARAMETER_STEREOSCOPIC_MODE_T *stereo_mode) {
@@ -468,44 +541,9 @@ int set_gains(MMAL_COMPONENT_T *camera, float analog, float digital) {
  * @return 0 if successful, none-zero if unsuccessful.
  */
 int set_all_parameters(MMAL_COMPONENT_T *camera, const CAM_PARAMETERS *params) {
-    int result;
-
-    result = set_saturation(camera, params->saturation);
-    result += set_sharpness(camera, params->sharpness);
-    result += set_contrast(camera, params->contrast);
-    result += set_brightness(camera, params->brightness);
-    result += set_ISO(camera, params->ISO);
-    result += set_video_stabilisation(camera, params->videoStabilisation);
-    result += set_exposure_compensation(camera, params->exposureCompensation);
-    result += set_exposure_mode(camera, params->exposureMode);
-    result += set_flicker_avoid_mode(camera, params->flickerAvoidMode);
-    result += set_metering_mode(camera, params->exposureMeterMode);
-    result += set_awb_mode(camera, params->awbMode);
-    result += set_awb_gains(camera, params->awb_gains_r, params->awb_gains_b);
-    result += set_rotation(camera, params->rotation);
-    result += set_flips(camera, params->hflip, params->vflip);
-    result += set_ROI(camera, params->roi);
-    result += set_shutter_speed(camera, params->shutter_speed);
-    result += set_DRC(camera, params->drc_level);
-    result += set_stats_pass(camera, params->stats_pass);
-    result += set_gains(camera, params->analog_gain, params->digital_gain);
-
-    if (params->settings) {
-        MMAL_PARAMETER_CHANGE_EVENT_REQUEST_T change_event_request =
-                {
-                        {MMAL_PARAMETER_CHANGE_EVENT_REQUEST, sizeof(MMAL_PARAMETER_CHANGE_EVENT_REQUEST_T)},
-                        MMAL_PARAMETER_CAMERA_SETTINGS, 1
-                };
-
-        MMAL_STATUS_T status = mmal_port_parameter_set(camera->control, &change_event_request.hdr);
-        if (status != MMAL_SUCCESS) {
-            vcos_log_error("No camera settings events");
-        }
-
-        result += status;
-    }
+    CAM_PARAMETER_RESULT result;
 
-    return result;
+    return apply_camera_parameters(camera, nullptr, params, &result);
 }
 
 /**
@@ -540,7 +578,7 @@ MMAL_STATUS_T create_camera_component(CAM_STATE *state) {
     MMAL_STATUS_T status;
 
     /* Create the component */
-    status = mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA, &camera);
+    status = create_backend_component(CAM_COMPONENT_CAMERA, &camera);
 
     if (status != MMAL_SUCCESS) {
         printf("Failed to create camera component");
@@ -673,7 +711,13 @@ MMAL_STATUS_T create_camera_component(CAM_STATE *state) {
     }
 
     // Note: this sets lots of parameters that were not individually addressed before.
-    set_all_parameters(camera, &state->camera_parameters);
+    // All of them are sent to the new camera, and the cache keeps what it took for later changes.
+    camera_parameter_cache_reset(&state->camera_parameters_applied);
+    apply_camera_parameters(camera, &state->camera_parameters_applied, &state->camera_parameters,
+                            &state->camera_parameters_result);
+    if (state->common_settings.verbose)
+        fprintf(stderr, "Camera parameters set in %llu us\n",
+                (unsigned long long) state->camera_parameters_result.duration);
 
     state->camera_component = camera;
 
@@ -683,6 +727,49 @@ MMAL_STATUS_T create_camera_component(CAM_STATE *state) {
     return status;
 }
 
+/**
+ * Pool callback for output port buffers (encoder, raw frame tap), called when the last reference to a buffer is released
+ *
+ * Sends the buffer back to its output port, so buffers held by the frame queue or by a FrameRef
+ * are replenished lazily, on whichever thread releases them.
+ *
+ * @param pool Pool the buffer belongs to
+ * @param buffer Released buffer header
+ * @param userdata Output port
+ * @return MMAL_TRUE to put the buffer back in the pool queue
+ */
+MMAL_BOOL_T port_pool_release_callback(MMAL_POOL_T *, MMAL_BUFFER_HEADER_T *buffer, void *userdata) {
+    auto *port = (MMAL_PORT_T *) userdata;
+
+    if (!port->is_enabled)
+        return MMAL_TRUE;
+
+    if (mmal_port_send_buffer(port, buffer) != MMAL_SUCCESS) {
+        vcos_log_error("Unable to return a buffer to port %s", port->name);
+        return MMAL_TRUE;
+    }
+    return MMAL_FALSE;
+}
+
+/**
+ * Pool callback for the video encoder output buffers: sends the buffer back to the encoder and counts it in the
+ * pipeline stats
+ *
+ * @param pool Pool the buffer belongs to
+ * @param buffer Released buffer header
+ * @param userdata Pointer to state control struct
+ * @return MMAL_TRUE to put the buffer back in the pool queue
+ */
+static MMAL_BOOL_T encoder_pool_release_callback(MMAL_POOL_T *pool, MMAL_BUFFER_HEADER_T *buffer, void *userdata) {
+    auto *state = (CAM_STATE *) userdata;
+    MMAL_PORT_T *port = state->video_encoder_output_port;
+    MMAL_BOOL_T requeue = port_pool_release_callback(pool, buffer, port);
+
+    if (state->pipeline_stats)
+        pipeline_stats_release(state->pipeline_stats, !requeue || !port->is_enabled);
+    return requeue;
+}
+
 /**
  * Create the encoder component, set up its ports
  *
@@ -697,7 +784,7 @@ MMAL_STATUS_T create_encoder_component(CAM_STATE *state) {
     MMAL_STATUS_T status;
     MMAL_POOL_T *pool;
 
-    status = mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_ENCODER, &encoder);
+    status = create_backend_component(CAM_COMPONENT_VIDEO_ENCODER, &encoder);
 
     if (status != MMAL_SUCCESS) {
         printf("Unable to create video encoder component");
@@ -754,6 +841,16 @@ MMAL_STATUS_T create_encoder_component(CAM_STATE *state) {
     if (encoder_output->buffer_num < encoder_output->buffer_num_min)
         encoder_output->buffer_num = encoder_output->buffer_num_min;
 
+    // Frames waiting in the frame queue or held by the frame callback hold on to their buffers
+    encoder_output->buffer_num += state->frameQueueSize + state->extraFrameBuffers;
+    // as do the frames the MJPEG server assembles, has pending and sends, each in up to MJPEG_FRAME_CHUNKS buffers
+    if (state->mjpegPort)
+        encoder_output->buffer_num += MJPEG_SERVER_BUFFERS;
+    // an adaptive pool starts out within its bounds
+    if (state->encoderPoolMax)
+        encoder_output->buffer_num = vcos_min(vcos_max(encoder_output->buffer_num, state->encoderPoolMin),
+                                              state->encoderPoolMax);
+
     // We need to set the frame rate on output to 0, to ensure it gets
     // updated correctly from the input framerate when port connected
     encoder_output->format->es->video.frame_rate.num = 0;
@@ -928,6 +1025,9 @@ MMAL_STATUS_T create_encoder_component(CAM_STATE *state) {
 
     if (!pool) {
         printf("Failed to create buffer header pool for encoder output port %s", encoder_output->name);
+    } else {
+        // buffers go straight back to the port once the last reference to them is released
+        mmal_pool_callback_set(pool, encoder_pool_release_callback, state);
     }
 
     state->video_encoder_pool = pool;
@@ -963,7 +1063,7 @@ MMAL_STATUS_T create_still_camera_component(CAM_STATE *state) {
     MMAL_STATUS_T status;
 
     /* Create the component */
-    status = mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA, &camera);
+    status = create_backend_component(CAM_COMPONENT_CAMERA, &camera);
 
     if (status != MMAL_SUCCESS) {
         vcos_log_error("Failed to create camera component");
@@ -1048,7 +1148,9 @@ MMAL_STATUS_T create_still_camera_component(CAM_STATE *state) {
         mmal_port_parameter_set(camera->control, &cam_config.hdr);
     }
 
-    set_all_parameters(camera, &state->camera_parameters);
+    camera_parameter_cache_reset(&state->camera_parameters_applied);
+    apply_camera_parameters(camera, &state->camera_parameters_applied, &state->camera_parameters,
+                            &state->camera_parameters_result);
 
     // Now set up the port formats
 
@@ -1190,7 +1292,7 @@ MMAL_STATUS_T create_still_encoder_component(CAM_STATE *state) {
     MMAL_STATUS_T status;
     MMAL_POOL_T *pool;
 
-    status = mmal_component_create(MMAL_COMPONENT_DEFAULT_IMAGE_ENCODER, &encoder);
+    status = create_backend_component(CAM_COMPONENT_IMAGE_ENCODER, &encoder);
 
     if (status != MMAL_SUCCESS) {
         vcos_log_error("Unable to create JPEG encoder component");
@@ -1222,6 +1324,10 @@ MMAL_STATUS_T create_still_encoder_component(CAM_STATE *state) {
     if (encoder_output->buffer_num < encoder_output->buffer_num_min)
         encoder_output->buffer_num = encoder_output->buffer_num_min;
 
+    // capture_still_chunks holds on to the buffers of a whole image
+    if (encoder_output->buffer_num < state->stillChunkBuffers)
+        encoder_output->buffer_num = state->stillChunkBuffers;
+
     // Commit the port changes to the output port
     status = mmal_port_format_commit(encoder_output);
 
@@ -1279,6 +1385,9 @@ MMAL_STATUS_T create_still_encoder_component(CAM_STATE *state) {
     }
 
     state->encoder_pool = pool;
+
+    // Images are assembled in memory reused between captures, start with the size of one output buffer
+    state->still_image_pool = still_image_pool_create(encoder_output->buffer_size);
     state->still_encoder_component = encoder;
     state->still_encoder_output_port = encoder_output;
     state->still_encoder_input_port = encoder_input;
@@ -1407,15 +1516,14 @@ MMAL_STATUS_T preview_create(CAM_PREVIEW_PARAMETERS *state) {
 
     if (!state->wantPreview) {
         // No preview required, so create a null sink component to take its place
-        status = mmal_component_create("vc.null_sink", &preview);
+        status = create_backend_component(CAM_COMPONENT_NULL_SINK, &preview);
 
         if (status != MMAL_SUCCESS) {
             vcos_log_error("Unable to create null sink component");
             goto error;
         }
     } else {
-        status = mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_RENDERER,
-                                       &preview);
+        status = create_backend_component(CAM_COMPONENT_VIDEO_RENDERER, &preview);
 
         if (status != MMAL_SUCCESS) {
             vcos_log_error("Unable to create preview component");
@@ -1530,6 +1638,13 @@ void default_state(CAM_STATE *state) {
     state->splitNow = 0;
     state->splitWait = 0;
     state->inlineMotionVectors = 0;
+    state->motionDetection = 0;
+    state->mp4FragmentDuration = 1000;
+    state->motionParameters.magnitude_threshold = 2;
+    state->motionParameters.sad_threshold = 256;
+    state->motionParameters.min_blocks = 10;
+    state->motionParameters.start_frames = 3;
+    state->motionParameters.stop_frames = 15;
     state->intra_refresh_type = -1;
     state->frame = 0;
     state->addSPSTiming = MMAL_FALSE;
@@ -1561,12 +1676,27 @@ void destroy_camera_component(CAM_STATE *state) {
 void destroy_encoder_component(CAM_STATE *state) {
     // Get rid of any port buffers first
     if (state->video_encoder_pool) {
-        mmal_port_pool_destroy(state->video_encoder_component->output[0], state->video_encoder_pool);
+        uint32_t held = 0;
+
+        // the pipeline has released its buffers by now, what is left is held by FrameRefs of the application
+        for (int waited = 0; state->pipeline_stats && (held = pipeline_stats_held(state->pipeline_stats)) &&
+                             waited < FRAME_RELEASE_TIMEOUT; waited += 10)
+            vcos_sleep(10);
+
+        if (held) {
+            // the buffers go back to the pool queue of a pool that is never freed, rather than to a destroyed port
+            vcos_log_error("%s: %u frames still held, their buffers are not freed", __func__, held);
+            mmal_pool_callback_set(state->video_encoder_pool, nullptr, nullptr);
+        } else {
+            mmal_port_pool_destroy(state->video_encoder_component->output[0], state->video_encoder_pool);
+        }
+        state->video_encoder_pool = nullptr;
     }
 
     if (state->video_encoder_component) {
         mmal_component_destroy(state->video_encoder_component);
         state->video_encoder_component = nullptr;
+        state->video_encoder_output_port = nullptr;
     }
 }
 
@@ -1585,7 +1715,7 @@ void get_sensor_defaults(int camera_num, char *camera_name, uint32_t *width, uin
     strncpy(camera_name, "OV5647", MMAL_PARAMETER_CAMERA_INFO_MAX_STR_LEN);
 
     // Try to get the camera name and maximum supported resolution
-    status = mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA_INFO, &camera_info);
+    status = create_backend_component(CAM_COMPONENT_CAMERA_INFO, &camera_info);
     if (status == MMAL_SUCCESS) {
         MMAL_PARAMETER_CAMERA_INFO_T param;
         param.hdr.id = MMAL_PARAMETER_CAMERA_INFO;
@@ -1632,7 +1762,7 @@ void check_camera_model(int cam_num) {
     MMAL_STATUS_T status;
 
     // Try to get the camera name
-    status = mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA_INFO, &camera_info);
+    status = create_backend_component(CAM_COMPONENT_CAMERA_INFO, &camera_info);
     if (status == MMAL_SUCCESS) {
         MMAL_PARAMETER_CAMERA_INFO_T param;
         param.hdr.id = MMAL_PARAMETER_CAMERA_INFO;
@@ -1709,27 +1839,97 @@ uint64_t get_microseconds64() {
 }
 
 /**
- * Pause for specified time, but return early if detect an abort request
+ * Wait for a capture request, or until the time has passed.
+ * Pause and resume requests that do not change the capture state are ignored.
+ *
+ * @param state Pointer to state control struct
+ * @param timeout Time in ms to wait, VCOS_SUSPEND to wait for a request only
+ * @return The CAPTURE_EVENT_* that ended the wait, 0 if the time has passed
+ */
+static uint32_t wait_for_capture_event(CAM_STATE *state, uint32_t timeout) {
+    int64_t end_time = get_microseconds64() / 1000 + timeout;
+
+    for (;;) {
+        VCOS_UNSIGNED events = 0;
+
+        if (vcos_event_flags_get(&state->callback_data.capture_events, CAPTURE_EVENT_ALL, VCOS_OR_CONSUME,
+                                 timeout, &events) != VCOS_SUCCESS)
+            return 0;
+
+        if (events & (CAPTURE_EVENT_ABORT | CAPTURE_EVENT_STOP))
+            return events & (CAPTURE_EVENT_ABORT | CAPTURE_EVENT_STOP);
+        // the encoder pool is resized here, on the capture thread, and the wait goes on
+        if (events & CAPTURE_EVENT_POOL) {
+            MMAL_STATUS_T status = encoder_pool_apply(state);
+            if (status != MMAL_SUCCESS && status != MMAL_EAGAIN)
+                vcos_log_error("%s: encoder pool not resized", __func__);
+        }
+        if ((events & CAPTURE_EVENT_PAUSE) && state->bCapturing)
+            return CAPTURE_EVENT_PAUSE;
+        if ((events & CAPTURE_EVENT_RESUME) && !state->bCapturing)
+            return CAPTURE_EVENT_RESUME;
+
+        if (timeout != VCOS_SUSPEND) {
+            int64_t current_time = get_microseconds64() / 1000;
+            if (current_time >= end_time)
+                return 0;
+            timeout = (uint32_t) (end_time - current_time);
+        }
+    }
+}
+
+/**
+ * Pause for specified time, but return early if a capture request arrives
  *
  * @param state Pointer to state control struct
  * @param pause Time in ms to pause
- * @param callback Struct contain an abort flag tested for early termination
+ * @return The CAPTURE_EVENT_* that ended the pause, 0 if the time has passed
+ */
+static uint32_t pause_and_test_abort(CAM_STATE *state, int pause) {
+    // no pause for an unset (negative) time
+    if (pause <= 0)
+        return 0;
+
+    return wait_for_capture_event(state, (uint32_t) pause);
+}
+
+/**
+ * Abort the capture, as if an error occurred in the encoder callback
  *
+ * @param state Pointer to state control struct
  */
-static int pause_and_test_abort(CAM_STATE *state, int pause) {
-    int wait;
+void capture_request_abort(CAM_STATE *state) {
+    state->callback_data.abort = 1;
+    vcos_event_flags_set(&state->callback_data.capture_events, CAPTURE_EVENT_ABORT, VCOS_OR);
+}
 
-    if (!pause)
-        return 0;
+/**
+ * Make capture() return. Taken at once with WAIT_METHOD_NONE, TIMED and FOREVER; KEYPRESS and SIGNAL
+ * block on the keyboard and SIGUSR1 and do not see it.
+ *
+ * @param state Pointer to state control struct
+ */
+void capture_request_stop(CAM_STATE *state) {
+    vcos_event_flags_set(&state->callback_data.capture_events, CAPTURE_EVENT_STOP, VCOS_OR);
+}
 
-    // Going to check every ABORT_INTERVAL milliseconds
-    for (wait = 0; wait < pause; wait += ABORT_INTERVAL) {
-        vcos_sleep(ABORT_INTERVAL);
-        if (state->callback_data.abort)
-            return 1;
-    }
+/**
+ * Pause capturing, capture() keeps running until resumed or stopped. Honoured with WAIT_METHOD_TIMED (which
+ * then carries on with its off time) and FOREVER; WAIT_METHOD_NONE ignores it, KEYPRESS and SIGNAL do not see it.
+ *
+ * @param state Pointer to state control struct
+ */
+void capture_request_pause(CAM_STATE *state) {
+    vcos_event_flags_set(&state->callback_data.capture_events, CAPTURE_EVENT_PAUSE, VCOS_OR);
+}
 
-    return 0;
+/**
+ * Resume capturing after capture_request_pause(), with the same wait methods
+ *
+ * @param state Pointer to state control struct
+ */
+void capture_request_resume(CAM_STATE *state) {
+    vcos_event_flags_set(&state->callback_data.capture_events, CAPTURE_EVENT_RESUME, VCOS_OR);
 }
 
 /**
@@ -1792,6 +1992,176 @@ int zoom_in_zoom_out(MMAL_COMPONENT_T *camera, ZOOM_COMMAND_T zoom_command, PARA
     return ret;
 }
 
+/**
+ * Deliver a frame to the frame callback, or to the video callback if there is none.
+ * The buffer must be locked by the caller.
+ *
+ * @param state Pointer to the state data
+ * @param buffer Buffer header holding the frame
+ * @param pts Presentation time of the frame
+ */
+void deliver_frame(CAM_STATE *state, MMAL_BUFFER_HEADER_T *buffer, int64_t pts) {
+    PORT_USERDATA *pData = &state->callback_data;
+    uint64_t start = get_microseconds64();
+
+    if (state->latency_tracker)
+        latency_tracker_record(state->latency_tracker, LATENCY_STAGE_CALLBACK_ENTER, buffer->pts);
+
+    if (pData->frame_cb)
+        pData->frame_cb(FrameRef(buffer, pts));
+    else if (pData->video_cb)
+        pData->video_cb(pts, buffer->data, buffer->length, buffer->offset);
+
+    if (state->latency_tracker)
+        latency_tracker_record(state->latency_tracker, LATENCY_STAGE_CALLBACK_EXIT, buffer->pts);
+    if (state->pipeline_stats)
+        pipeline_stats_callback(state->pipeline_stats, get_microseconds64() - start);
+}
+
+/**
+ * Pass the inline motion vectors of a frame to the motion detector and the motion vector callback,
+ * straight from the encoder buffer.
+ * The buffer must be locked by the caller; the vectors are only valid during the callback.
+ *
+ * @param state Pointer to the state data
+ * @param buffer Side information buffer holding the vectors
+ */
+void deliver_motion_vectors(CAM_STATE *state, MMAL_BUFFER_HEADER_T *buffer) {
+    PORT_USERDATA *pData = &state->callback_data;
+    // the encoder adds one column per row
+    uint32_t columns = (state->common_settings.width + 15) / 16 + 1;
+    uint32_t rows = buffer->length / (columns * sizeof(CAM_MOTION_VECTOR));
+    const auto *vectors = (const CAM_MOTION_VECTOR *) (buffer->data + buffer->offset);
+    int64_t pts = buffer->pts;
+
+    if ((!pData->motion_cb && !state->motion_detector) || !rows)
+        return;
+
+    // same time base as the frames passed to the video callback
+    if (pts != MMAL_TIME_UNKNOWN)
+        pts -= state->starttime;
+
+    if (state->motion_detector)
+        motion_detector_process(state->motion_detector, pts, vectors, columns, rows);
+    if (pData->motion_cb)
+        pData->motion_cb(pts, vectors, columns, rows);
+}
+
+/**
+ * Pass an access unit from the assembler to the access unit callback, or to the video callback.
+ * Timestamps are made relative to the first frame, as for frames delivered by deliver_frame().
+ *
+ * @param state Pointer to the state data
+ * @param assembled Access unit with the encoder pts
+ */
+static void deliver_access_unit(CAM_STATE *state, const H264_ACCESS_UNIT *assembled) {
+    PORT_USERDATA *pData = &state->callback_data;
+    H264_ACCESS_UNIT unit = *assembled;
+
+    if (state->latency_tracker)
+        latency_tracker_record(state->latency_tracker, LATENCY_STAGE_ENCODER, assembled->pts);
+
+    if (unit.pts != MMAL_TIME_UNKNOWN) {
+        if (state->frame == 0)
+            state->starttime = unit.pts;
+        state->lasttime = unit.pts;
+        unit.pts -= state->starttime;
+    }
+    state->frame++;
+    if (state->pipeline_stats)
+        pipeline_stats_frame(state->pipeline_stats, 1);
+
+    if (state->mp4_muxer && mp4_muxer_write(state->mp4_muxer, &unit, state->segmentNumber) != MMAL_SUCCESS) {
+        vcos_log_error("Failed to write MP4 output - aborting");
+        capture_request_abort(state);
+    }
+
+    if (state->rtp_sender && rtp_sender_send(state->rtp_sender, &unit) != MMAL_SUCCESS) {
+        vcos_log_error("Failed to send RTP output - aborting");
+        capture_request_abort(state);
+    }
+
+    if (state->latency_tracker)
+        latency_tracker_record(state->latency_tracker, LATENCY_STAGE_CALLBACK_ENTER, assembled->pts);
+    uint64_t start = get_microseconds64();
+
+    if (pData->access_unit_cb)
+        pData->access_unit_cb(&unit);
+    else if (pData->video_cb)
+        pData->video_cb(unit.pts, unit.data, unit.length, 0);
+
+    if (state->latency_tracker)
+        latency_tracker_record(state->latency_tracker, LATENCY_STAGE_CALLBACK_EXIT, assembled->pts);
+    if (state->pipeline_stats)
+        pipeline_stats_callback(state->pipeline_stats, get_microseconds64() - start);
+}
+
+/**
+ * Copy the latest SPS and PPS of the stream, for a consumer that starts decoding in the middle of it.
+ * Needs assembleAccessUnits.
+ *
+ * @param state Pointer to the state data
+ * @param data Buffer to copy the parameter sets to, as Annex-B NAL units
+ * @param size Size of the buffer
+ * @return Number of bytes copied, 0 if they are not known yet or do not fit
+ */
+uint32_t get_parameter_sets(CAM_STATE *state, uint8_t *data, uint32_t size) {
+    if (!state->h264_assembler)
+        return 0;
+
+    return h264_assembler_parameter_sets(state->h264_assembler, data, size);
+}
+
+/**
+ * Take a reference on an encoded frame.
+ * Buffer memory is not locked: the encoder output pool is allocated in host memory.
+ *
+ * @param buffer Buffer header holding the frame
+ * @param pts Presentation time of the frame
+ */
+FrameRef::FrameRef(MMAL_BUFFER_HEADER_T *buffer, int64_t pts) : buffer_(buffer), pts_(pts) {
+    if (buffer_)
+        mmal_buffer_header_acquire(buffer_);
+}
+
+FrameRef::FrameRef(const FrameRef &other) : FrameRef(other.buffer_, other.pts_) {
+}
+
+FrameRef::FrameRef(FrameRef &&other) noexcept: buffer_(other.buffer_), pts_(other.pts_) {
+    other.buffer_ = nullptr;
+}
+
+FrameRef &FrameRef::operator=(FrameRef other) noexcept {
+    std::swap(buffer_, other.buffer_);
+    std::swap(pts_, other.pts_);
+    return *this;
+}
+
+FrameRef::~FrameRef() {
+    reset();
+}
+
+void FrameRef::reset() {
+    if (buffer_)
+        mmal_buffer_header_release(buffer_);
+    buffer_ = nullptr;
+}
+
+/**
+ * Forget the timing of a previous run, so a re-initialised pipeline starts its timeout,
+ * segments, time-lapse and frame timestamps afresh
+ *
+ * @param state Pointer to the state data
+ */
+static void reset_capture_timing(CAM_STATE *state) {
+    state->segmentStartTime = -1;
+    state->completeTime = -1;
+    state->nextFrameTime = -1;
+    state->frame = 0;
+    state->starttime = 0;
+    state->lasttime = 0;
+}
+
 /**
  * Function to wait in various ways (depending on settings)
  *
@@ -1801,41 +2171,44 @@ int zoom_in_zoom_out(MMAL_COMPONENT_T *camera, ZOOM_COMMAND_T zoom_command, PARA
  */
 int wait_for_next_change(CAM_STATE *state) {
     int keep_running = 1;
-    static int64_t complete_time = -1;
 
     // Have we actually exceeded our timeout?
     int64_t current_time = get_microseconds64() / 1000;
 
-    if (complete_time == -1)
-        complete_time = current_time + state->timeout;
+    if (state->completeTime == -1)
+        state->completeTime = current_time + state->timeout;
 
     // if we have run out of time, flag we need to exit
-    if (current_time >= complete_time && state->timeout != 0)
+    if (current_time >= state->completeTime && state->timeout != 0)
         keep_running = 0;
 
     switch (state->waitMethod) {
         case WAIT_METHOD_NONE:
-            (void) pause_and_test_abort(state, state->timeout);
+            // a single run for the timeout: only a stop or abort ends it early, pause and resume are ignored
+            while (current_time < state->completeTime) {
+                if (pause_and_test_abort(state, (int) (state->completeTime - current_time)) &
+                    (CAPTURE_EVENT_ABORT | CAPTURE_EVENT_STOP))
+                    break;
+                current_time = get_microseconds64() / 1000;
+            }
             return 0;
 
         case WAIT_METHOD_FOREVER: {
-            // We never return from this. Expect a ctrl-c to exit or abort.
-            while (!state->callback_data.abort)
-                // Have a sleep so we don't hog the CPU.
-                vcos_sleep(ABORT_INTERVAL);
+            // Block until stopped or aborted, toggling capture on pause/resume requests
+            uint32_t event = wait_for_capture_event(state, VCOS_SUSPEND);
 
-            return 0;
+            return (event & (CAPTURE_EVENT_PAUSE | CAPTURE_EVENT_RESUME)) ? 1 : 0;
         }
 
         case WAIT_METHOD_TIMED: {
-            int abort;
+            uint32_t event;
 
             if (state->bCapturing)
-                abort = pause_and_test_abort(state, state->onTime);
+                event = pause_and_test_abort(state, state->onTime);
             else
-                abort = pause_and_test_abort(state, state->offTime);
+                event = pause_and_test_abort(state, state->offTime);
 
-            if (abort)
+            if (event & (CAPTURE_EVENT_ABORT | CAPTURE_EVENT_STOP))
                 return 0;
             else
                 return keep_running;
@@ -1901,13 +2274,12 @@ int wait_for_next_change(CAM_STATE *state) {
 }
 
 /**
- * Start capturing video.
- * @param state
+ * Send all the buffers of the video encoder pool to the encoder output port
+ *
+ * @param state Pointer to the state data
+ * @return MMAL_SUCCESS if all OK, MMAL_ENOSPC otherwise
  */
-MMAL_STATUS_T capture(CAM_STATE *state) {
-    int running = 1;
-    MMAL_STATUS_T status;
-
+MMAL_STATUS_T send_encoder_buffers(CAM_STATE *state) {
     int num = mmal_queue_length(state->video_encoder_pool->queue);
     int q;
     for (q = 0; q < num; q++) {
@@ -1924,8 +2296,30 @@ MMAL_STATUS_T capture(CAM_STATE *state) {
         }
     }
 
+    return MMAL_SUCCESS;
+}
+
+/**
+ * Start capturing video.
+ * @param state
+ */
+MMAL_STATUS_T capture(CAM_STATE *state) {
+    int running = 1;
+    MMAL_STATUS_T status;
+
+    if ((status = send_encoder_buffers(state)) != MMAL_SUCCESS) {
+        return status;
+    }
+
+    // map the STC afresh, frames are timed from now on
+    if (state->latency_tracker)
+        latency_tracker_sync(state->latency_tracker);
+
     int initialCapturing = state->bCapturing;
     while (running) {
+        // a resize asked for while waiting without capture events (keypress, signal)
+        encoder_pool_apply(state);
+
         // Change state
         state->bCapturing = !state->bCapturing;
 
@@ -1952,6 +2346,8 @@ MMAL_STATUS_T capture(CAM_STATE *state) {
         // by default, will wait for timeout to have expired
         running = wait_for_next_change(state);
     }
+
+    return MMAL_SUCCESS;
 }
 
 /**
@@ -1962,17 +2358,16 @@ MMAL_STATUS_T capture(CAM_STATE *state) {
  * @return !0 if to continue, 0 if reached end of run
  */
 int wait_for_next_frame(CAM_STATE *state, int *frame) {
-    static int64_t complete_time = -1;
     int keep_running = 1;
 
     int64_t current_time = get_microseconds64() / 1000;
 
-    if (complete_time == -1)
-        complete_time = current_time + state->timeout;
+    if (state->completeTime == -1)
+        state->completeTime = current_time + state->timeout;
 
     // if we have run out of time, flag we need to exit
     // If timeout = 0 then always continue
-    if (current_time >= complete_time && state->timeout != 0)
+    if (current_time >= state->completeTime && state->timeout != 0)
         keep_running = 0;
 
     switch (state->frameNextMethod) {
@@ -1992,27 +2387,25 @@ int wait_for_next_frame(CAM_STATE *state, int *frame) {
         }
 
         case FRAME_NEXT_TIMELAPSE : {
-            static int64_t next_frame_ms = -1;
-
             // Always need to increment by at least one, may add a skip later
             *frame += 1;
 
-            if (next_frame_ms == -1) {
+            if (state->nextFrameTime == -1) {
                 vcos_sleep(CAMERA_SETTLE_TIME);
 
                 // Update our current time after the sleep
                 current_time = get_microseconds64() / 1000;
 
                 // Set our initial 'next frame time'
-                next_frame_ms = current_time + state->timelapse;
+                state->nextFrameTime = current_time + state->timelapse;
             } else {
-                int64_t this_delay_ms = next_frame_ms - current_time;
+                int64_t this_delay_ms = state->nextFrameTime - current_time;
 
                 if (this_delay_ms < 0) {
                     // We are already past the next exposure time
                     if (-this_delay_ms < state->timelapse / 2) {
                         // Less than a half frame late, take a frame and hope to catch up next time
-                        next_frame_ms += state->timelapse;
+                        state->nextFrameTime += state->timelapse;
                         vcos_log_info("Frame %d is %d ms late", *frame, (int) (-this_delay_ms));
                     } else {
                         int nskip = 1 + (-this_delay_ms) / state->timelapse;
@@ -2020,11 +2413,11 @@ int wait_for_next_frame(CAM_STATE *state, int *frame) {
                         *frame += nskip;
                         this_delay_ms += nskip * state->timelapse;
                         vcos_sleep(this_delay_ms);
-                        next_frame_ms += (nskip + 1) * state->timelapse;
+                        state->nextFrameTime += (nskip + 1) * state->timelapse;
                     }
                 } else {
                     vcos_sleep(this_delay_ms);
-                    next_frame_ms += state->timelapse;
+                    state->nextFrameTime += state->timelapse;
                 }
             }
 
@@ -2112,18 +2505,18 @@ int wait_for_next_frame(CAM_STATE *state, int *frame) {
 }
 
 /**
- * TODO
- * @param state
- * @return
+ * Capture loop for stills, the callbacks must have been set in the callback data
+ *
+ * @param state Pointer to state control struct
+ * @return MMAL_SUCCESS if all OK, something else otherwise
  */
-MMAL_STATUS_T capture_still(CAM_STATE *state, StillCallback still_cb) {
+static MMAL_STATUS_T capture_still_frames(CAM_STATE *state) {
     int frame, keep_looping = 1;
-    MMAL_STATUS_T status;
+    MMAL_STATUS_T status = MMAL_SUCCESS;
 
     // Set up our userdata - this is passed though to the callback where we need the information.
     // Null until we open our filename
     state->callback_data.pstate = state;
-    state->callback_data.still_cb = std::move(still_cb);
 
     // create the semaphore to indicate successful frame handling (the semaphore is
     // completed in the encoder buffer callback)
@@ -2167,6 +2560,12 @@ MMAL_STATUS_T capture_still(CAM_STATE *state, StillCallback still_cb) {
                                                 state->camera_parameters.shutter_speed)) != MMAL_SUCCESS)
                 vcos_log_error("Unable to set shutter speed");
 
+            // Start a new image, it takes its memory from the still image pool
+            state->callback_data.still_image = StillImage(state->still_image_pool);
+            state->callback_data.still_chunks.reset();
+            state->callback_data.still_chunks_overflow = 0;
+            state->callback_data.port_buffers = 0;
+
             // Enable the encoder output port
             state->still_encoder_output_port->userdata = (struct MMAL_PORT_USERDATA_T *) &state->callback_data;
 
@@ -2187,6 +2586,8 @@ MMAL_STATUS_T capture_still(CAM_STATE *state, StillCallback still_cb) {
 
                 if (mmal_port_send_buffer(state->still_encoder_output_port, buffer) != MMAL_SUCCESS)
                     vcos_log_error("Unable to send a buffer to encoder output port (%d)", q);
+                else
+                    state->callback_data.port_buffers++;
             }
 
             if (state->burstCaptureMode) {
@@ -2215,6 +2616,50 @@ MMAL_STATUS_T capture_still(CAM_STATE *state, StillCallback still_cb) {
     } // end for (frame)
 
     vcos_semaphore_delete(&state->callback_data.complete_semaphore);
+    return status;
+}
+
+/**
+ * Capture stills, passing each image to the callback as a pointer and length.
+ * The data is only valid during the callback, its memory is reused by the next capture.
+ *
+ * @param state Pointer to state control struct
+ * @param still_cb Callback receiving each image
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T capture_still(CAM_STATE *state, StillCallback still_cb) {
+    return capture_still_image(state, [still_cb](StillImage image) {
+        still_cb(image.data(), (uint32_t) image.length());
+    });
+}
+
+/**
+ * Capture stills, handing ownership of each image to the callback.
+ * Memory of images that have been released is reused by the following captures.
+ *
+ * @param state Pointer to state control struct
+ * @param still_cb Callback receiving each image
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T capture_still_image(CAM_STATE *state, StillImageCallback still_cb) {
+    state->callback_data.still_cb = std::move(still_cb);
+    state->callback_data.still_chunks_cb = nullptr;
+    return capture_still_frames(state);
+}
+
+/**
+ * Capture stills, passing each image as the list of encoder buffers it was delivered in.
+ * The buffers go back to the encoder once the chunks are destroyed; the still encoder needs
+ * enough output buffers to hold a whole image (stillChunkBuffers), images that do not fit are dropped.
+ *
+ * @param state Pointer to state control struct
+ * @param still_chunks_cb Callback receiving each image
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T capture_still_chunks(CAM_STATE *state, StillChunksCallback still_chunks_cb) {
+    state->callback_data.still_cb = nullptr;
+    state->callback_data.still_chunks_cb = std::move(still_chunks_cb);
+    return capture_still_frames(state);
 }
 
 /**
@@ -2229,12 +2674,41 @@ MMAL_STATUS_T capture_still(CAM_STATE *state, StillCallback still_cb) {
 MMAL_STATUS_T init(CAM_STATE *state) {
     MMAL_STATUS_T status;
 
+    get_backend()->host_init();
+    reset_capture_timing(state);
+
+    // capture() blocks on these until a request arrives
+    if (vcos_event_flags_create(&state->callback_data.capture_events, "cam-capture") != VCOS_SUCCESS) {
+        vcos_log_error("%s: failed to create capture events", __func__);
+        return MMAL_ENOMEM;
+    }
+    if (vcos_mutex_create(&state->encoder_control_lock, "cam-encoder-control") != VCOS_SUCCESS) {
+        vcos_log_error("%s: failed to create the encoder control lock", __func__);
+        vcos_event_flags_delete(&state->callback_data.capture_events);
+        return MMAL_ENOMEM;
+    }
+
     // Setup for sensor specific parameters, only set W/H settings if zero on entry
     get_sensor_defaults(state->common_settings.cameraNum, state->common_settings.camera_name,
                         &state->common_settings.width, &state->common_settings.height);
 
     check_camera_model(state->common_settings.cameraNum);
 
+    // the motion detector works on the inline motion vectors
+    if (state->motionDetection)
+        state->inlineMotionVectors = 1;
+    // the MP4 muxer and the RTP sender work on complete access units
+    if (state->mp4Mux || state->rtpDestination)
+        state->assembleAccessUnits = 1;
+    if (state->assembleAccessUnits && state->encoding != MMAL_ENCODING_H264) { // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+        vcos_log_error("%s: access units, MP4 and RTP need encoding = MMAL_ENCODING_H264", __func__);
+        return MMAL_EINVAL;
+    }
+
+    // before the encoder pool, whose release callback counts in it
+    if ((status = pipeline_stats_create(state)) != MMAL_SUCCESS) {
+        return status;
+    }
     if ((status = create_camera_component(state)) != MMAL_SUCCESS) {
         return status;
     }
@@ -2247,12 +2721,72 @@ MMAL_STATUS_T init(CAM_STATE *state) {
     state->video_encoder_input_port = state->video_encoder_component->input[0];
     state->video_encoder_output_port = state->video_encoder_component->output[0];
 
-    // connect the camera's video port to the video_encoder's input port
-    status = connect_ports(state->camera_video_port, state->video_encoder_input_port, &state->video_encoder_connection);
+    // insert the splitter for the raw and analysis frames, if any
+    if ((status = raw_frame_tap_create(state)) != MMAL_SUCCESS) {
+        return status;
+    }
+
+    // connect the camera's video port (or the splitter) to the video_encoder's input port
+    status = connect_ports(raw_frame_tap_encoder_port(state), state->video_encoder_input_port,
+                           &state->video_encoder_connection);
     if (status != MMAL_SUCCESS) {
         return status;
     }
 
+    if ((status = frame_queue_create(state)) != MMAL_SUCCESS) {
+        return status;
+    }
+    if ((status = circular_buffer_create(state)) != MMAL_SUCCESS) {
+        return status;
+    }
+    if ((status = keyframe_index_create(state)) != MMAL_SUCCESS) {
+        return status;
+    }
+    if (state->assembleAccessUnits && !state->h264_assembler) {
+        if (state->frameQueueSize || state->callback_data.frame_cb) {
+            vcos_log_error("%s: assembled access units are not delivered as frames", __func__);
+            return MMAL_EINVAL;
+        }
+        state->h264_assembler = h264_assembler_create([state](const H264_ACCESS_UNIT *unit) {
+            deliver_access_unit(state, unit);
+        });
+        if (!state->h264_assembler)
+            return MMAL_ENOMEM;
+    }
+    if ((status = segment_writer_create(state)) != MMAL_SUCCESS) {
+        return status;
+    }
+    if ((status = mjpeg_server_create(state)) != MMAL_SUCCESS) {
+        return status;
+    }
+    if (state->mp4Mux && !state->mp4_muxer) {
+        state->mp4_muxer = mp4_muxer_create(state->common_settings.width, state->common_settings.height,
+                                            state->mp4FragmentDuration, state->common_settings.filename,
+                                            state->callback_data.mp4_sink_cb);
+        if (!state->mp4_muxer)
+            return MMAL_EINVAL;
+    }
+    if (state->rtpDestination && !state->rtp_sender) {
+        state->rtp_sender = rtp_sender_create(state->rtpDestination, state->rtpMtu, state->rtpPayloadType);
+        if (!state->rtp_sender)
+            return MMAL_EIO;
+    }
+    if (state->latencyStats && !state->latency_tracker) {
+        state->latency_tracker = latency_tracker_create(state->camera_component);
+        if (!state->latency_tracker)
+            return MMAL_ENOSYS;
+    }
+    if (state->motionDetection && !state->motion_detector) {
+        state->motion_detector = motion_detector_create(&state->motionParameters, state->callback_data.motion_event_cb);
+        if (!state->motion_detector)
+            return MMAL_ENOMEM;
+    }
+
+    // the encoder pool bounds and sizes are known once the output port is set up
+    if ((status = encoder_pool_adapter_create(state)) != MMAL_SUCCESS) {
+        return status;
+    }
+
     // Set up our userdata - this is passed though to the callback where we need the information.
     (state->video_encoder_output_port)->userdata = (struct MMAL_PORT_USERDATA_T *) &state->callback_data;
     // Enable the encoder output port and tell it its callback function
@@ -2262,6 +2796,11 @@ MMAL_STATUS_T init(CAM_STATE *state) {
         return status;
     }
 
+    // steers the bitrate of the running encoder from here on
+    if ((status = rate_controller_create(state)) != MMAL_SUCCESS) {
+        return status;
+    }
+
     return MMAL_SUCCESS;
 }
 
@@ -2273,7 +2812,8 @@ MMAL_STATUS_T init(CAM_STATE *state) {
 MMAL_STATUS_T init_still(CAM_STATE *state) {
     MMAL_STATUS_T status;
 
-    bcm_host_init();
+    get_backend()->host_init();
+    reset_capture_timing(state);
 
     // Setup for sensor specific parameters
     get_sensor_defaults(state->common_settings.cameraNum, state->common_settings.camera_name,
@@ -2300,12 +2840,6 @@ MMAL_STATUS_T init_still(CAM_STATE *state) {
         return status;
     }
 
-    PORT_USERDATA callback_data;
-    callback_data.image_data = nullptr;
-    callback_data.image_data_length = 0;
-    callback_data.image_data = nullptr;
-    callback_data.image_data_length = 0;
-
     if (state->common_settings.verbose)
         vcos_log_info("Starting component connection stage\n");
 
@@ -2348,11 +2882,34 @@ MMAL_STATUS_T init_still(CAM_STATE *state) {
  * @param video_encoder_output_port
  */
 void destroy(CAM_STATE *state) {
+    /* stop changing the encoder settings, and reading the pools that are about to go */
+    rate_controller_destroy(state);
+    pipeline_stats_stop_export(state);
     /* disable ports that are not handled by connections */
     check_disable_port(state->video_encoder_output_port);
+    /* release frames still waiting for delivery */
+    frame_queue_destroy(state);
+    circular_buffer_destroy(state);
+    keyframe_index_destroy(state);
+    motion_detector_destroy(state->motion_detector);
+    state->motion_detector = nullptr;
+    mjpeg_server_destroy(state);
+    segment_writer_destroy(state);
+    /* writes the last MP4 fragment */
+    mp4_muxer_destroy(state->mp4_muxer);
+    state->mp4_muxer = nullptr;
+    rtp_sender_destroy(state->rtp_sender);
+    state->rtp_sender = nullptr;
+    h264_assembler_destroy(state->h264_assembler);
+    state->h264_assembler = nullptr;
+    latency_tracker_destroy(state->latency_tracker);
+    state->latency_tracker = nullptr;
+    encoder_pool_adapter_destroy(state);
     /* destroy connections */
     if (state->video_encoder_connection)
         mmal_connection_destroy(state->video_encoder_connection);
+    state->video_encoder_connection = nullptr;
+    raw_frame_tap_destroy(state);
     /* disable components */
     if (state->video_encoder_component)
         mmal_component_disable(state->video_encoder_component);
@@ -2361,6 +2918,9 @@ void destroy(CAM_STATE *state) {
     /* destroy components */
     destroy_encoder_component(state);
     destroy_camera_component(state);
+    pipeline_stats_destroy(state);
+    vcos_mutex_delete(&state->encoder_control_lock);
+    vcos_event_flags_delete(&state->callback_data.capture_events);
 }
 
 /**
@@ -2372,13 +2932,6 @@ void destroy(CAM_STATE *state) {
  * @param buffer mmal buffer header pointer
  */
 void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
-    MMAL_BUFFER_HEADER_T *new_buffer;
-    static int64_t base_time = -1;
-
-    // All our segment times based on the receipt of the first encoder callback
-    if (base_time == -1)
-        base_time = get_microseconds64() / 1000;
-
     // We pass our file handle and other stuff in via the userdata field.
     auto *pData = (PORT_USERDATA *) port->userdata;
 
@@ -2386,12 +2939,26 @@ void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
         int bytes_written = buffer->length;
         int64_t current_time = get_microseconds64() / 1000;
 
-        if ((buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG) &&
-            // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
-            ((pData->pstate->segmentSize && current_time > base_time + pData->pstate->segmentSize) ||
+        // motion vectors are held like any buffer, but are not part of the stream throughput
+        if (pData->pstate->pipeline_stats)
+            pipeline_stats_buffer(pData->pstate->pipeline_stats,
+                                  buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO ? 0 : buffer->length); // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+        if (pData->pstate->encoder_pool_adapter)
+            encoder_pool_observe(pData->pstate, buffer);
+
+        // All our segment times based on the receipt of the first encoder callback
+        if (pData->pstate->segmentStartTime == -1)
+            pData->pstate->segmentStartTime = current_time;
+
+        // segments start at the inline headers, or at a keyframe when there are none
+        if (((buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG) || // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+             (!pData->pstate->bInlineHeaders && (buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME) && // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+              !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO))) && // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+            ((pData->pstate->segmentSize &&
+              current_time > pData->pstate->segmentStartTime + pData->pstate->segmentSize) ||
              (pData->pstate->splitWait && pData->pstate->splitNow))) {
-            // increase segment??
-            base_time = current_time;
+            // move on to the next segment, the segment writer and MP4 muxer start a new file here
+            pData->pstate->segmentStartTime = current_time;
             pData->pstate->splitNow = 0;
             pData->pstate->segmentNumber++;
             // Only wrap if we have a wrap point set
@@ -2407,13 +2974,28 @@ void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
             if (buffer->flags &
                 MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO) { // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
                 if (pData->pstate->inlineMotionVectors) {
-                    vcos_log_info("*** IMV of length %i\n", buffer->length);
+                    deliver_motion_vectors(pData->pstate, buffer);
                 } else {
                     bytes_written = buffer->length;
                 }
             } else {
-                /* a frame has ended */
-                if ((buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END || buffer->flags == 0 ||
+                // keep the recent video in memory, this also updates the keyframe index
+                if (pData->pstate->circular_buffer)
+                    circular_buffer_write(pData->pstate, buffer);
+                else if (pData->pstate->keyframe_index)
+                    keyframe_index_update(pData->pstate->keyframe_index, buffer);
+
+                if (pData->pstate->segment_writer)
+                    segment_writer_write(pData->pstate, buffer);
+                if (pData->pstate->mjpeg_server)
+                    mjpeg_server_push(pData->pstate, buffer);
+
+                if (pData->pstate->h264_assembler) {
+                    // the assembler finds the frame boundaries in the stream itself
+                    h264_assembler_push(pData->pstate->h264_assembler, buffer->data + buffer->offset, buffer->length,
+                                        buffer->pts, !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG) &&
+                                                     (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)); // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+                } else if (/* a frame has ended */ (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END || buffer->flags == 0 ||
                      // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
                      /* is a keyframe (i.e., standalone) */
                      buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME) &&
@@ -2429,11 +3011,23 @@ void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
                         pData->pstate->lasttime = buffer->pts;
                         pts = buffer->pts - pData->pstate->starttime;
 
-                        // callback to handle frame data
-                        pData->video_cb(pts, buffer->data, buffer->length, buffer->offset);
+                        if (pData->pstate->latency_tracker)
+                            latency_tracker_record(pData->pstate->latency_tracker, LATENCY_STAGE_ENCODER,
+                                                   buffer->pts);
+
+                        // callback to handle frame data, or hand it to the consumer thread
+                        if (pData->pstate->frame_queue)
+                            frame_queue_push(pData->pstate, buffer, pts);
+                        else
+                            deliver_frame(pData->pstate, buffer, pts);
 
                         // increase frame count
                         pData->pstate->frame++;
+                        if (pData->pstate->pipeline_stats)
+                            pipeline_stats_frame(pData->pstate->pipeline_stats, 1);
+                    } else if (pData->pstate->pipeline_stats) {
+                        // no timestamp, or the same as the previous frame
+                        pipeline_stats_frame(pData->pstate->pipeline_stats, 0);
                     }
                 }
             }
@@ -2442,28 +3036,16 @@ void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
 
             if (bytes_written != buffer->length) {
                 vcos_log_error("Failed to write buffer data (%d from %d)- aborting", bytes_written, buffer->length);
-                pData->abort = 1;
+                capture_request_abort(pData->pstate);
             }
         }
     } else {
         vcos_log_error("Received a encoder buffer callback with no state");
     }
 
-    // release buffer back to the pool
+    // release our reference, the pool callback sends the buffer back to the port (if still open)
+    // once the frame queue and frame callback are done with it
     mmal_buffer_header_release(buffer);
-
-    // and send one back to the port (if still open)
-    if (port->is_enabled) {
-        MMAL_STATUS_T status;
-
-        new_buffer = mmal_queue_get(pData->pstate->video_encoder_pool->queue);
-
-        if (new_buffer)
-            status = mmal_port_send_buffer(port, new_buffer);
-
-        if (!new_buffer || status != MMAL_SUCCESS)
-            vcos_log_error("Unable to return a buffer to the encoder port\n");
-    }
 }
 
 /**
@@ -2482,28 +3064,26 @@ void still_encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buff
     if (pData) {
         int bytes_written = buffer->length;
 
+        pData->port_buffers--;
+
         if (buffer->length) {
             mmal_buffer_header_mem_lock(buffer);
 
-            if (pData->image_data == nullptr) {
-                // start a new image
-                pData->image_data = (uint8_t *) malloc(sizeof(uint8_t) * buffer->length);
-                memcpy(pData->image_data, buffer->data, buffer->length);
-                pData->image_data_length = buffer->length;
-            } else {
-                // continue building the current image
-                pData->image_data = (uint8_t *) realloc(pData->image_data,
-                                                        sizeof(uint8_t) * (buffer->length + pData->image_data_length));
-                memcpy(&(pData->image_data)[pData->image_data_length], buffer->data, buffer->length);
-                pData->image_data_length = buffer->length + pData->image_data_length;
+            if (pData->still_chunks_cb) {
+                // keep the buffer itself, it is released once the application is done with the image
+                if (!pData->still_chunks_overflow)
+                    pData->still_chunks.add(buffer);
+            } else if (!pData->still_image.append(buffer->data + buffer->offset, buffer->length)) {
+                // add to the image, its memory comes from the still image pool
+                bytes_written = 0;
             }
 
             mmal_buffer_header_mem_unlock(buffer);
         }
 
-        // We need to check we wrote what we wanted - it's possible we have run out of storage.
+        // We need to check we wrote what we wanted - it's possible we have run out of memory.
         if (bytes_written != buffer->length) {
-            vcos_log_error("Unable to write buffer to file - aborting");
+            vcos_log_error("Unable to add buffer to the still image - aborting");
             complete = 1;
         }
 
@@ -2527,15 +3107,40 @@ void still_encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buff
 
         if (new_buffer) {
             status = mmal_port_send_buffer(port, new_buffer);
+            if (status == MMAL_SUCCESS)
+                pData->port_buffers++;
         }
-        if (!new_buffer || status != MMAL_SUCCESS)
+        // buffers held by still chunks are not in the pool, running out of them is handled below
+        if ((!new_buffer && !pData->still_chunks_cb) || status != MMAL_SUCCESS)
             vcos_log_error("Unable to return a buffer to the encoder port");
+
+        // every buffer is held by the image: the encoder would stall, drop the image and let it finish
+        if (pData->still_chunks_cb && !complete && !pData->port_buffers) {
+            vcos_log_error("Still image does not fit in %u encoder buffers, increase stillChunkBuffers",
+                           pData->pstate->encoder_pool->headers_num);
+            pData->still_chunks_overflow = 1;
+            pData->still_chunks.reset();
+
+            while ((new_buffer = mmal_queue_get(pData->pstate->encoder_pool->queue))) {
+                if (mmal_port_send_buffer(port, new_buffer) != MMAL_SUCCESS) {
+                    mmal_queue_put_back(pData->pstate->encoder_pool->queue, new_buffer);
+                    break;
+                }
+                pData->port_buffers++;
+            }
+        }
     }
 
     if (complete) {
-        if (pData->still_cb) {
-            // call the callback with the completed image
-            pData->still_cb(pData->image_data, pData->image_data_length);
+        if (pData->still_chunks_cb) {
+            // hand the buffers of the image to the callback, unless it had to be dropped
+            if (!pData->still_chunks_overflow)
+                pData->still_chunks_cb(std::move(pData->still_chunks));
+            pData->still_chunks.reset();
+        } else if (pData->still_cb) {
+            // hand the completed image to the callback, the next capture starts a new one
+            pData->still_cb(std::move(pData->still_image));
+            pData->still_image.reset();
         } else {
             vcos_log_error("no still callback specified");
         }
@@ -2574,4 +3179,10 @@ void destroy_still(CAM_STATE *state) {
     destroy_encoder_component(state);
     preview_destroy(&state->preview_parameters);
     destroy_camera_component(state);
+
+    // images still held by the application keep their memory until released
+    state->callback_data.still_image.reset();
+    state->callback_data.still_chunks.reset();
+    still_image_pool_destroy(state->still_image_pool);
+    state->still_image_pool = nullptr;
 }
@@ -3,6 +3,7 @@
 //
 
 #include <functional>
+#include <vector>
 #include <cstdio>
 #include <cstdbool>
 #include <cstdlib>
@@ -10,6 +11,7 @@
 #include <endian.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sysexits.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -51,12 +53,14 @@ extern "C" {
 
 // Max bitrate we allow for recording
 #define MAX_BITRATE_MJPEG 25000000 // 25Mbits/s
+#define MJPEG_FRAME_CHUNKS 4 // Encoder buffers a frame streamed by the MJPEG server may span
+#define MJPEG_SERVER_FRAMES 4 // Frames the MJPEG server holds: assembling, pending, sent and the one before
+#define MJPEG_SERVER_BUFFERS (MJPEG_SERVER_FRAMES * MJPEG_FRAME_CHUNKS) // Extra encoder buffers for the MJPEG server
+#define RAW_FRAME_BUFFERS 3 // Minimum buffers of the raw frame tap, frames held by raw_frame_cb included
+#define FRAME_RELEASE_TIMEOUT 1000 // ms destroy() waits for the encoder and raw frame buffers still held by FrameRefs
 #define MAX_BITRATE_LEVEL4 25000000 // 25Mbits/s
 #define MAX_BITRATE_LEVEL42 62500000 // 62.5Mbits/s
 
-/// Interval at which we check for an failure abort during capture
-#define ABORT_INTERVAL 100 // ms
-
 #define zoom_full_16P16 ((unsigned int)(65536 * 0.15))
 #define zoom_increment_16P16 (65536UL / 10)
 
@@ -85,6 +89,33 @@ typedef enum {
 
 typedef struct CAM_STATE_S CAM_STATE;
 
+/// Component roles which a backend has to be able to create
+typedef enum {
+    CAM_COMPONENT_CAMERA,
+    CAM_COMPONENT_CAMERA_INFO,
+    CAM_COMPONENT_VIDEO_ENCODER,
+    CAM_COMPONENT_IMAGE_ENCODER,
+    CAM_COMPONENT_VIDEO_RENDERER,
+    CAM_COMPONENT_NULL_SINK,
+    CAM_COMPONENT_SPLITTER,
+    CAM_COMPONENT_ISP
+} CAM_COMPONENT_TYPE_T;
+
+/** Platform backend used to create the MMAL components of a pipeline.
+ *  The VideoCore backend creates the firmware components, the emulated backend creates host
+ *  components that produce synthetic frames so the pipeline can run without a camera.
+ */
+typedef struct cam_backend_s {
+    const char *name;                   /// Name of the backend, for logging
+    void (*host_init)(void);            /// One-off platform initialisation (may be called more than once)
+    MMAL_STATUS_T (*component_create)(CAM_COMPONENT_TYPE_T type, MMAL_COMPONENT_T **component);
+} CAM_BACKEND;
+
+/// Backend creating the VideoCore firmware components (the default on the Pi)
+extern const CAM_BACKEND mmal_backend;
+/// Backend creating emulated host components (the default for CAM_HOST_BUILD)
+extern const CAM_BACKEND emulated_backend;
+
 // There isn't actually a MMAL structure for the following, so make one
 typedef struct mmal_param_colourfx_s {
     int enable;       /// Turn colourFX on or off
@@ -119,25 +150,354 @@ typedef struct mmal_param_thumbnail_config_s {
 typedef std::function<void(int64_t timestamp, uint8_t *data, uint32_t length, uint32_t offset)> VideoCallback;
 typedef std::function<void(uint8_t *data, uint32_t length)> StillCallback;
 
+/** Reference counted handle to an encoded frame.
+ *  The frame stays in its MMAL buffer for as long as a FrameRef refers to it, so it can be kept
+ *  and moved across threads without copying. The buffer goes back to the encoder once the last
+ *  reference is gone, so frames should not be held for longer than needed (see extraFrameBuffers).
+ *  Every FrameRef must be released before destroy(): it waits FRAME_RELEASE_TIMEOUT for them, and
+ *  leaves the buffers of frames held beyond that allocated rather than free them under the holder.
+ */
+class FrameRef {
+public:
+    FrameRef() = default;
+
+    FrameRef(MMAL_BUFFER_HEADER_T *buffer, int64_t pts);
+
+    FrameRef(const FrameRef &other);
+
+    FrameRef(FrameRef &&other) noexcept;
+
+    FrameRef &operator=(FrameRef other) noexcept;
+
+    ~FrameRef();
+
+    /// Drop the reference, the frame must not be accessed afterwards
+    void reset();
+
+    uint8_t *data() const { return buffer_ ? buffer_->data + buffer_->offset : nullptr; }
+
+    uint32_t length() const { return buffer_ ? buffer_->length : 0; }
+
+    int64_t pts() const { return pts_; }
+
+    uint32_t flags() const { return buffer_ ? buffer_->flags : 0; }
+
+    bool keyframe() const {
+        return (flags() & MMAL_BUFFER_HEADER_FLAG_KEYFRAME) != 0; // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+    }
+
+    MMAL_BUFFER_HEADER_T *buffer() const { return buffer_; }
+
+    explicit operator bool() const { return buffer_ != nullptr; }
+
+private:
+    MMAL_BUFFER_HEADER_T *buffer_ = nullptr;
+    int64_t pts_ = 0;
+};
+
+typedef std::function<void(FrameRef frame)> FrameCallback;
+
+/// Layout of the frames delivered by the raw frame taps
+typedef struct {
+    MMAL_FOURCC_T encoding;     /// MMAL_ENCODING_I420, MMAL_ENCODING_RGB24 or MMAL_ENCODING_BGR24
+    uint32_t width;             /// Visible width in pixels
+    uint32_t height;            /// Visible height in pixels
+    uint32_t stride;            /// Bytes per row (of the Y plane for I420, the U and V planes have half)
+    uint32_t slice_height;      /// Rows per plane: for I420 the U plane starts at stride * slice_height
+} RAW_FRAME_FORMAT;
+
+/// Receives the uncompressed frames of a raw frame tap; the frame stays in the port buffer while it is held
+typedef std::function<void(FrameRef frame, const RAW_FRAME_FORMAT *format)> RawFrameCallback;
+
+/// Motion vector of one macroblock, as output by the H264 encoder with inlineMotionVectors
+typedef struct {
+    int8_t x;                   /// Horizontal motion, in pixels
+    int8_t y;                   /// Vertical motion, in pixels
+    uint16_t sad;               /// Sum of absolute differences of the macroblock with its reference
+} CAM_MOTION_VECTOR;
+
+/// Receives the motion vectors of a frame: rows of columns macroblocks (the last column of each row is padding)
+typedef std::function<void(int64_t timestamp, const CAM_MOTION_VECTOR *vectors, uint32_t columns,
+                           uint32_t rows)> MotionVectorCallback;
+
+/// Motion detection settings, see motion_detector_process()
+typedef struct {
+    uint32_t magnitude_threshold;   /// Minimum length (pixels) of the vector of an active macroblock
+    uint32_t sad_threshold;         /// Minimum SAD of an active macroblock
+    uint32_t min_blocks;            /// Macroblocks with motion for a frame to count as a motion frame
+    uint32_t start_frames;          /// Consecutive motion frames before motion starts
+    uint32_t stop_frames;           /// Consecutive frames without motion before motion stops
+    const uint8_t *mask;            /// Region mask, one byte per macroblock without the padding column, !0 to analyse. nullptr for the whole frame
+} MOTION_DETECT_PARAMETERS;
+
+typedef enum {
+    MOTION_EVENT_START,
+    MOTION_EVENT_STOP
+} MOTION_EVENT_T;
+
+typedef struct motion_detector_s MOTION_DETECTOR;
+
+/// Receives motion start and stop events, with the macroblocks with motion in the frame that raised it
+typedef std::function<void(MOTION_EVENT_T event, int64_t timestamp, uint32_t blocks)> MotionEventCallback;
+
+/// H264 NAL unit types (nal_unit_type) of interest
+typedef enum {
+    H264_NAL_SLICE = 1,         /// Slice of a non-IDR picture
+    H264_NAL_IDR = 5,           /// Slice of an IDR picture
+    H264_NAL_SEI = 6,
+    H264_NAL_SPS = 7,
+    H264_NAL_PPS = 8,
+    H264_NAL_AUD = 9
+} H264_NAL_TYPE_T;
+
+/// NAL unit within an access unit
+typedef struct {
+    uint32_t offset;            /// Start of the NAL unit in the access unit, at its start code
+    uint32_t length;            /// Length including the start code
+    uint8_t type;               /// nal_unit_type, see H264_NAL_TYPE_T
+} H264_NAL_UNIT;
+
+/// Complete access unit (coded picture with its headers), in Annex-B format
+typedef struct {
+    uint8_t *data;
+    uint32_t length;
+    int64_t pts;                /// Presentation time, relative to the first frame when delivered by the encoder callback
+    const H264_NAL_UNIT *nals;  /// NAL units of the access unit
+    uint32_t nal_count;
+    uint32_t nal_types;         /// (1 << type) of each NAL unit type present
+    int keyframe;               /// Contains an IDR picture
+} H264_ACCESS_UNIT;
+
+/// Receives complete access units, the data is only valid during the call
+typedef std::function<void(const H264_ACCESS_UNIT *unit)> AccessUnitCallback;
+
+typedef struct h264_assembler_s H264_ASSEMBLER;
+
+typedef struct mp4_muxer_s MP4_MUXER;
+
+typedef struct mjpeg_server_s MJPEG_SERVER;
+
+typedef struct segment_writer_s SEGMENT_WRITER;
+
+typedef struct raw_frame_tap_s RAW_FRAME_TAP;
+
+/// Points in the pipeline at which the age of a frame is measured
+typedef enum {
+    LATENCY_STAGE_ENCODER,          /// The encoder returned the end of the frame
+    LATENCY_STAGE_CALLBACK_ENTER,   /// The frame is passed to the video, frame or access unit callback
+    LATENCY_STAGE_CALLBACK_EXIT,    /// The callback returned
+    LATENCY_STAGE_COUNT
+} LATENCY_STAGE_T;
+
+/// Latencies, in us since the sensor timestamped the frame, of the frames that reached a stage
+typedef struct {
+    uint64_t count;             /// Frames recorded
+    uint32_t p50;               /// Percentiles, within 6% (histogram resolution)
+    uint32_t p90;
+    uint32_t p99;
+    uint32_t max;
+} LATENCY_SUMMARY;
+
+typedef struct {
+    LATENCY_SUMMARY stages[LATENCY_STAGE_COUNT]; /// Indexed by LATENCY_STAGE_T
+} LATENCY_STATS;
+
+typedef struct latency_tracker_s LATENCY_TRACKER;
+
+/// Snapshot of the video pipeline counters (since init) and gauges (at the time of the snapshot)
+typedef struct {
+    uint32_t encoder_pool_size;         /// Buffers of the video encoder output pool
+    uint32_t encoder_pool_free;         /// Of those, idle in the pool
+    uint32_t buffers_held;              /// Of those, returned by the encoder and not yet released (queues, FrameRefs)
+    uint32_t buffers_in_flight;         /// Of those, queued at the encoder for it to fill
+    uint32_t still_pool_size;           /// Buffers of the still encoder output pool
+    uint32_t still_pool_free;           /// Of those, idle in the pool
+    uint64_t frames_delivered;          /// Frames (or access units) handed on for delivery
+    uint64_t frames_dropped;            /// Frames dropped for having no timestamp or the same as the previous one
+    uint64_t buffer_return_failures;    /// Buffers that could not be sent back to the encoder
+    uint64_t bytes;                     /// Encoded stream bytes received from the encoder, motion vectors excluded
+    uint64_t bytes_per_second;          /// Over the last second
+    double fps;                         /// Frames delivered per second, over the last second
+    uint64_t callbacks;                 /// Calls of the video, frame or access unit callback
+    uint64_t callback_time;             /// Total time spent in those callbacks, in us
+    uint32_t callback_time_max;         /// Longest of those callbacks, in us
+} CAM_PIPELINE_STATS;
+
+typedef struct pipeline_stats_s PIPELINE_STATS;
+
+typedef struct encoder_pool_adapter_s ENCODER_POOL_ADAPTER;
+
+/// Fields of ENCODER_CONTROL to apply
+#define ENCODER_CONTROL_BITRATE     (1u << 0u)
+#define ENCODER_CONTROL_QP          (1u << 1u)
+#define ENCODER_CONTROL_FRAMERATE   (1u << 2u)
+#define ENCODER_CONTROL_INTRAPERIOD (1u << 3u)
+/// Let the change ride on the current GOP rather than requesting a keyframe for it
+#define ENCODER_CONTROL_NO_KEYFRAME (1u << 4u)
+
+/// Encoder settings changed while capturing, see set_encoder_control
+typedef struct {
+    uint32_t flags;                     /// ENCODER_CONTROL_* fields to apply (the others are left as they are) and options
+    int bitrate;                        /// Bits/s, limited as by init
+    uint32_t quantisationParameter;     /// Fixed QP (H264), 0 to let the bitrate decide again
+    uint32_t framerate;                 /// Frames per second of the camera video port
+    uint32_t intraperiod;               /// Frames between keyframes (H264)
+} ENCODER_CONTROL;
+
+typedef struct rate_controller_s RATE_CONTROLLER;
+
+typedef struct rtp_sender_s RTP_SENDER;
+
+/// RTP output counters
+typedef struct {
+    uint64_t packets_sent;
+    uint64_t packets_dropped;           /// Packets that did not fit in the socket buffer
+    uint64_t bytes_sent;
+} RTP_STATS;
+
+/// Receives the fragmented MP4 output of a segment (init segment, then fragments), returns false on error
+typedef std::function<bool(int segment, const struct iovec *iov, int iovcnt)> Mp4SinkCallback;
+
+typedef struct still_image_pool_s STILL_IMAGE_POOL;
+
+/** Still image assembled from the still encoder output.
+ *  The image owns its memory and can be moved, e.g. out of a StillImageCallback. Once it is
+ *  destroyed the memory goes back to its pool and is reused by the next capture.
+ */
+class StillImage {
+public:
+    StillImage() = default;
+
+    explicit StillImage(STILL_IMAGE_POOL *pool);
+
+    StillImage(const StillImage &) = delete;
+
+    StillImage &operator=(const StillImage &) = delete;
+
+    StillImage(StillImage &&other) noexcept;
+
+    StillImage &operator=(StillImage &&other) noexcept;
+
+    ~StillImage();
+
+    bool append(const uint8_t *data, size_t length);
+
+    /// Release the memory back to the pool
+    void reset();
+
+    uint8_t *data() const { return data_; }
+
+    size_t length() const { return length_; }
+
+private:
+    STILL_IMAGE_POOL *pool_ = nullptr;
+    uint8_t *data_ = nullptr;
+    size_t length_ = 0;
+    size_t capacity_ = 0;
+};
+
+typedef std::function<void(StillImage image)> StillImageCallback;
+
+/** Still image as the list of encoder output buffers it was delivered in.
+ *  The buffers are held until the chunks are destroyed, iov() can be passed straight to
+ *  writev()/sendmsg(). The encoder output pool has to be large enough to hold a whole image
+ *  (see stillChunkBuffers).
+ */
+class StillChunks {
+public:
+    StillChunks() = default;
+
+    StillChunks(const StillChunks &) = delete;
+
+    StillChunks &operator=(const StillChunks &) = delete;
+
+    StillChunks(StillChunks &&other) noexcept;
+
+    StillChunks &operator=(StillChunks &&other) noexcept;
+
+    ~StillChunks();
+
+    void add(MMAL_BUFFER_HEADER_T *buffer);
+
+    /// Release the buffers back to the encoder pool
+    void reset();
+
+    const struct iovec *iov() const { return iov_.data(); }
+
+    int iovcnt() const { return (int) iov_.size(); }
+
+    size_t length() const { return length_; }
+
+private:
+    std::vector<MMAL_BUFFER_HEADER_T *> buffers_;
+    std::vector<struct iovec> iov_;
+    size_t length_ = 0;
+};
+
+typedef std::function<void(StillChunks chunks)> StillChunksCallback;
+
+/// What the encoder callback does with a frame when the frame queue is full
+typedef enum {
+    FRAME_QUEUE_DROP_OLDEST,    /// Release the oldest queued frame to make room
+    FRAME_QUEUE_DROP_NEWEST,    /// Release the new frame
+    FRAME_QUEUE_BLOCK           /// Wait for the consumer (stalls the encoder callback)
+} FRAME_QUEUE_POLICY_T;
+
+/// Counters of the frame queue between the encoder callback and the video callback
+typedef struct {
+    uint64_t frames_queued;     /// Frames handed to the queue by the encoder callback
+    uint64_t frames_delivered;  /// Frames passed to the video callback
+    uint64_t frames_dropped;    /// Frames released without being delivered
+    uint32_t depth;             /// Frames currently waiting for delivery
+    uint32_t max_depth;         /// Highest number of frames that were waiting at once
+} FRAME_QUEUE_STATS;
+
+typedef struct frame_queue_s FRAME_QUEUE;
+
+/// Start of a keyframe in the encoded stream
+typedef struct {
+    uint64_t offset;            /// Stream offset of the keyframe, or of the inline headers preceding it
+    int64_t pts;                /// Presentation time (STC) of the keyframe
+} KEYFRAME_INDEX_ENTRY;
+
+typedef struct keyframe_index_s KEYFRAME_INDEX;
+
+typedef struct circular_buffer_s CIRCULAR_BUFFER;
+
+/// Receives consecutive parts of the stream flushed from the circular buffer, returns false to stop
+typedef std::function<bool(const uint8_t *data, uint32_t length)> CircularBufferCallback;
+
+/// Requests that wake up the video capture loop (see capture_request_*)
+#define CAPTURE_EVENT_ABORT   (1u << 0u)   /// An error occurred, stop capturing
+#define CAPTURE_EVENT_STOP    (1u << 1u)   /// Stop capturing and return from capture()
+#define CAPTURE_EVENT_PAUSE   (1u << 2u)   /// Pause capturing
+#define CAPTURE_EVENT_RESUME  (1u << 3u)   /// Resume capturing
+#define CAPTURE_EVENT_POOL    (1u << 4u)   /// Resize the encoder pool (encoderPoolMax), handled without waking the caller
+#define CAPTURE_EVENT_ALL     (CAPTURE_EVENT_ABORT | CAPTURE_EVENT_STOP | CAPTURE_EVENT_PAUSE | CAPTURE_EVENT_RESUME | \
+                               CAPTURE_EVENT_POOL)
+
 /** Struct used to pass information in encoder port userdata to callback
  */
 typedef struct {
     VideoCallback video_cb;
-    StillCallback still_cb;
+    FrameCallback frame_cb;             /// Used instead of video_cb if set, receives the frame without a copy
+    MotionVectorCallback motion_cb;     /// Receives the inline motion vectors, if inlineMotionVectors is set
+    MotionEventCallback motion_event_cb; /// Receives motion start/stop, if motionDetection is set
+    AccessUnitCallback access_unit_cb;  /// Used instead of video_cb if set and assembleAccessUnits is set
+    Mp4SinkCallback mp4_sink_cb;        /// Receives the MP4 output instead of common_settings.filename, if set
+    RawFrameCallback raw_frame_cb;      /// Receives the uncompressed frames, if rawFrameEncoding is set
+    RawFrameCallback analysis_cb;       /// Receives the scaled I420 frames, if analysisWidth is set
+    StillImageCallback still_cb;
     FILE *file_handle;                   /// File handle to write buffer data to.
     CAM_STATE *pstate;              /// pointer to our state in case required in callback
     VCOS_SEMAPHORE_T complete_semaphore; /// semaphore which is posted when we reach end of frame (indicates end of capture or fault)
     int abort;                           /// Set to 1 in callback if an error occurs to attempt to abort the capture
-#define IFRAME_BUFSIZE (60*1000)
-    int iframe_buff[IFRAME_BUFSIZE];          /// buffer of iframe pointers
-    int iframe_buff_wpos;
-    int iframe_buff_rpos;
-    char header_bytes[29];
-    int header_wptr;
-    int flush_buffers;
-    // temporary image data
-    uint8_t *image_data;
-    long image_data_length;
+    VCOS_EVENT_FLAGS_T capture_events;   /// CAPTURE_EVENT_* requests, the capture loop blocks on these
+    StillImage still_image;              /// Image being assembled by the still encoder callback
+    StillChunksCallback still_chunks_cb; /// Used instead of still_cb if set, receives the encoder buffers of the image
+    StillChunks still_chunks;            /// Buffers of the image being captured for still_chunks_cb
+    int still_chunks_overflow;           /// Image did not fit in the encoder buffers, drop it
+    uint32_t port_buffers;               /// Buffers currently sent to the still encoder output port
 } PORT_USERDATA;
 
 /// Frame advance method
@@ -184,6 +544,45 @@ typedef struct cam_parameters_s {
     int settings;
 } CAM_PARAMETERS;
 
+/// Camera parameters as set_all_parameters sends them, one bit each in CAM_PARAMETER_RESULT
+typedef enum {
+    CAM_PARAMETER_SATURATION,
+    CAM_PARAMETER_SHARPNESS,
+    CAM_PARAMETER_CONTRAST,
+    CAM_PARAMETER_BRIGHTNESS,
+    CAM_PARAMETER_ISO,
+    CAM_PARAMETER_VIDEO_STABILISATION,
+    CAM_PARAMETER_EXPOSURE_COMPENSATION,
+    CAM_PARAMETER_EXPOSURE_MODE,
+    CAM_PARAMETER_FLICKER_AVOID_MODE,
+    CAM_PARAMETER_METERING_MODE,
+    CAM_PARAMETER_AWB_MODE,
+    CAM_PARAMETER_AWB_GAINS,
+    CAM_PARAMETER_ROTATION,
+    CAM_PARAMETER_FLIPS,
+    CAM_PARAMETER_ROI,
+    CAM_PARAMETER_SHUTTER_SPEED,
+    CAM_PARAMETER_DRC,
+    CAM_PARAMETER_STATS_PASS,
+    CAM_PARAMETER_GAINS,                /// Analog and digital
+    CAM_PARAMETER_SETTINGS_EVENTS,      /// MMAL_PARAMETER_CAMERA_SETTINGS change events, if settings is set
+    CAM_PARAMETER_COUNT
+} CAM_PARAMETER_T;
+
+/// What a camera component was last set to
+typedef struct {
+    CAM_PARAMETERS applied;
+    uint32_t known;                     /// Bits (1 << CAM_PARAMETER_T) of the parameters applied holds
+} CAM_PARAMETER_CACHE;
+
+/// Outcome of applying a set of camera parameters
+typedef struct {
+    uint32_t sent;                      /// Bits (1 << CAM_PARAMETER_T) of the parameters sent to the camera
+    uint32_t failed;                    /// Of those, the ones that could not be set
+    int status[CAM_PARAMETER_COUNT];    /// Per parameter, 0 if set or not sent, else the error (as the set_* functions)
+    uint64_t duration;                  /// Time taken, in us
+} CAM_PARAMETER_RESULT;
+
 typedef struct {
     int wantPreview;                       /// Display a preview
     int wantFullScreenPreview;             /// 0 is use previewRect, non-zero to use full screen
@@ -222,6 +621,8 @@ struct CAM_STATE_S {
 
     CAM_PREVIEW_PARAMETERS preview_parameters{}; /// Camera setup parameters
     CAM_PARAMETERS camera_parameters{}; /// Camera setup parameters
+    CAM_PARAMETER_CACHE camera_parameters_applied{}; /// What the camera component is set to, see set_camera_parameters()
+    CAM_PARAMETER_RESULT camera_parameters_result{}; /// Outcome of setting the parameters when the camera was created
 
     MMAL_COMPONENT_T *camera_component{};    /// Pointer to the camera component
     MMAL_COMPONENT_T *video_encoder_component{};   /// Pointer to the encoder component
@@ -234,6 +635,52 @@ struct CAM_STATE_S {
 
     MMAL_POOL_T *video_encoder_pool{}; /// Pointer to the pool of buffers used by encoder output port
 
+    uint32_t frameQueueSize{};            /// Frames buffered between the encoder and video_cb. 0 delivers on the MMAL thread
+    int frameQueuePolicy{};               /// FRAME_QUEUE_POLICY_T applied when the frame queue is full
+    FRAME_QUEUE *frame_queue{};           /// Queue and consumer thread, if frameQueueSize is set
+    uint32_t extraFrameBuffers{};         /// Extra encoder buffers for frames held by the frame callback
+    uint32_t keyframeHistory{};           /// Keyframes remembered in the keyframe index. 0 disables the index
+    KEYFRAME_INDEX *keyframe_index{};     /// Offsets of the recent keyframes, if keyframeHistory is set
+    uint32_t circularBufferSize{};        /// Bytes of encoded video kept in memory for circular_buffer_flush(). 0 disables it
+    CIRCULAR_BUFFER *circular_buffer{};   /// Recent encoded video, if circularBufferSize is set
+    int motionDetection{};                /// Detect motion on the inline motion vectors (enables inlineMotionVectors)
+    MOTION_DETECT_PARAMETERS motionParameters{}; /// Motion detection settings
+    MOTION_DETECTOR *motion_detector{};   /// Motion detector, if motionDetection is set
+    int assembleAccessUnits{};            /// Parse the stream and deliver complete access units instead of encoder buffers
+    H264_ASSEMBLER *h264_assembler{};     /// Access unit assembler, if assembleAccessUnits is set
+    int mp4Mux{};                         /// Mux the video into fragmented MP4 (enables assembleAccessUnits)
+    uint32_t mp4FragmentDuration{};       /// Minimum duration (ms) of an MP4 fragment. 0 for a fragment per frame
+    MP4_MUXER *mp4_muxer{};               /// MP4 muxer, if mp4Mux is set
+    int recordFile{};                     /// Write the encoded video to common_settings.filename, a %d in it is replaced by segmentNumber
+    uint32_t recordBufferSize{};          /// Bytes buffered for the file writer thread, 0 for the default (8MB)
+    SEGMENT_WRITER *segment_writer{};     /// File writer, if recordFile is set
+    uint16_t mjpegPort{};                 /// TCP port of the MJPEG HTTP server (MJPEG encoding only). 0 disables it
+    const char *mjpegAddress{};           /// Address the MJPEG server listens on, nullptr for 127.0.0.1
+    uint32_t mjpegMaxClients{};           /// Clients the MJPEG server accepts, 0 for the default (8)
+    MJPEG_SERVER *mjpeg_server{};         /// MJPEG server, if mjpegPort is set
+    const char *rtpDestination{};         /// Send the video as RTP to "host:port" (UDP) or a unix socket path (enables assembleAccessUnits)
+    uint32_t rtpMtu{};                    /// Largest RTP payload, 0 for the default (1400)
+    uint8_t rtpPayloadType{};             /// RTP payload type, 0 for the default (96)
+    RTP_SENDER *rtp_sender{};             /// RTP sender, if rtpDestination is set
+    MMAL_FOURCC_T rawFrameEncoding{};     /// Also deliver the frames uncompressed (I420, RGB24 or BGR24) to raw_frame_cb. 0 disables it
+    uint32_t rawFrameInterval{};          /// Deliver every Nth raw frame, 0 or 1 for every frame
+    uint32_t analysisWidth{};             /// Also deliver the frames scaled down by the ISP, as I420, to analysis_cb. 0 disables it
+    uint32_t analysisHeight{};            /// Height of the analysis frames
+    uint32_t analysisInterval{};          /// Deliver every Nth analysis frame, 0 or 1 for every frame
+    RAW_FRAME_TAP *raw_frame_tap{};       /// Splitter between the camera and the encoder, if rawFrameEncoding or analysisWidth is set
+    int latencyStats{};                   /// Measure the age of the frames along the pipeline, see get_latency_stats()
+    LATENCY_TRACKER *latency_tracker{};   /// Latency histograms, if latencyStats is set
+    const char *statsSocket{};            /// Unix socket serving the pipeline stats as text, nullptr for none
+    PIPELINE_STATS *pipeline_stats{};     /// Pipeline counters, created by init()
+    uint32_t encoderPoolMin{};            /// Fewest buffers an adaptive encoder pool shrinks to
+    uint32_t encoderPoolMax{};            /// Most buffers an adaptive encoder pool grows to. 0 keeps the pool size fixed
+    ENCODER_POOL_ADAPTER *encoder_pool_adapter{}; /// Encoder pool sizing, if encoderPoolMax is set
+    uint32_t rateControlTarget{};         /// Throughput (bytes/s) the bitrate is steered to, see set_rate_control_target(). 0 keeps the bitrate fixed
+    int rateControlMin{};                 /// Lowest bitrate rate control goes down to, 0 for the default (250kbit/s)
+    int rateControlMax{};                 /// Highest bitrate rate control goes up to, 0 for the bitrate set at init
+    RATE_CONTROLLER *rate_controller{};   /// Rate controller, if rateControlTarget is set
+    VCOS_MUTEX_T encoder_control_lock{};  /// Serialises changes to the running encoder (set_encoder_control, pool resizes)
+
     PORT_USERDATA callback_data;        /// Used to move data to the encoder callback
 
     int bCapturing{};                     /// State of capture/pause
@@ -244,6 +691,10 @@ struct CAM_STATE_S {
     int64_t starttime{};
     int64_t lasttime{};
 
+    int64_t segmentStartTime{};           /// Time (ms) the current segment started, -1 until the first encoder callback
+    int64_t completeTime{};               /// Time (ms) at which the capture timeout expires, -1 until the first wait
+    int64_t nextFrameTime{};              /// Time (ms) of the next time-lapse still, -1 until the first frame
+
     MMAL_BOOL_T addSPSTiming{};
     int slices{};
 
@@ -268,8 +719,31 @@ struct CAM_STATE_S {
     MMAL_CONNECTION_T *encoder_connection{}; /// Pointer to the connection from camera to encoder
 
     MMAL_POOL_T *encoder_pool{}; /// Pointer to the pool of buffers used by encoder output port
+    STILL_IMAGE_POOL *still_image_pool{}; /// Memory reused for the assembled still images
+    uint32_t stillChunkBuffers{};         /// Minimum number of still encoder buffers, capture_still_chunks holds a whole image
 };
 
+/// Counters of the frame pairing of a dual camera capture
+typedef struct {
+    uint64_t pairs;             /// Frame pairs passed to the callback
+    uint64_t frames_unmatched;  /// Frames dropped without a match from the other camera
+    int64_t max_skew;           /// Largest STC difference (us) within a pair
+} CAM_DUAL_STATS;
+
+typedef struct cam_frame_pairer_s FRAME_PAIRER;
+
+/// Receives frames of both cameras with (nearly) the same STC time, skew is frame1 minus frame0 in us
+typedef std::function<void(FrameRef frame0, FrameRef frame1, int64_t skew)> FramePairCallback;
+
+/** State of a synchronised capture from two cameras
+ */
+typedef struct {
+    CAM_STATE camera[2];                /// Pipelines, common_settings.cameraNum selects the sensor of each
+    int64_t maxSkew;                    /// Largest STC difference (us) of a pair. 0 for half a frame interval
+    FramePairCallback pair_cb;          /// Called with each pair of frames
+    FRAME_PAIRER *pairer;               /// Frames waiting for a match
+} CAM_DUAL_STATE;
+
 /// Capture/Pause switch method
 /// Simply capture for time specified
 enum {
@@ -283,6 +757,12 @@ enum {
 static VCHI_INSTANCE_T global_initialise_instance;
 static VCHI_CONNECTION_T *global_connection;
 
+void set_backend(const CAM_BACKEND *backend);
+
+const CAM_BACKEND *get_backend();
+
+MMAL_STATUS_T create_backend_component(CAM_COMPONENT_TYPE_T type, MMAL_COMPONENT_T **component);
+
 void check_camera_model(int cam_num);
 
 void get_sensor_defaults(int camera_num, char *camera_name, uint32_t *width, uint32_t *height);
@@ -321,6 +801,13 @@ int set_gains(MMAL_COMPONENT_T *camera, float analog, float digital);
 
 int set_all_parameters(MMAL_COMPONENT_T *camera, const CAM_PARAMETERS *params);
 
+void camera_parameter_cache_reset(CAM_PARAMETER_CACHE *cache);
+
+int apply_camera_parameters(MMAL_COMPONENT_T *camera, CAM_PARAMETER_CACHE *cache, const CAM_PARAMETERS *params,
+                            CAM_PARAMETER_RESULT *result);
+
+MMAL_STATUS_T set_camera_parameters(CAM_STATE *state, const CAM_PARAMETERS *params, CAM_PARAMETER_RESULT *result);
+
 MMAL_STATUS_T create_camera_component(CAM_STATE *state);
 
 int set_stereo_mode(MMAL_PORT_T *port, MMAL_PARAMETER_STEREOSCOPIC_MODE_T *stereo_mode);
@@ -359,10 +846,174 @@ void default_state(CAM_STATE *state);
 
 MMAL_STATUS_T init(CAM_STATE *state);
 
+MMAL_STATUS_T send_encoder_buffers(CAM_STATE *state);
+
 MMAL_STATUS_T capture(CAM_STATE *state);
 
+void capture_request_abort(CAM_STATE *state);
+
+void capture_request_stop(CAM_STATE *state);
+
+void capture_request_pause(CAM_STATE *state);
+
+void capture_request_resume(CAM_STATE *state);
+
+void deliver_frame(CAM_STATE *state, MMAL_BUFFER_HEADER_T *buffer, int64_t pts);
+
+void deliver_motion_vectors(CAM_STATE *state, MMAL_BUFFER_HEADER_T *buffer);
+
+MMAL_STATUS_T frame_queue_create(CAM_STATE *state);
+
+void frame_queue_destroy(CAM_STATE *state);
+
+int frame_queue_push(CAM_STATE *state, MMAL_BUFFER_HEADER_T *buffer, int64_t pts);
+
+MMAL_STATUS_T get_frame_queue_stats(CAM_STATE *state, FRAME_QUEUE_STATS *stats);
+
+MMAL_STATUS_T keyframe_index_create(CAM_STATE *state);
+
+void keyframe_index_destroy(CAM_STATE *state);
+
+void keyframe_index_update(KEYFRAME_INDEX *index, MMAL_BUFFER_HEADER_T *buffer);
+
+int keyframe_index_find(KEYFRAME_INDEX *index, uint64_t min_offset, KEYFRAME_INDEX_ENTRY *entry);
+
+int keyframe_index_find_before(KEYFRAME_INDEX *index, uint64_t min_offset, int64_t pts, KEYFRAME_INDEX_ENTRY *entry);
+
+uint64_t keyframe_index_stream_offset(KEYFRAME_INDEX *index);
+
+MMAL_STATUS_T circular_buffer_create(CAM_STATE *state);
+
+void circular_buffer_destroy(CAM_STATE *state);
+
+void circular_buffer_write(CAM_STATE *state, MMAL_BUFFER_HEADER_T *buffer);
+
+MMAL_STATUS_T circular_buffer_flush(CAM_STATE *state, uint32_t seconds, const CircularBufferCallback &cb);
+
+MMAL_STATUS_T circular_buffer_flush_fd(CAM_STATE *state, uint32_t seconds, int fd);
+
+MOTION_DETECTOR *motion_detector_create(const MOTION_DETECT_PARAMETERS *parameters, MotionEventCallback event_cb);
+
+void motion_detector_destroy(MOTION_DETECTOR *detector);
+
+uint32_t motion_detector_process(MOTION_DETECTOR *detector, int64_t timestamp, const CAM_MOTION_VECTOR *vectors,
+                                 uint32_t columns, uint32_t rows);
+
+int motion_detector_active(MOTION_DETECTOR *detector);
+
+int motion_detector_use_neon(MOTION_DETECTOR *detector, int enable);
+
+const uint8_t *motion_detector_history(MOTION_DETECTOR *detector, uint32_t *columns, uint32_t *rows);
+
+H264_ASSEMBLER *h264_assembler_create(AccessUnitCallback cb);
+
+void h264_assembler_destroy(H264_ASSEMBLER *assembler);
+
+void h264_assembler_push(H264_ASSEMBLER *assembler, const uint8_t *data, uint32_t length, int64_t pts,
+                         int frame_end);
+
+uint32_t h264_assembler_parameter_sets(H264_ASSEMBLER *assembler, uint8_t *data, uint32_t size);
+
+uint32_t get_parameter_sets(CAM_STATE *state, uint8_t *data, uint32_t size);
+
+MP4_MUXER *mp4_muxer_create(uint32_t width, uint32_t height, uint32_t fragment_duration, const char *filename,
+                            Mp4SinkCallback sink);
+
+void mp4_muxer_destroy(MP4_MUXER *muxer);
+
+MMAL_STATUS_T mp4_muxer_write(MP4_MUXER *muxer, const H264_ACCESS_UNIT *unit, int segment);
+
+MMAL_STATUS_T raw_frame_tap_create(CAM_STATE *state);
+
+void raw_frame_tap_destroy(CAM_STATE *state);
+
+MMAL_PORT_T *raw_frame_tap_encoder_port(CAM_STATE *state);
+
+MMAL_BOOL_T port_pool_release_callback(MMAL_POOL_T *pool, MMAL_BUFFER_HEADER_T *buffer, void *userdata);
+
+LATENCY_TRACKER *latency_tracker_create(MMAL_COMPONENT_T *camera);
+
+void latency_tracker_destroy(LATENCY_TRACKER *tracker);
+
+MMAL_STATUS_T latency_tracker_sync(LATENCY_TRACKER *tracker);
+
+void latency_tracker_record(LATENCY_TRACKER *tracker, LATENCY_STAGE_T stage, int64_t pts);
+
+MMAL_STATUS_T get_latency_stats(CAM_STATE *state, LATENCY_STATS *stats);
+
+void reset_latency_stats(CAM_STATE *state);
+
+MMAL_STATUS_T pipeline_stats_create(CAM_STATE *state);
+
+void pipeline_stats_stop_export(CAM_STATE *state);
+
+void pipeline_stats_destroy(CAM_STATE *state);
+
+void pipeline_stats_buffer(PIPELINE_STATS *stats, uint32_t length);
+
+void pipeline_stats_release(PIPELINE_STATS *stats, int returned);
+
+void pipeline_stats_frame(PIPELINE_STATS *stats, int delivered);
+
+void pipeline_stats_callback(PIPELINE_STATS *stats, uint64_t duration);
+
+MMAL_STATUS_T get_pipeline_stats(CAM_STATE *state, CAM_PIPELINE_STATS *snapshot);
+
+uint32_t pipeline_stats_held(PIPELINE_STATS *stats);
+
+MMAL_STATUS_T encoder_pool_adapter_create(CAM_STATE *state);
+
+void encoder_pool_adapter_destroy(CAM_STATE *state);
+
+void encoder_pool_observe(CAM_STATE *state, MMAL_BUFFER_HEADER_T *buffer);
+
+MMAL_STATUS_T encoder_pool_apply(CAM_STATE *state);
+
+MMAL_STATUS_T set_encoder_control(CAM_STATE *state, const ENCODER_CONTROL *control);
+
+MMAL_STATUS_T encoder_control_apply(CAM_STATE *state, const ENCODER_CONTROL *control);
+
+MMAL_STATUS_T rate_controller_create(CAM_STATE *state);
+
+void rate_controller_destroy(CAM_STATE *state);
+
+void set_rate_control_target(CAM_STATE *state, uint32_t bytes_per_second);
+
+void report_rate_control_queue(CAM_STATE *state, uint32_t queued_bytes);
+
+MMAL_STATUS_T segment_writer_create(CAM_STATE *state);
+
+void segment_writer_destroy(CAM_STATE *state);
+
+void segment_writer_write(CAM_STATE *state, MMAL_BUFFER_HEADER_T *buffer);
+
+MMAL_STATUS_T mjpeg_server_create(CAM_STATE *state);
+
+void mjpeg_server_destroy(CAM_STATE *state);
+
+void mjpeg_server_push(CAM_STATE *state, MMAL_BUFFER_HEADER_T *buffer);
+
+RTP_SENDER *rtp_sender_create(const char *destination, uint32_t mtu, uint8_t payload_type);
+
+void rtp_sender_destroy(RTP_SENDER *sender);
+
+MMAL_STATUS_T rtp_sender_send(RTP_SENDER *sender, const H264_ACCESS_UNIT *unit);
+
+MMAL_STATUS_T get_rtp_stats(CAM_STATE *state, RTP_STATS *stats);
+
 void destroy(CAM_STATE *state);
 
+//dual
+void default_dual_state(CAM_DUAL_STATE *state);
+
+MMAL_STATUS_T init_dual(CAM_DUAL_STATE *state);
+
+MMAL_STATUS_T capture_dual(CAM_DUAL_STATE *state);
+
+void destroy_dual(CAM_DUAL_STATE *state);
+
+MMAL_STATUS_T get_dual_stats(CAM_DUAL_STATE *state, CAM_DUAL_STATS *stats);
+
 //still
 MMAL_STATUS_T create_still_camera_component(CAM_STATE *state);
 
@@ -374,6 +1025,14 @@ MMAL_STATUS_T create_still_encoder_component(CAM_STATE *state);
 
 MMAL_STATUS_T capture_still(CAM_STATE *state, StillCallback);
 
+MMAL_STATUS_T capture_still_image(CAM_STATE *state, StillImageCallback still_cb);
+
+MMAL_STATUS_T capture_still_chunks(CAM_STATE *state, StillChunksCallback still_chunks_cb);
+
+STILL_IMAGE_POOL *still_image_pool_create(size_t size_hint);
+
+void still_image_pool_destroy(STILL_IMAGE_POOL *pool);
+
 int wait_for_next_frame(CAM_STATE *state, int *frame);
 
 void still_encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
@@ -0,0 +1,241 @@
+//
+// In-memory circular buffer of the encoded video, for pre-event recording.
+//
+// The encoder callback copies every output buffer (side information excepted) into a
+// preallocated ring of circularBufferSize bytes and records the keyframes in the keyframe
+// index, so ring positions are simply stream offsets modulo the ring size. On a trigger the
+// last seconds are flushed starting at a keyframe, preceded by the last stream headers.
+// The flush copies the ring out in chunks, so the encoder callback is only held up for one
+// chunk at a time and recording carries on while the flush is written.
+//
+
+#include "cam.h"
+#include <cerrno>
+#include <cstring>
+#include <new>
+
+/// Keyframes remembered if keyframeHistory was not set
+#define CIRCULAR_KEYFRAME_HISTORY 256
+/// Largest stream headers (SPS/PPS) kept for a flush
+#define CIRCULAR_HEADER_MAX 256
+/// Bytes copied out of the ring at a time while flushing
+#define CIRCULAR_FLUSH_CHUNK (64u << 10u)
+
+struct circular_buffer_s {
+    VCOS_MUTEX_T lock;                  /// protects the ring, the keyframe index and the headers
+    VCOS_MUTEX_T flush_lock;            /// serialises flushes, which share the chunk buffer
+    uint8_t *data;
+    uint32_t size;
+    uint8_t headers[CIRCULAR_HEADER_MAX];
+    uint32_t headers_length;
+    int in_headers;                     /// the last buffer was a header buffer
+    int64_t last_pts;                   /// pts of the latest frame
+    uint8_t *chunk;
+};
+
+/**
+ * Create the circular buffer, if state->circularBufferSize is set.
+ * Must be called before keyframe_index_create(), the circular buffer needs the keyframe index.
+ *
+ * @param state Pointer to state control struct
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T circular_buffer_create(CAM_STATE *state) {
+    if (!state->circularBufferSize || state->circular_buffer)
+        return MMAL_SUCCESS;
+
+    if (!state->keyframeHistory)
+        state->keyframeHistory = CIRCULAR_KEYFRAME_HISTORY;
+
+    auto *circular = new(std::nothrow) CIRCULAR_BUFFER();
+    if (!circular)
+        return MMAL_ENOMEM;
+
+    circular->size = state->circularBufferSize;
+    circular->data = (uint8_t *) malloc(circular->size);
+    circular->chunk = (uint8_t *) malloc(CIRCULAR_FLUSH_CHUNK);
+    circular->last_pts = MMAL_TIME_UNKNOWN;
+    if (!circular->data || !circular->chunk) {
+        vcos_log_error("%s: unable to allocate %u bytes", __func__, circular->size);
+        free(circular->data);
+        free(circular->chunk);
+        delete circular;
+        return MMAL_ENOMEM;
+    }
+
+    if (vcos_mutex_create(&circular->lock, "cam-circular") != VCOS_SUCCESS) {
+        free(circular->data);
+        free(circular->chunk);
+        delete circular;
+        return MMAL_ENOMEM;
+    }
+    if (vcos_mutex_create(&circular->flush_lock, "cam-circular-flush") != VCOS_SUCCESS) {
+        vcos_mutex_delete(&circular->lock);
+        free(circular->data);
+        free(circular->chunk);
+        delete circular;
+        return MMAL_ENOMEM;
+    }
+
+    state->circular_buffer = circular;
+    return MMAL_SUCCESS;
+}
+
+/**
+ * Destroy the circular buffer. The encoder output port must be disabled first.
+ *
+ * @param state Pointer to state control struct
+ */
+void circular_buffer_destroy(CAM_STATE *state) {
+    CIRCULAR_BUFFER *circular = state->circular_buffer;
+
+    if (!circular)
+        return;
+
+    vcos_mutex_delete(&circular->flush_lock);
+    vcos_mutex_delete(&circular->lock);
+    free(circular->data);
+    free(circular->chunk);
+    delete circular;
+    state->circular_buffer = nullptr;
+}
+
+/**
+ * Copy an encoder output buffer into the ring, called from the encoder callback
+ *
+ * @param state Pointer to state control struct
+ * @param buffer Encoder output buffer, without side information
+ */
+void circular_buffer_write(CAM_STATE *state, MMAL_BUFFER_HEADER_T *buffer) {
+    CIRCULAR_BUFFER *circular = state->circular_buffer;
+    const uint8_t *data = buffer->data + buffer->offset;
+    uint32_t length = buffer->length;
+
+    vcos_mutex_lock(&circular->lock);
+
+    if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG) { // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+        // keep the latest headers, a flush starts with them
+        if (!circular->in_headers)
+            circular->headers_length = 0;
+        if (circular->headers_length + length <= CIRCULAR_HEADER_MAX) {
+            memcpy(circular->headers + circular->headers_length, data, length);
+            circular->headers_length += length;
+        }
+        circular->in_headers = 1;
+    } else {
+        circular->in_headers = 0;
+        if (buffer->pts != MMAL_TIME_UNKNOWN)
+            circular->last_pts = buffer->pts;
+    }
+
+    // only the tail of a buffer larger than the ring survives
+    uint64_t offset = keyframe_index_stream_offset(state->keyframe_index);
+    if (length > circular->size) {
+        offset += length - circular->size;
+        data += length - circular->size;
+        length = circular->size;
+    }
+
+    uint32_t pos = (uint32_t) (offset % circular->size);
+    uint32_t first = length < circular->size - pos ? length : circular->size - pos;
+    memcpy(circular->data + pos, data, first);
+    memcpy(circular->data, data + first, length - first);
+
+    keyframe_index_update(state->keyframe_index, buffer);
+
+    vcos_mutex_unlock(&circular->lock);
+}
+
+/**
+ * Pass the last seconds of video to a callback, starting at a keyframe and preceded by the stream headers.
+ * Recording carries on while flushing; only what was recorded up to the call is flushed.
+ *
+ * @param state Pointer to state control struct
+ * @param seconds Seconds of video before the latest frame to flush, as far as the buffer holds them
+ * @param cb Called with consecutive parts of the stream, returns false to stop the flush
+ * @return MMAL_SUCCESS if all OK, MMAL_ENOSYS if the circular buffer is not in use,
+ *         MMAL_ENOENT if there is no keyframe in the buffer, MMAL_ENOSPC if the data was overwritten
+ *         while flushing (the buffer is too small for the flush to keep up), MMAL_EIO if the callback stopped
+ */
+MMAL_STATUS_T circular_buffer_flush(CAM_STATE *state, uint32_t seconds, const CircularBufferCallback &cb) {
+    CIRCULAR_BUFFER *circular = state->circular_buffer;
+    KEYFRAME_INDEX_ENTRY keyframe;
+    MMAL_STATUS_T status = MMAL_SUCCESS;
+    uint64_t start, end;
+    uint32_t headers_length;
+    int found;
+
+    if (!circular)
+        return MMAL_ENOSYS;
+
+    vcos_mutex_lock(&circular->flush_lock);
+
+    vcos_mutex_lock(&circular->lock);
+    end = keyframe_index_stream_offset(state->keyframe_index);
+    start = end > circular->size ? end - circular->size : 0;
+    found = circular->last_pts != MMAL_TIME_UNKNOWN &&
+            keyframe_index_find_before(state->keyframe_index, start,
+                                       circular->last_pts - (int64_t) seconds * 1000000, &keyframe);
+    headers_length = circular->headers_length;
+    memcpy(circular->chunk, circular->headers, headers_length);
+    vcos_mutex_unlock(&circular->lock);
+
+    if (!found) {
+        vcos_mutex_unlock(&circular->flush_lock);
+        return MMAL_ENOENT;
+    }
+
+    if (headers_length && !cb(circular->chunk, headers_length))
+        status = MMAL_EIO;
+
+    for (uint64_t offset = keyframe.offset; status == MMAL_SUCCESS && offset < end;) {
+        uint32_t length = end - offset < CIRCULAR_FLUSH_CHUNK ? (uint32_t) (end - offset) : CIRCULAR_FLUSH_CHUNK;
+        uint32_t pos = (uint32_t) (offset % circular->size);
+        uint32_t first = length < circular->size - pos ? length : circular->size - pos;
+
+        vcos_mutex_lock(&circular->lock);
+        // the encoder may have caught up with us
+        if (keyframe_index_stream_offset(state->keyframe_index) - offset > circular->size) {
+            status = MMAL_ENOSPC;
+        } else {
+            memcpy(circular->chunk, circular->data + pos, first);
+            memcpy(circular->chunk + first, circular->data, length - first);
+        }
+        vcos_mutex_unlock(&circular->lock);
+
+        if (status == MMAL_SUCCESS && !cb(circular->chunk, length))
+            status = MMAL_EIO;
+        offset += length;
+    }
+
+    vcos_mutex_unlock(&circular->flush_lock);
+
+    if (status == MMAL_ENOSPC)
+        vcos_log_error("%s: video was overwritten while flushing", __func__);
+    return status;
+}
+
+/**
+ * Write the last seconds of video to a file descriptor, see circular_buffer_flush()
+ *
+ * @param state Pointer to state control struct
+ * @param seconds Seconds of video before the latest frame to flush
+ * @param fd File descriptor to write to
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T circular_buffer_flush_fd(CAM_STATE *state, uint32_t seconds, int fd) {
+    return circular_buffer_flush(state, seconds, [fd](const uint8_t *data, uint32_t length) {
+        while (length) {
+            ssize_t written = write(fd, data, length);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                vcos_log_error("circular buffer write failed: %s", strerror(errno));
+                return false;
+            }
+            data += written;
+            length -= (uint32_t) written;
+        }
+        return true;
+    });
+}
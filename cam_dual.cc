@@ -0,0 +1,238 @@
+//
+// Synchronised capture from two cameras (Compute Module boards).
+//
+// Both pipelines are set up as usual and started back to back. The cameras timestamp their
+// frames with the raw STC (use_stc_timestamp), which is shared by both, so frames are paired
+// on buffer->pts: a frame is matched with the closest pending frame of the other camera that
+// lies within maxSkew. Frames that are passed by a newer match can never be paired and are dropped.
+//
+
+#include "cam.h"
+#include <new>
+#include <utility>
+
+/// Frames kept per camera while waiting for a match
+#define FRAME_PAIRER_DEPTH 4
+
+struct cam_frame_pairer_s {
+    CAM_DUAL_STATE *pstate;
+    VCOS_MUTEX_T lock;
+    FrameRef pending[2][FRAME_PAIRER_DEPTH];
+    uint32_t pending_num[2];
+    int64_t max_skew;
+    CAM_DUAL_STATS stats;
+};
+
+/**
+ * Remove the first count pending frames of a camera
+ */
+static void frame_pairer_remove(FRAME_PAIRER *pairer, int camera, uint32_t count) {
+    uint32_t i;
+
+    for (i = count; i < pairer->pending_num[camera]; i++)
+        pairer->pending[camera][i - count] = std::move(pairer->pending[camera][i]);
+    for (i = pairer->pending_num[camera] - count; i < pairer->pending_num[camera]; i++)
+        pairer->pending[camera][i].reset();
+
+    pairer->pending_num[camera] -= count;
+}
+
+/**
+ * Frame callback of each camera: pair the frame, or keep it until the other camera delivers
+ */
+static void frame_pairer_push(FRAME_PAIRER *pairer, int camera, FrameRef frame) {
+    int other = !camera;
+    int64_t pts = frame.buffer()->pts;
+    int64_t best_skew = 0;
+    int best = -1;
+    FrameRef match;
+
+    vcos_mutex_lock(&pairer->lock);
+
+    for (uint32_t i = 0; i < pairer->pending_num[other]; i++) {
+        int64_t skew = pts - pairer->pending[other][i].buffer()->pts;
+        if (skew < 0)
+            skew = -skew;
+        if (skew <= pairer->max_skew && (best == -1 || skew < best_skew)) {
+            best = (int) i;
+            best_skew = skew;
+        }
+    }
+
+    if (best == -1) {
+        // nothing to pair with yet, make room by giving up on the oldest frame
+        if (pairer->pending_num[camera] == FRAME_PAIRER_DEPTH) {
+            frame_pairer_remove(pairer, camera, 1);
+            pairer->stats.frames_unmatched++;
+        }
+        pairer->pending[camera][pairer->pending_num[camera]++] = std::move(frame);
+        vcos_mutex_unlock(&pairer->lock);
+        return;
+    }
+
+    // the older frames of both cameras will not find a closer match any more
+    match = std::move(pairer->pending[other][best]);
+    pairer->stats.frames_unmatched += best + pairer->pending_num[camera];
+    frame_pairer_remove(pairer, other, best + 1);
+    frame_pairer_remove(pairer, camera, pairer->pending_num[camera]);
+
+    pairer->stats.pairs++;
+    if (best_skew > pairer->stats.max_skew)
+        pairer->stats.max_skew = best_skew;
+    vcos_mutex_unlock(&pairer->lock);
+
+    // skew of camera 1 relative to camera 0
+    int64_t skew = match.buffer()->pts - pts;
+    if (camera == 0)
+        pairer->pstate->pair_cb(std::move(frame), std::move(match), skew);
+    else
+        pairer->pstate->pair_cb(std::move(match), std::move(frame), -skew);
+}
+
+/**
+ * Assign a default set of parameters to both pipelines, cameras 0 and 1
+ *
+ * @param state Pointer to state structure to assign defaults to
+ */
+void default_dual_state(CAM_DUAL_STATE *state) {
+    for (int i = 0; i < 2; i++) {
+        default_state(&state->camera[i]);
+        state->camera[i].common_settings.cameraNum = i;
+    }
+    state->maxSkew = 0;
+    state->pairer = nullptr;
+}
+
+/**
+ * Set up both camera/encoder pipelines and the frame pairing.
+ * The frame callbacks of the pipelines are used for the pairing, frames are passed to pair_cb.
+ *
+ * @param state Pointer to state control struct
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T init_dual(CAM_DUAL_STATE *state) {
+    MMAL_STATUS_T status;
+
+    if (!state->pair_cb) {
+        vcos_log_error("%s: no frame pair callback specified", __func__);
+        return MMAL_EINVAL;
+    }
+
+    auto *pairer = new(std::nothrow) FRAME_PAIRER();
+    if (!pairer)
+        return MMAL_ENOMEM;
+    if (vcos_mutex_create(&pairer->lock, "cam-pairer") != VCOS_SUCCESS) {
+        delete pairer;
+        return MMAL_ENOMEM;
+    }
+    pairer->pstate = state;
+    pairer->max_skew = state->maxSkew;
+    if (!pairer->max_skew) {
+        // default to half a frame interval: the closest frame of the other camera is the only candidate
+        uint32_t framerate = state->camera[0].framerate ? state->camera[0].framerate : VIDEO_FRAME_RATE_NUM;
+        pairer->max_skew = 500000 / framerate;
+    }
+    state->pairer = pairer;
+
+    for (int i = 0; i < 2; i++) {
+        state->camera[i].callback_data.pstate = &state->camera[i];
+        state->camera[i].callback_data.frame_cb = [pairer, i](FrameRef frame) {
+            frame_pairer_push(pairer, i, std::move(frame));
+        };
+
+        if ((status = init(&state->camera[i])) != MMAL_SUCCESS) {
+            vcos_log_error("%s: failed to set up camera %d: %s", __func__,
+                           state->camera[i].common_settings.cameraNum, mmal_status_to_string(status));
+            return status;
+        }
+    }
+
+    return MMAL_SUCCESS;
+}
+
+/**
+ * Switch capturing of both cameras, back to back so that their first frames are close together
+ */
+static MMAL_STATUS_T set_dual_capturing(CAM_DUAL_STATE *state, int capturing) {
+    MMAL_STATUS_T status = MMAL_SUCCESS;
+
+    for (int i = 0; i < 2; i++) {
+        state->camera[i].bCapturing = capturing;
+        if (mmal_port_parameter_set_boolean(state->camera[i].camera_video_port, MMAL_PARAMETER_CAPTURE,
+                                            capturing) != MMAL_SUCCESS) {
+            vcos_log_error("failed to %s capturing on camera %d", capturing ? "start" : "stop",
+                           state->camera[i].common_settings.cameraNum);
+            status = MMAL_EIO;
+        }
+    }
+
+    return status;
+}
+
+/**
+ * Capture from both cameras together.
+ * The wait method, timeout and capture requests (capture_request_stop() etc.) of camera[0] drive both.
+ *
+ * @param state Pointer to state control struct
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T capture_dual(CAM_DUAL_STATE *state) {
+    MMAL_STATUS_T status;
+    int running = 1;
+
+    for (int i = 0; i < 2; i++) {
+        if ((status = send_encoder_buffers(&state->camera[i])) != MMAL_SUCCESS)
+            return status;
+    }
+
+    while (running) {
+        if ((status = set_dual_capturing(state, !state->camera[0].bCapturing)) != MMAL_SUCCESS)
+            return status;
+
+        running = wait_for_next_change(&state->camera[0]);
+    }
+
+    return set_dual_capturing(state, 0);
+}
+
+/**
+ * Destroy both pipelines and release frames still waiting for a match
+ *
+ * @param state Pointer to state control struct
+ */
+void destroy_dual(CAM_DUAL_STATE *state) {
+    // no more frames after this, the pending ones have to go back before the pools are destroyed
+    for (int i = 0; i < 2; i++)
+        check_disable_port(state->camera[i].video_encoder_output_port);
+
+    if (state->pairer) {
+        for (int i = 0; i < 2; i++)
+            frame_pairer_remove(state->pairer, i, state->pairer->pending_num[i]);
+    }
+
+    for (int i = 0; i < 2; i++)
+        destroy(&state->camera[i]);
+
+    if (state->pairer) {
+        vcos_mutex_delete(&state->pairer->lock);
+        delete state->pairer;
+        state->pairer = nullptr;
+    }
+}
+
+/**
+ * Read the frame pairing counters
+ *
+ * @param state Pointer to state control struct
+ * @param stats Filled with the current counters
+ * @return MMAL_SUCCESS, or MMAL_ENOSYS if init_dual() has not been called
+ */
+MMAL_STATUS_T get_dual_stats(CAM_DUAL_STATE *state, CAM_DUAL_STATS *stats) {
+    if (!state->pairer)
+        return MMAL_ENOSYS;
+
+    vcos_mutex_lock(&state->pairer->lock);
+    *stats = state->pairer->stats;
+    vcos_mutex_unlock(&state->pairer->lock);
+    return MMAL_SUCCESS;
+}
@@ -0,0 +1,935 @@
+//
+// Emulated camera, encoder and splitter components, so the pipeline can run on hosts without a camera.
+//
+// The components are plain MMAL host components: the camera produces timestamped frames at the
+// frame rate of its video port, and the encoders turn each frame into a synthetic bitstream of
+// the configured bitrate (H264, MJPEG) or quality (JPEG), fragmented over the output buffers in
+// the same way as the firmware encoders. The splitter and the ISP copy each frame to their opaque
+// outputs and render a test pattern, at the size of the output, on their I420/RGB outputs.
+//
+
+#include "cam.h"
+#include "interface/mmal/core/mmal_component_private.h"
+#include "interface/mmal/core/mmal_port_private.h"
+#include <cstring>
+
+#define EMULATED_CAMERA_NAME "emulated"
+#define EMULATED_NUM_CAMERAS 2
+#define EMULATED_SENSOR_WIDTH 2592
+#define EMULATED_SENSOR_HEIGHT 1944
+#define EMULATED_FRAME_RATE 30
+#define EMULATED_VIDEO_BUFFER_SIZE (64u << 10u)
+#define EMULATED_IMAGE_BUFFER_SIZE (80u << 10u)
+#define EMULATED_DEFAULT_BITRATE 17000000
+#define EMULATED_DEFAULT_INTRAPERIOD 60
+/// Size of a keyframe relative to a predicted frame
+#define EMULATED_KEYFRAME_SCALE 4
+
+/// Frame descriptor passed through the opaque camera ports
+typedef struct {
+    uint32_t frame;
+} EMULATED_FRAME_T;
+
+struct MMAL_PORT_MODULE_T {
+    MMAL_QUEUE_T *queue;        /// Buffers sent to the port by the client
+    MMAL_BOOL_T capture;        /// MMAL_PARAMETER_CAPTURE state of a camera output port
+};
+
+struct MMAL_COMPONENT_MODULE_T {
+    CAM_COMPONENT_TYPE_T type;
+
+    // camera
+    VCOS_THREAD_T thread;
+    VCOS_MUTEX_T lock;
+    int thread_running;
+    volatile int stop;
+    uint32_t frame;
+
+    // encoders
+    uint32_t bitrate;
+    uint32_t intraperiod;
+    uint32_t quality;
+    uint32_t profile;
+    uint32_t level;
+    int inline_headers;
+    int inline_vectors;
+    int request_keyframe;
+    uint32_t encoded_frames;
+    MMAL_BUFFER_HEADER_T *input;    /// Frame currently being encoded
+    int send_config;                /// SPS/PPS have to go out before the current frame
+    int send_vectors;               /// Motion vectors have to go out after the current frame
+    int keyframe;
+    uint32_t frame_size;
+    uint32_t written;
+};
+
+/**
+ * Return every buffer queued on a port to the client
+ * @param port Port to flush
+ */
+static void emulated_port_return_buffers(MMAL_PORT_T *port) {
+    MMAL_BUFFER_HEADER_T *buffer;
+
+    while ((buffer = mmal_queue_get(port->priv->module->queue)))
+        mmal_port_buffer_header_callback(port, buffer);
+}
+
+static MMAL_STATUS_T emulated_port_enable(MMAL_PORT_T *, MMAL_PORT_BH_CB_T) {
+    return MMAL_SUCCESS;
+}
+
+static MMAL_STATUS_T emulated_port_flush(MMAL_PORT_T *port) {
+    emulated_port_return_buffers(port);
+    return MMAL_SUCCESS;
+}
+
+static MMAL_STATUS_T emulated_port_send(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+    mmal_queue_put(port->priv->module->queue, buffer);
+    mmal_component_action_trigger(port->component);
+    return MMAL_SUCCESS;
+}
+
+/**
+ * Port parameters. Everything is accepted, the values the emulation depends on are recorded.
+ */
+static MMAL_STATUS_T emulated_port_parameter_set(MMAL_PORT_T *port, const MMAL_PARAMETER_HEADER_T *param) {
+    MMAL_COMPONENT_MODULE_T *module = port->component->priv->module;
+
+    switch (param->id) {
+        case MMAL_PARAMETER_CAPTURE:
+            if (port->type == MMAL_PORT_TYPE_OUTPUT)
+                port->priv->module->capture = ((const MMAL_PARAMETER_BOOLEAN_T *) param)->enable;
+            break;
+        case MMAL_PARAMETER_VIDEO_BIT_RATE:
+            module->bitrate = ((const MMAL_PARAMETER_UINT32_T *) param)->value;
+            break;
+        case MMAL_PARAMETER_INTRAPERIOD:
+            module->intraperiod = ((const MMAL_PARAMETER_UINT32_T *) param)->value;
+            break;
+        case MMAL_PARAMETER_VIDEO_FRAME_RATE:
+            // the camera is paced by its port format and the encoder budgets from its input format
+            port->format->es->video.frame_rate = ((const MMAL_PARAMETER_FRAME_RATE_T *) param)->value;
+            if (port->component->input_num)
+                port->component->input[0]->format->es->video.frame_rate = port->format->es->video.frame_rate;
+            break;
+        case MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME:
+            module->request_keyframe = ((const MMAL_PARAMETER_BOOLEAN_T *) param)->enable;
+            break;
+        case MMAL_PARAMETER_VIDEO_ENCODE_INLINE_HEADER:
+            module->inline_headers = ((const MMAL_PARAMETER_BOOLEAN_T *) param)->enable;
+            break;
+        case MMAL_PARAMETER_VIDEO_ENCODE_INLINE_VECTORS:
+            module->inline_vectors = ((const MMAL_PARAMETER_BOOLEAN_T *) param)->enable;
+            break;
+        case MMAL_PARAMETER_JPEG_Q_FACTOR:
+            module->quality = ((const MMAL_PARAMETER_UINT32_T *) param)->value;
+            break;
+        case MMAL_PARAMETER_PROFILE: {
+            auto *profile = (const MMAL_PARAMETER_VIDEO_PROFILE_T *) param;
+            module->profile = profile->profile[0].profile;
+            module->level = profile->profile[0].level;
+        }
+            break;
+        default:
+            break;
+    }
+
+    return MMAL_SUCCESS;
+}
+
+static MMAL_STATUS_T emulated_port_parameter_get(MMAL_PORT_T *port, MMAL_PARAMETER_HEADER_T *param) {
+    MMAL_COMPONENT_MODULE_T *module = port->component->priv->module;
+
+    if (module->type == CAM_COMPONENT_CAMERA_INFO && param->id == MMAL_PARAMETER_CAMERA_INFO) {
+        auto *info = (MMAL_PARAMETER_CAMERA_INFO_T *) param;
+
+        // Behave like current firmware, which rejects the undersized legacy structure
+        if (param->size < sizeof(MMAL_PARAMETER_CAMERA_INFO_T))
+            return MMAL_EINVAL;
+
+        info->num_cameras = EMULATED_NUM_CAMERAS;
+        info->num_flashes = 0;
+        for (uint32_t i = 0; i < EMULATED_NUM_CAMERAS; i++) {
+            info->cameras[i].port_id = i;
+            info->cameras[i].max_width = EMULATED_SENSOR_WIDTH;
+            info->cameras[i].max_height = EMULATED_SENSOR_HEIGHT;
+            info->cameras[i].lens_present = MMAL_FALSE;
+            strncpy(info->cameras[i].camera_name, EMULATED_CAMERA_NAME, MMAL_PARAMETER_CAMERA_INFO_MAX_STR_LEN);
+        }
+        return MMAL_SUCCESS;
+    }
+    // the emulated camera stamps its frames with the host clock, so that is the STC
+    if (param->id == MMAL_PARAMETER_SYSTEM_TIME && param->size >= sizeof(MMAL_PARAMETER_UINT64_T)) {
+        ((MMAL_PARAMETER_UINT64_T *) param)->value = get_microseconds64();
+        return MMAL_SUCCESS;
+    }
+
+    return MMAL_ENOSYS;
+}
+
+/**
+ * Frame period of a port in microseconds, taken from its format
+ */
+static uint64_t emulated_frame_period(MMAL_PORT_T *port) {
+    MMAL_RATIONAL_T rate = port->format->es->video.frame_rate;
+
+    if (rate.num <= 0 || rate.den <= 0)
+        return 1000000 / EMULATED_FRAME_RATE;
+    return (uint64_t) rate.den * 1000000 / rate.num;
+}
+
+static MMAL_STATUS_T emulated_camera_set_format(MMAL_PORT_T *port) {
+    port->buffer_size_min = port->buffer_size_recommended = sizeof(EMULATED_FRAME_T);
+    return MMAL_SUCCESS;
+}
+
+static MMAL_STATUS_T emulated_camera_port_disable(MMAL_PORT_T *port) {
+    MMAL_COMPONENT_MODULE_T *module = port->component->priv->module;
+
+    vcos_mutex_lock(&module->lock);
+    port->priv->module->capture = MMAL_FALSE;
+    emulated_port_return_buffers(port);
+    vcos_mutex_unlock(&module->lock);
+    return MMAL_SUCCESS;
+}
+
+static MMAL_STATUS_T emulated_camera_port_send(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+    mmal_queue_put(port->priv->module->queue, buffer);
+    return MMAL_SUCCESS;
+}
+
+/**
+ * Deliver one frame on a camera output port, if the client gave it a buffer
+ */
+static void emulated_camera_emit(MMAL_COMPONENT_T *camera, MMAL_PORT_T *port, uint64_t now) {
+    MMAL_COMPONENT_MODULE_T *module = camera->priv->module;
+    MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(port->priv->module->queue);
+
+    if (!buffer) {
+        vcos_log_trace("%s: no buffer for frame %u", port->name, module->frame);
+        return;
+    }
+
+    EMULATED_FRAME_T frame = {module->frame};
+    memcpy(buffer->data, &frame, sizeof(frame));
+    buffer->length = sizeof(frame);
+    buffer->offset = 0;
+    buffer->flags = MMAL_BUFFER_HEADER_FLAG_FRAME_END; // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+    // Like MMAL_PARAM_TIMESTAMP_MODE_RAW_STC, frames carry the time they were "exposed"
+    buffer->pts = buffer->dts = (int64_t) now;
+    mmal_port_buffer_header_callback(port, buffer);
+}
+
+/**
+ * Sensor emulation: paced by the frame rate of the video port
+ */
+static void *emulated_camera_thread(void *arg) {
+    auto *camera = (MMAL_COMPONENT_T *) arg;
+    MMAL_COMPONENT_MODULE_T *module = camera->priv->module;
+    uint64_t next_frame_us = get_microseconds64();
+
+    while (!module->stop) {
+        uint64_t period = emulated_frame_period(camera->output[MMAL_CAMERA_VIDEO_PORT]);
+        uint64_t now = get_microseconds64();
+
+        if (now < next_frame_us) {
+            vcos_sleep((uint32_t) ((next_frame_us - now + 999) / 1000));
+            continue;
+        }
+
+        // Don't try to catch up after a stall, a sensor just carries on
+        next_frame_us += period;
+        if (next_frame_us < now)
+            next_frame_us = now + period;
+
+        vcos_mutex_lock(&module->lock);
+        MMAL_PORT_T *preview = camera->output[MMAL_CAMERA_PREVIEW_PORT];
+        MMAL_PORT_T *video = camera->output[MMAL_CAMERA_VIDEO_PORT];
+        MMAL_PORT_T *still = camera->output[MMAL_CAMERA_CAPTURE_PORT];
+
+        if (preview->is_enabled)
+            emulated_camera_emit(camera, preview, now);
+        if (video->is_enabled && video->priv->module->capture)
+            emulated_camera_emit(camera, video, now);
+        if (still->is_enabled && still->priv->module->capture) {
+            // stills are one shot
+            still->priv->module->capture = MMAL_FALSE;
+            emulated_camera_emit(camera, still, now);
+        }
+        module->frame++;
+        vcos_mutex_unlock(&module->lock);
+    }
+
+    return nullptr;
+}
+
+/// Minimal RBSP writer for the synthetic parameter sets
+typedef struct {
+    uint8_t data[64];
+    uint32_t bits;
+} EMULATED_BIT_WRITER_T;
+
+static void put_bits(EMULATED_BIT_WRITER_T *w, uint32_t value, int count) {
+    for (int i = count - 1; i >= 0; i--) {
+        if ((value >> (unsigned) i) & 1u)
+            w->data[w->bits >> 3u] |= (uint8_t) (0x80u >> (w->bits & 7u));
+        w->bits++;
+    }
+}
+
+static void put_ue(EMULATED_BIT_WRITER_T *w, uint32_t value) {
+    value++;
+    int length = 32 - __builtin_clz(value);
+    put_bits(w, 0, length - 1);
+    put_bits(w, value, length);
+}
+
+static void put_trailing_bits(EMULATED_BIT_WRITER_T *w) {
+    put_bits(w, 1, 1);
+    while (w->bits & 7u)
+        put_bits(w, 0, 1);
+}
+
+/**
+ * Write a NAL unit with start code, adding emulation prevention bytes
+ * @return number of bytes written
+ */
+static uint32_t write_nal(uint8_t *dst, uint8_t header, const EMULATED_BIT_WRITER_T *w) {
+    uint32_t pos = 0, zeros = 0;
+
+    dst[pos++] = 0;
+    dst[pos++] = 0;
+    dst[pos++] = 0;
+    dst[pos++] = 1;
+    dst[pos++] = header;
+    for (uint32_t i = 0; i < w->bits / 8; i++) {
+        if (zeros >= 2 && w->data[i] <= 3) {
+            dst[pos++] = 3;
+            zeros = 0;
+        }
+        dst[pos++] = w->data[i];
+        zeros = w->data[i] ? 0 : zeros + 1;
+    }
+    return pos;
+}
+
+/**
+ * Write SPS and PPS describing the frames of the encoder input port
+ * @return number of bytes written
+ */
+static uint32_t emulated_write_parameter_sets(MMAL_COMPONENT_T *encoder, uint8_t *dst) {
+    MMAL_COMPONENT_MODULE_T *module = encoder->priv->module;
+    MMAL_VIDEO_FORMAT_T *video = &encoder->input[0]->format->es->video;
+    uint32_t width = video->crop.width ? video->crop.width : video->width;
+    uint32_t height = video->crop.height ? video->crop.height : video->height;
+    uint32_t mb_width = (width + 15) / 16, mb_height = (height + 15) / 16;
+    uint32_t profile_idc = 66, level_idc = 40;
+    EMULATED_BIT_WRITER_T sps{}, pps{};
+
+    if (module->profile == MMAL_VIDEO_PROFILE_H264_MAIN)
+        profile_idc = 77;
+    else if (module->profile == MMAL_VIDEO_PROFILE_H264_HIGH)
+        profile_idc = 100;
+    if (module->level == MMAL_VIDEO_LEVEL_H264_41)
+        level_idc = 41;
+    else if (module->level == MMAL_VIDEO_LEVEL_H264_42)
+        level_idc = 42;
+
+    put_bits(&sps, profile_idc, 8);
+    put_bits(&sps, profile_idc == 66 ? 0xC0 : 0x00, 8); // constraint flags
+    put_bits(&sps, level_idc, 8);
+    put_ue(&sps, 0);                  // seq_parameter_set_id
+    if (profile_idc == 100) {
+        put_ue(&sps, 1);              // chroma_format_idc 4:2:0
+        put_ue(&sps, 0);              // bit_depth_luma_minus8
+        put_ue(&sps, 0);              // bit_depth_chroma_minus8
+        put_bits(&sps, 0, 1);         // qpprime_y_zero_transform_bypass_flag
+        put_bits(&sps, 0, 1);         // seq_scaling_matrix_present_flag
+    }
+    put_ue(&sps, 0);                  // log2_max_frame_num_minus4
+    put_ue(&sps, 2);                  // pic_order_cnt_type
+    put_ue(&sps, 1);                  // max_num_ref_frames
+    put_bits(&sps, 0, 1);             // gaps_in_frame_num_value_allowed_flag
+    put_ue(&sps, mb_width - 1);
+    put_ue(&sps, mb_height - 1);
+    put_bits(&sps, 1, 1);             // frame_mbs_only_flag
+    put_bits(&sps, 1, 1);             // direct_8x8_inference_flag
+    if (mb_width * 16 != width || mb_height * 16 != height) {
+        put_bits(&sps, 1, 1);         // frame_cropping_flag, in 4:2:0 chroma units
+        put_ue(&sps, 0);
+        put_ue(&sps, (mb_width * 16 - width) / 2);
+        put_ue(&sps, 0);
+        put_ue(&sps, (mb_height * 16 - height) / 2);
+    } else {
+        put_bits(&sps, 0, 1);
+    }
+    put_bits(&sps, 0, 1);             // vui_parameters_present_flag
+    put_trailing_bits(&sps);
+
+    put_ue(&pps, 0);                  // pic_parameter_set_id
+    put_ue(&pps, 0);                  // seq_parameter_set_id
+    put_bits(&pps, 0, 1);             // entropy_coding_mode_flag
+    put_bits(&pps, 0, 1);             // bottom_field_pic_order_in_frame_present_flag
+    put_ue(&pps, 0);                  // num_slice_groups_minus1
+    put_ue(&pps, 0);                  // num_ref_idx_l0_default_active_minus1
+    put_ue(&pps, 0);                  // num_ref_idx_l1_default_active_minus1
+    put_bits(&pps, 0, 1);             // weighted_pred_flag
+    put_bits(&pps, 0, 2);             // weighted_bipred_idc
+    put_ue(&pps, 0);                  // pic_init_qp_minus26
+    put_ue(&pps, 0);                  // pic_init_qs_minus26
+    put_ue(&pps, 0);                  // chroma_qp_index_offset
+    put_bits(&pps, 1, 1);             // deblocking_filter_control_present_flag
+    put_bits(&pps, 0, 1);             // constrained_intra_pred_flag
+    put_bits(&pps, 0, 1);             // redundant_pic_cnt_present_flag
+    put_trailing_bits(&pps);
+
+    uint32_t length = write_nal(dst, 0x67, &sps);
+    return length + write_nal(dst + length, 0x68, &pps);
+}
+
+/**
+ * Work out the size and type of the frame about to be encoded
+ */
+static void emulated_encoder_begin_frame(MMAL_COMPONENT_T *encoder) {
+    MMAL_COMPONENT_MODULE_T *module = encoder->priv->module;
+    MMAL_PORT_T *input = encoder->input[0], *output = encoder->output[0];
+    MMAL_VIDEO_FORMAT_T *video = &input->format->es->video;
+    uint64_t pixels = (uint64_t) video->width * video->height;
+
+    if (module->type == CAM_COMPONENT_IMAGE_ENCODER) {
+        uint32_t quality = module->quality ? module->quality : 85;
+        module->keyframe = 1;
+        module->send_config = 0;
+        module->frame_size = (uint32_t) vcos_max(pixels * quality / 200, 1024);
+    } else {
+        uint32_t bitrate = module->bitrate ? module->bitrate : output->format->bitrate;
+        uint64_t average = (bitrate ? bitrate : EMULATED_DEFAULT_BITRATE) * emulated_frame_period(input) / 8000000;
+
+        if (output->format->encoding == MMAL_ENCODING_H264) { // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+            uint32_t period = module->intraperiod && module->intraperiod != (uint32_t) -1 ?
+                              module->intraperiod : EMULATED_DEFAULT_INTRAPERIOD;
+            // Split the bit budget of a GOP so the stream averages out at the bitrate
+            uint64_t predicted = average * period / (period + EMULATED_KEYFRAME_SCALE - 1);
+
+            module->keyframe = module->request_keyframe || module->encoded_frames % period == 0;
+            module->send_config = module->encoded_frames == 0 || (module->keyframe && module->inline_headers);
+            module->frame_size = (uint32_t) vcos_max(module->keyframe ? predicted * EMULATED_KEYFRAME_SCALE : predicted,
+                                                     64);
+            module->request_keyframe = 0;
+        } else {
+            module->keyframe = 1;
+            module->send_config = 0;
+            module->frame_size = (uint32_t) vcos_max(average, 1024);
+        }
+    }
+    module->written = 0;
+}
+
+/**
+ * Write the motion vectors of the current frame: a static background and an 8x8 macroblock
+ * object moving right by one macroblock per frame
+ * @return number of bytes written
+ */
+static uint32_t emulated_write_vectors(MMAL_COMPONENT_T *encoder, MMAL_BUFFER_HEADER_T *out) {
+    MMAL_COMPONENT_MODULE_T *module = encoder->priv->module;
+    MMAL_VIDEO_FORMAT_T *video = &encoder->input[0]->format->es->video;
+    // like the firmware, there is one extra column per row
+    uint32_t columns = (video->width + 15) / 16 + 1, rows = (video->height + 15) / 16;
+    uint32_t object_x = module->encoded_frames % columns, object_y = rows / 2;
+    auto *vectors = (CAM_MOTION_VECTOR *) out->data;
+
+    rows = vcos_min(rows, out->alloc_size / (columns * (uint32_t) sizeof(CAM_MOTION_VECTOR)));
+    for (uint32_t y = 0; y < rows; y++) {
+        for (uint32_t x = 0; x < columns; x++) {
+            CAM_MOTION_VECTOR *vector = &vectors[y * columns + x];
+            int moving = !module->keyframe && x - object_x < 8 && y - object_y < 8;
+
+            vector->x = (int8_t) (moving ? -16 : 0);
+            vector->y = 0;
+            vector->sad = (uint16_t) (moving ? 2000 : 100 + (x * 7 + y * 13 + module->encoded_frames) % 64);
+        }
+    }
+    return rows * columns * (uint32_t) sizeof(CAM_MOTION_VECTOR);
+}
+
+/**
+ * Fill one output buffer with the next part of the current frame
+ * @return !0 if the frame is complete
+ */
+static int emulated_encoder_fill(MMAL_COMPONENT_T *encoder, MMAL_BUFFER_HEADER_T *out) {
+    MMAL_COMPONENT_MODULE_T *module = encoder->priv->module;
+    MMAL_FOURCC_T encoding = encoder->output[0]->format->encoding;
+    int h264 = encoding == MMAL_ENCODING_H264; // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+    int64_t pts = module->input->pts;
+
+    out->offset = 0;
+    out->dts = out->pts = pts;
+
+    if (module->send_vectors) {
+        out->length = emulated_write_vectors(encoder, out);
+        out->flags = MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO; // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+        module->send_vectors = 0;
+        module->encoded_frames++;
+        return 1;
+    }
+
+    if (module->send_config) {
+        out->length = emulated_write_parameter_sets(encoder, out->data);
+        out->flags = MMAL_BUFFER_HEADER_FLAG_CONFIG; // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+        out->pts = out->dts = MMAL_TIME_UNKNOWN;
+        module->send_config = 0;
+        return 0;
+    }
+
+    uint32_t remaining = module->frame_size - module->written;
+    uint32_t length = vcos_min(remaining, out->alloc_size);
+    uint32_t pos = 0;
+
+    // the JPEG EOI marker goes in the last buffer whole, which takes a byte from this one if only one would be left
+    if (!h264 && remaining - length == 1 && length > 1)
+        length--;
+
+    if (module->written == 0) {
+        if (h264) {
+            const uint8_t header[] = {0, 0, 0, 1, (uint8_t) (module->keyframe ? 0x65 : 0x41)};
+            memcpy(out->data, header, sizeof(header));
+            pos = sizeof(header);
+        } else {
+            const uint8_t soi[] = {0xFF, 0xD8, 0xFF, 0xDB};
+            memcpy(out->data, soi, sizeof(soi));
+            pos = sizeof(soi);
+        }
+    }
+
+    // Filler never contains 0x00 (no start code emulation) nor 0xFF (no JPEG markers)
+    for (; pos < length; pos++)
+        out->data[pos] = (uint8_t) (1 + (module->written + pos + module->encoded_frames * 7) % 253);
+
+    module->written += length;
+    out->length = length;
+    out->flags = module->keyframe ? MMAL_BUFFER_HEADER_FLAG_KEYFRAME : 0; // NOLINT(hicpp-signed-bitwise)
+
+    if (module->written < module->frame_size)
+        return 0;
+
+    if (!h264 && length >= 2) {
+        out->data[length - 2] = 0xFF;
+        out->data[length - 1] = 0xD9;
+    }
+    out->flags |= MMAL_BUFFER_HEADER_FLAG_FRAME_END; // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+
+    // the vectors follow the frame in their own buffer
+    if (h264 && module->inline_vectors) {
+        module->send_vectors = 1;
+        return 0;
+    }
+    module->encoded_frames++;
+    return 1;
+}
+
+/**
+ * Encoder processing, runs on the component action thread
+ */
+static void emulated_encoder_do_processing(MMAL_COMPONENT_T *encoder) {
+    MMAL_COMPONENT_MODULE_T *module = encoder->priv->module;
+    MMAL_PORT_T *input = encoder->input[0], *output = encoder->output[0];
+
+    while (input->is_enabled && output->is_enabled) {
+        if (!module->input) {
+            if (!(module->input = mmal_queue_get(input->priv->module->queue)))
+                break;
+            emulated_encoder_begin_frame(encoder);
+        }
+
+        MMAL_BUFFER_HEADER_T *out = mmal_queue_get(output->priv->module->queue);
+        if (!out)
+            break;
+
+        int complete = emulated_encoder_fill(encoder, out);
+        mmal_port_buffer_header_callback(output, out);
+
+        if (complete) {
+            module->input->length = 0;
+            mmal_port_buffer_header_callback(input, module->input);
+            module->input = nullptr;
+        }
+    }
+}
+
+/**
+ * Render a test pattern for a frame on a raw (I420/RGB24/BGR24) splitter output: a gradient moving right
+ * by one pixel per frame, on grey chroma
+ * @return number of bytes written, 0 if the buffer is too small
+ */
+static uint32_t emulated_splitter_render(MMAL_PORT_T *port, const EMULATED_FRAME_T *frame, MMAL_BUFFER_HEADER_T *out) {
+    MMAL_VIDEO_FORMAT_T *video = &port->format->es->video;
+    uint32_t stride = mmal_encoding_width_to_stride(port->format->encoding, video->width);
+
+    if (port->format->encoding == MMAL_ENCODING_I420) { // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+        uint32_t luma = stride * video->height, length = luma * 3 / 2;
+
+        if (out->alloc_size < length)
+            return 0;
+        for (uint32_t y = 0; y < video->height; y++) {
+            for (uint32_t x = 0; x < stride; x++)
+                out->data[y * stride + x] = (uint8_t) (x + y + frame->frame);
+        }
+        memset(out->data + luma, 128, length - luma);
+        return length;
+    }
+
+    uint32_t length = stride * video->height;
+    if (out->alloc_size < length)
+        return 0;
+    for (uint32_t y = 0; y < video->height; y++) {
+        uint8_t *row = out->data + y * stride;
+        for (uint32_t x = 0; x < video->width; x++) {
+            row[x * 3] = (uint8_t) (x + frame->frame);
+            row[x * 3 + 1] = (uint8_t) y;
+            row[x * 3 + 2] = 128;
+        }
+    }
+    return length;
+}
+
+/**
+ * Splitter and ISP processing, runs on the component action thread. Outputs without a buffer miss the frame.
+ */
+static void emulated_splitter_do_processing(MMAL_COMPONENT_T *splitter) {
+    MMAL_PORT_T *input = splitter->input[0];
+    MMAL_BUFFER_HEADER_T *in;
+
+    while (input->is_enabled && (in = mmal_queue_get(input->priv->module->queue))) {
+        EMULATED_FRAME_T frame{};
+        memcpy(&frame, in->data + in->offset, vcos_min(in->length, (uint32_t) sizeof(frame)));
+
+        for (uint32_t i = 0; i < splitter->output_num; i++) {
+            MMAL_PORT_T *port = splitter->output[i];
+            MMAL_BUFFER_HEADER_T *out;
+
+            if (!port->is_enabled || !(out = mmal_queue_get(port->priv->module->queue)))
+                continue;
+
+            if (port->format->encoding == MMAL_ENCODING_OPAQUE) { // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+                memcpy(out->data, &frame, sizeof(frame));
+                out->length = sizeof(frame);
+            } else {
+                out->length = emulated_splitter_render(port, &frame, out);
+            }
+            out->offset = 0;
+            out->flags = in->flags;
+            out->pts = in->pts;
+            out->dts = in->dts;
+            mmal_port_buffer_header_callback(port, out);
+        }
+
+        in->length = 0;
+        mmal_port_buffer_header_callback(input, in);
+    }
+}
+
+static MMAL_STATUS_T emulated_splitter_set_format(MMAL_PORT_T *port) {
+    MMAL_VIDEO_FORMAT_T *video = &port->format->es->video;
+
+    if (port->format->encoding == MMAL_ENCODING_OPAQUE) { // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+        port->buffer_size_min = port->buffer_size_recommended = sizeof(EMULATED_FRAME_T);
+    } else if (port->format->encoding == MMAL_ENCODING_I420) { // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+        port->buffer_size_min = port->buffer_size_recommended = video->width * video->height * 3 / 2;
+    } else if (port->format->encoding == MMAL_ENCODING_RGB24 || // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+               port->format->encoding == MMAL_ENCODING_BGR24) { // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+        port->buffer_size_min = port->buffer_size_recommended =
+                mmal_encoding_width_to_stride(port->format->encoding, video->width) * video->height;
+    } else {
+        return MMAL_EINVAL;
+    }
+    return MMAL_SUCCESS;
+}
+
+static MMAL_STATUS_T emulated_splitter_port_disable(MMAL_PORT_T *port) {
+    mmal_component_action_lock(port->component);
+    emulated_port_return_buffers(port);
+    mmal_component_action_unlock(port->component);
+    return MMAL_SUCCESS;
+}
+
+static MMAL_STATUS_T emulated_encoder_set_format(MMAL_PORT_T *port) {
+    if (port->type == MMAL_PORT_TYPE_INPUT) {
+        port->buffer_size_min = port->buffer_size_recommended = sizeof(EMULATED_FRAME_T);
+        // The output follows the input frame geometry, but keeps its own encoding and bitrate
+        port->component->output[0]->format->es->video = port->format->es->video;
+    }
+    return MMAL_SUCCESS;
+}
+
+static MMAL_STATUS_T emulated_encoder_port_disable(MMAL_PORT_T *port) {
+    MMAL_COMPONENT_MODULE_T *module = port->component->priv->module;
+
+    mmal_component_action_lock(port->component);
+    if (port->type == MMAL_PORT_TYPE_INPUT && module->input) {
+        mmal_port_buffer_header_callback(port, module->input);
+        module->input = nullptr;
+    }
+    emulated_port_return_buffers(port);
+    mmal_component_action_unlock(port->component);
+    return MMAL_SUCCESS;
+}
+
+/**
+ * Sink processing: every buffer is consumed straight away
+ */
+static MMAL_STATUS_T emulated_sink_send(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+    buffer->length = 0;
+    mmal_port_buffer_header_callback(port, buffer);
+    return MMAL_SUCCESS;
+}
+
+static MMAL_STATUS_T emulated_accept_format(MMAL_PORT_T *) {
+    return MMAL_SUCCESS;
+}
+
+static MMAL_STATUS_T emulated_component_destroy(MMAL_COMPONENT_T *component) {
+    MMAL_COMPONENT_MODULE_T *module = component->priv->module;
+
+    if (module->thread_running) {
+        module->stop = 1;
+        vcos_thread_join(&module->thread, nullptr);
+        vcos_mutex_delete(&module->lock);
+    } else if (module->type == CAM_COMPONENT_VIDEO_ENCODER || module->type == CAM_COMPONENT_IMAGE_ENCODER ||
+               module->type == CAM_COMPONENT_SPLITTER || module->type == CAM_COMPONENT_ISP) {
+        mmal_component_action_deregister(component);
+    }
+
+    for (uint32_t i = 0; i < component->input_num; i++) {
+        if (component->input[i]->priv->module->queue)
+            mmal_queue_destroy(component->input[i]->priv->module->queue);
+    }
+    for (uint32_t i = 0; i < component->output_num; i++) {
+        if (component->output[i]->priv->module->queue)
+            mmal_queue_destroy(component->output[i]->priv->module->queue);
+    }
+    if (component->input_num)
+        mmal_ports_free(component->input, component->input_num);
+    if (component->output_num)
+        mmal_ports_free(component->output, component->output_num);
+
+    vcos_free(module);
+    return MMAL_SUCCESS;
+}
+
+/**
+ * Allocate the ports of a component and hook up the shared port functions
+ */
+static MMAL_STATUS_T emulated_ports_alloc(MMAL_COMPONENT_T *component, MMAL_PORT_TYPE_T type, unsigned int num,
+                                          MMAL_PORT_T ***ports) {
+    *ports = mmal_ports_alloc(component, num, type, sizeof(MMAL_PORT_MODULE_T));
+    if (!*ports)
+        return MMAL_ENOMEM;
+
+    for (unsigned int i = 0; i < num; i++) {
+        MMAL_PORT_T *port = (*ports)[i];
+
+        port->priv->pf_enable = emulated_port_enable;
+        port->priv->pf_flush = emulated_port_flush;
+        port->priv->pf_send = emulated_port_send;
+        port->priv->pf_set_format = emulated_accept_format;
+        port->priv->pf_parameter_set = emulated_port_parameter_set;
+        port->priv->pf_parameter_get = emulated_port_parameter_get;
+        port->priv->module->queue = mmal_queue_create();
+        if (!port->priv->module->queue)
+            return MMAL_ENOMEM;
+
+        port->format->type = MMAL_ES_TYPE_VIDEO;
+        port->format->encoding = MMAL_ENCODING_OPAQUE; // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+        port->format->es->video.width = 1920;
+        port->format->es->video.height = 1088;
+        port->format->es->video.crop.width = 1920;
+        port->format->es->video.crop.height = 1080;
+        port->buffer_num_min = 1;
+        port->buffer_num_recommended = VIDEO_OUTPUT_BUFFERS_NUM;
+        port->buffer_size_min = port->buffer_size_recommended = sizeof(EMULATED_FRAME_T);
+    }
+    return MMAL_SUCCESS;
+}
+
+static MMAL_STATUS_T emulated_camera_create(const char *, MMAL_COMPONENT_T *component) {
+    MMAL_COMPONENT_MODULE_T *module = component->priv->module;
+    MMAL_STATUS_T status;
+
+    component->priv->pf_destroy = emulated_component_destroy;
+    component->control->priv->pf_parameter_set = emulated_port_parameter_set;
+    component->control->priv->pf_parameter_get = emulated_port_parameter_get;
+
+    status = emulated_ports_alloc(component, MMAL_PORT_TYPE_OUTPUT, 3, &component->output);
+    if (component->output)
+        component->output_num = 3;
+    if (status != MMAL_SUCCESS)
+        return status;
+
+    for (uint32_t i = 0; i < component->output_num; i++) {
+        component->output[i]->priv->pf_set_format = emulated_camera_set_format;
+        component->output[i]->priv->pf_disable = emulated_camera_port_disable;
+        component->output[i]->priv->pf_send = emulated_camera_port_send;
+    }
+
+    if (vcos_mutex_create(&module->lock, "emulated-camera") != VCOS_SUCCESS)
+        return MMAL_ENOMEM;
+    if (vcos_thread_create(&module->thread, "emulated-camera", nullptr, emulated_camera_thread, component) !=
+        VCOS_SUCCESS) {
+        vcos_mutex_delete(&module->lock);
+        return MMAL_ENOMEM;
+    }
+    module->thread_running = 1;
+    return MMAL_SUCCESS;
+}
+
+static MMAL_STATUS_T emulated_encoder_create(const char *, MMAL_COMPONENT_T *component) {
+    MMAL_COMPONENT_MODULE_T *module = component->priv->module;
+    MMAL_STATUS_T status;
+
+    component->priv->pf_destroy = emulated_component_destroy;
+    component->control->priv->pf_parameter_set = emulated_port_parameter_set;
+    component->control->priv->pf_parameter_get = emulated_port_parameter_get;
+
+    status = emulated_ports_alloc(component, MMAL_PORT_TYPE_INPUT, 1, &component->input);
+    if (component->input)
+        component->input_num = 1;
+    if (status != MMAL_SUCCESS)
+        return status;
+    status = emulated_ports_alloc(component, MMAL_PORT_TYPE_OUTPUT, 1, &component->output);
+    if (component->output)
+        component->output_num = 1;
+    if (status != MMAL_SUCCESS)
+        return status;
+
+    component->input[0]->priv->pf_set_format = emulated_encoder_set_format;
+    component->input[0]->priv->pf_disable = emulated_encoder_port_disable;
+    component->output[0]->priv->pf_set_format = emulated_encoder_set_format;
+    component->output[0]->priv->pf_disable = emulated_encoder_port_disable;
+    component->output[0]->buffer_size_min = 4096;
+    component->output[0]->buffer_size_recommended =
+            module->type == CAM_COMPONENT_IMAGE_ENCODER ? EMULATED_IMAGE_BUFFER_SIZE : EMULATED_VIDEO_BUFFER_SIZE;
+
+    return mmal_component_action_register(component, emulated_encoder_do_processing);
+}
+
+static MMAL_STATUS_T emulated_splitter_create(const char *, MMAL_COMPONENT_T *component) {
+    MMAL_STATUS_T status;
+
+    component->priv->pf_destroy = emulated_component_destroy;
+    component->control->priv->pf_parameter_set = emulated_port_parameter_set;
+    component->control->priv->pf_parameter_get = emulated_port_parameter_get;
+
+    status = emulated_ports_alloc(component, MMAL_PORT_TYPE_INPUT, 1, &component->input);
+    if (component->input)
+        component->input_num = 1;
+    if (status != MMAL_SUCCESS)
+        return status;
+    // like vc.ril.video_splitter, the ISP only emulates its main output
+    unsigned int outputs = component->priv->module->type == CAM_COMPONENT_ISP ? 1 : 4;
+    status = emulated_ports_alloc(component, MMAL_PORT_TYPE_OUTPUT, outputs, &component->output);
+    if (component->output)
+        component->output_num = outputs;
+    if (status != MMAL_SUCCESS)
+        return status;
+
+    component->input[0]->priv->pf_set_format = emulated_splitter_set_format;
+    component->input[0]->priv->pf_disable = emulated_splitter_port_disable;
+    for (uint32_t i = 0; i < component->output_num; i++) {
+        component->output[i]->priv->pf_set_format = emulated_splitter_set_format;
+        component->output[i]->priv->pf_disable = emulated_splitter_port_disable;
+    }
+
+    return mmal_component_action_register(component, emulated_splitter_do_processing);
+}
+
+static MMAL_STATUS_T emulated_sink_create(const char *, MMAL_COMPONENT_T *component) {
+    MMAL_STATUS_T status;
+
+    component->priv->pf_destroy = emulated_component_destroy;
+    component->control->priv->pf_parameter_set = emulated_port_parameter_set;
+    component->control->priv->pf_parameter_get = emulated_port_parameter_get;
+
+    status = emulated_ports_alloc(component, MMAL_PORT_TYPE_INPUT, 1, &component->input);
+    if (component->input)
+        component->input_num = 1;
+    if (status != MMAL_SUCCESS)
+        return status;
+    component->input[0]->priv->pf_disable = emulated_port_flush;
+    component->input[0]->priv->pf_send = emulated_sink_send;
+    return MMAL_SUCCESS;
+}
+
+static MMAL_STATUS_T emulated_camera_info_create(const char *, MMAL_COMPONENT_T *component) {
+    component->priv->pf_destroy = emulated_component_destroy;
+    component->control->priv->pf_parameter_set = emulated_port_parameter_set;
+    component->control->priv->pf_parameter_get = emulated_port_parameter_get;
+    return MMAL_SUCCESS;
+}
+
+/**
+ * Create an emulated host component
+ *
+ * @param type Role of the component to create
+ * @param component Pointer to the created component, set if successful
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+static MMAL_STATUS_T emulated_backend_component_create(CAM_COMPONENT_TYPE_T type, MMAL_COMPONENT_T **component) {
+    MMAL_STATUS_T (*constructor)(const char *, MMAL_COMPONENT_T *);
+    const char *name;
+
+    switch (type) {
+        case CAM_COMPONENT_CAMERA:
+            name = "emulated.camera";
+            constructor = emulated_camera_create;
+            break;
+        case CAM_COMPONENT_CAMERA_INFO:
+            name = "emulated.camera_info";
+            constructor = emulated_camera_info_create;
+            break;
+        case CAM_COMPONENT_VIDEO_ENCODER:
+            name = "emulated.video_encode";
+            constructor = emulated_encoder_create;
+            break;
+        case CAM_COMPONENT_IMAGE_ENCODER:
+            name = "emulated.image_encode";
+            constructor = emulated_encoder_create;
+            break;
+        case CAM_COMPONENT_SPLITTER:
+            name = "emulated.video_splitter";
+            constructor = emulated_splitter_create;
+            break;
+        case CAM_COMPONENT_ISP:
+            name = "emulated.isp";
+            constructor = emulated_splitter_create;
+            break;
+        case CAM_COMPONENT_VIDEO_RENDERER:
+        case CAM_COMPONENT_NULL_SINK:
+            name = "emulated.null_sink";
+            constructor = emulated_sink_create;
+            break;
+        default:
+            return MMAL_ENOSYS;
+    }
+
+    // The module is handed to the constructor through the core, so the type is known up front
+    auto *module = (MMAL_COMPONENT_MODULE_T *) vcos_calloc(1, sizeof(MMAL_COMPONENT_MODULE_T), name);
+    if (!module)
+        return MMAL_ENOMEM;
+    module->type = type;
+
+    MMAL_STATUS_T status = mmal_component_create_with_constructor(name, constructor, module, component);
+    if (status != MMAL_SUCCESS)
+        vcos_log_error("Failed to create emulated component %s: %s", name, mmal_status_to_string(status));
+    return status;
+}
+
+static void emulated_host_init(void) {
+    static int initted;
+
+    if (initted)
+        return;
+    initted = 1;
+    vcos_init();
+}
+
+const CAM_BACKEND emulated_backend = {"emulated", emulated_host_init, emulated_backend_component_create};
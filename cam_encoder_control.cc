@@ -0,0 +1,143 @@
+//
+// Changing the rate settings of a running video pipeline.
+//
+// Bitrate, QP and intraperiod are encoder output port parameters and the frame rate is a camera
+// video port parameter; the firmware takes all of them while the ports are enabled, so nothing is
+// torn down. The encoder's rate control only settles on the new settings from the frame it gets
+// them at, so the change is made to land at a keyframe: one is requested right after the
+// parameters, and the stream switches over at a point where a decoder or a new segment can start.
+//
+
+#include "cam.h"
+
+/**
+ * @return The highest bitrate the encoder takes for the configured encoding and level
+ */
+static int encoder_control_max_bitrate(CAM_STATE *state) {
+    if (state->encoding == MMAL_ENCODING_MJPEG) // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+        return MAX_BITRATE_MJPEG;
+    return state->level == MMAL_VIDEO_LEVEL_H264_4 ? MAX_BITRATE_LEVEL4 : MAX_BITRATE_LEVEL42;
+}
+
+/**
+ * Set the fixed QP of the H264 encoder, or lift it with 0
+ */
+static MMAL_STATUS_T encoder_control_set_qp(MMAL_PORT_T *port, uint32_t qp) {
+    MMAL_STATUS_T status;
+
+    // the initial QP only matters with a fixed QP, 0 is not a valid initial value
+    if (qp && (status = mmal_port_parameter_set_uint32(port, MMAL_PARAMETER_VIDEO_ENCODE_INITIAL_QUANT, qp)) !=
+              MMAL_SUCCESS)
+        return status;
+    if ((status = mmal_port_parameter_set_uint32(port, MMAL_PARAMETER_VIDEO_ENCODE_MIN_QUANT, qp)) != MMAL_SUCCESS)
+        return status;
+    return mmal_port_parameter_set_uint32(port, MMAL_PARAMETER_VIDEO_ENCODE_MAX_QUANT, qp);
+}
+
+/**
+ * set_encoder_control() for a caller holding state->encoder_control_lock, e.g. to change the settings
+ * based on the current ones without another change coming in between
+ *
+ * @param state Pointer to state control struct
+ * @param control The settings to change, those in control->flags
+ * @return As set_encoder_control()
+ */
+MMAL_STATUS_T encoder_control_apply(CAM_STATE *state, const ENCODER_CONTROL *control) {
+    MMAL_PORT_T *encoder_output = state->video_encoder_output_port;
+    int h264 = state->encoding == MMAL_ENCODING_H264; // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+    MMAL_STATUS_T status;
+
+    if (!encoder_output || !state->camera_video_port)
+        return MMAL_EINVAL;
+    if ((control->flags & (ENCODER_CONTROL_QP | ENCODER_CONTROL_INTRAPERIOD)) && !h264) {
+        vcos_log_error("%s: QP and intraperiod can only be changed for H264", __func__);
+        return MMAL_EINVAL;
+    }
+    if ((control->flags & ENCODER_CONTROL_FRAMERATE) && !control->framerate) {
+        vcos_log_error("%s: a variable frame rate can only be set up by init()", __func__);
+        return MMAL_EINVAL;
+    }
+
+    if (control->flags & ENCODER_CONTROL_BITRATE) {
+        int bitrate = vcos_min(vcos_max(control->bitrate, 0), encoder_control_max_bitrate(state));
+
+        status = mmal_port_parameter_set_uint32(encoder_output, MMAL_PARAMETER_VIDEO_BIT_RATE, (uint32_t) bitrate);
+        if (status != MMAL_SUCCESS) {
+            vcos_log_error("%s: unable to set the bitrate: %s", __func__, mmal_status_to_string(status));
+            return status;
+        }
+        state->bitrate = bitrate;
+    }
+
+    if (control->flags & ENCODER_CONTROL_QP) {
+        if ((status = encoder_control_set_qp(encoder_output, control->quantisationParameter)) != MMAL_SUCCESS) {
+            vcos_log_error("%s: unable to set the QP: %s", __func__, mmal_status_to_string(status));
+            return status;
+        }
+        state->quantisationParameter = control->quantisationParameter;
+    }
+
+    if (control->flags & ENCODER_CONTROL_FRAMERATE) {
+        MMAL_PARAMETER_FRAME_RATE_T rate = {{MMAL_PARAMETER_VIDEO_FRAME_RATE, sizeof(rate)},
+                                            {(int32_t) control->framerate, VIDEO_FRAME_RATE_DEN}};
+
+        if ((status = mmal_port_parameter_set(state->camera_video_port, &rate.hdr)) != MMAL_SUCCESS) {
+            vcos_log_error("%s: unable to set the frame rate: %s", __func__, mmal_status_to_string(status));
+            return status;
+        }
+        // the encoder budgets its bits per frame from the rate it was told at connection
+        if ((status = mmal_port_parameter_set(encoder_output, &rate.hdr)) != MMAL_SUCCESS) {
+            vcos_log_error("%s: unable to set the encoder frame rate: %s", __func__, mmal_status_to_string(status));
+            return status;
+        }
+        state->framerate = control->framerate;
+    }
+
+    if (control->flags & ENCODER_CONTROL_INTRAPERIOD) {
+        status = mmal_port_parameter_set_uint32(encoder_output, MMAL_PARAMETER_INTRAPERIOD, control->intraperiod);
+        if (status != MMAL_SUCCESS) {
+            vcos_log_error("%s: unable to set the intraperiod: %s", __func__, mmal_status_to_string(status));
+            return status;
+        }
+        state->intraperiod = control->intraperiod;
+    }
+
+    if (h264 && control->flags && !(control->flags & ENCODER_CONTROL_NO_KEYFRAME) && state->bCapturing) {
+        status = mmal_port_parameter_set_boolean(encoder_output, MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, 1);
+        if (status != MMAL_SUCCESS) {
+            vcos_log_error("%s: unable to request an I-frame: %s", __func__, mmal_status_to_string(status));
+            return status;
+        }
+    }
+
+    if (state->common_settings.verbose)
+        vcos_log_info("Encoder control: bitrate %d, QP %u, %u fps, intraperiod %d", state->bitrate,
+                      state->quantisationParameter, state->framerate, (int) state->intraperiod);
+    return MMAL_SUCCESS;
+}
+
+/**
+ * Change the bitrate, QP, frame rate and/or intraperiod of the video pipeline set up by init(),
+ * while capturing or not. While capturing, the new settings take effect at a keyframe requested
+ * straight after (H264), unless ENCODER_CONTROL_NO_KEYFRAME is set. The settings are kept in the
+ * state, so they also apply after a restart. Changes from several threads (the application, the
+ * rate controller, a pool resize) are made one at a time.
+ * Not for the MMAL callback thread, the parameters are set synchronously on the VideoCore.
+ *
+ * @param state Pointer to state control struct
+ * @param control The settings to change, those in control->flags
+ * @return MMAL_SUCCESS if all OK, MMAL_EINVAL for a setting the encoding does not have, or the error of the
+ *         first parameter that could not be set (the settings before it are applied)
+ */
+MMAL_STATUS_T set_encoder_control(CAM_STATE *state, const ENCODER_CONTROL *control) {
+    MMAL_STATUS_T status;
+
+    // the lock only exists once init() set up the encoder
+    if (!state->video_encoder_output_port || !state->camera_video_port)
+        return MMAL_EINVAL;
+
+    vcos_mutex_lock(&state->encoder_control_lock);
+    status = encoder_control_apply(state, control);
+    vcos_mutex_unlock(&state->encoder_control_lock);
+    return status;
+}
@@ -0,0 +1,246 @@
+//
+// Adaptive sizing of the video encoder output pool.
+//
+// The encoder callback watches how many buffers are left queued at the encoder when it gets one
+// back, and how large the frames are. Running out of buffers at the encoder (it would have to stall
+// or drop the next frame) grows the pool straight away; a pool that kept spare buffers at the
+// encoder for a whole window shrinks by one. Buffers grow when a single frame spreads over half the
+// pool, as large keyframes do with small buffers, and shrink when frames stay well below their size.
+//
+// A pool can only be resized with all of its buffers back, so the change is applied by the capture
+// thread at a safe point: capture is stopped, the encoder is given time to return the frame in
+// hand, its output port is cycled around mmal_pool_resize, and capture restarts with a keyframe.
+// The port is only cycled when no buffer is held downstream (frame queue, FrameRefs): otherwise
+// the change is given up without touching the stream, and asked for again later. The MJPEG server
+// always holds its newest frame, so the pool of an MJPEG stream cannot adapt.
+//
+
+#include "cam.h"
+#include <atomic>
+#include <new>
+
+/// Time over which the encoder has to keep spare buffers before the pool shrinks, in us
+#define ENCODER_POOL_WINDOW 10000000
+/// Buffers added when the encoder runs out
+#define ENCODER_POOL_GROW 2
+/// Buffers the encoder has to keep queued throughout a window for the pool to shrink
+#define ENCODER_POOL_SLACK 3
+/// Largest buffer size the adaptation grows to
+#define ENCODER_POOL_MAX_BUFFER_SIZE (1u << 20u)
+
+struct encoder_pool_adapter_s {
+    uint32_t min_num;                   /// bounds on the number of buffers
+    uint32_t max_num;
+    uint32_t min_size;                  /// smallest buffer size the encoder accepts
+    uint32_t num;                       /// current number of buffers
+    uint32_t size;                      /// current buffer size
+
+    // observations, encoder callback thread
+    uint64_t window_start;
+    uint32_t min_at_encoder;            /// fewest buffers left at the encoder in the window
+    uint32_t max_frame;                 /// largest frame in the window, in bytes
+    uint32_t max_frame_buffers;         /// most buffers a frame took in the window
+    uint32_t frame_bytes;               /// current frame so far
+    uint32_t frame_buffers;
+
+    std::atomic<int> pending;           /// a change was asked for and not applied yet
+    std::atomic<uint32_t> target_num;
+    std::atomic<uint32_t> target_size;
+    uint32_t resizes;
+};
+
+/**
+ * Start a new observation window
+ */
+static void encoder_pool_window_reset(ENCODER_POOL_ADAPTER *adapter, uint64_t now) {
+    adapter->window_start = now;
+    adapter->min_at_encoder = UINT32_MAX;
+    adapter->max_frame = 0;
+    adapter->max_frame_buffers = 0;
+}
+
+/**
+ * Ask the capture thread to resize the pool
+ */
+static void encoder_pool_request(CAM_STATE *state, uint32_t num, uint32_t size) {
+    ENCODER_POOL_ADAPTER *adapter = state->encoder_pool_adapter;
+
+    adapter->target_num.store(num, std::memory_order_relaxed);
+    adapter->target_size.store(size, std::memory_order_relaxed);
+    if (!adapter->pending.exchange(1))
+        vcos_event_flags_set(&state->callback_data.capture_events, CAPTURE_EVENT_POOL, VCOS_OR);
+}
+
+/**
+ * Set up adaptive sizing of the video encoder pool, if state->encoderPoolMax is set.
+ * Called once the encoder output port buffer number and size are known.
+ *
+ * @param state Pointer to state control struct
+ * @return MMAL_SUCCESS if all OK, MMAL_EINVAL for inconsistent bounds or with mjpegPort
+ */
+MMAL_STATUS_T encoder_pool_adapter_create(CAM_STATE *state) {
+    MMAL_PORT_T *port = state->video_encoder_output_port;
+    ENCODER_POOL_ADAPTER *adapter;
+
+    if (!state->encoderPoolMax || state->encoder_pool_adapter || !port || !state->video_encoder_pool)
+        return MMAL_SUCCESS;
+
+    if (state->encoderPoolMin > state->encoderPoolMax || state->encoderPoolMax < port->buffer_num_min) {
+        vcos_log_error("%s: encoder pool bounds %u-%u are invalid", __func__, state->encoderPoolMin,
+                       state->encoderPoolMax);
+        return MMAL_EINVAL;
+    }
+    if (state->mjpegPort) {
+        vcos_log_error("%s: the encoder pool cannot adapt while the MJPEG server holds frames", __func__);
+        return MMAL_EINVAL;
+    }
+
+    adapter = state->encoder_pool_adapter = new(std::nothrow) ENCODER_POOL_ADAPTER();
+    if (!adapter)
+        return MMAL_ENOMEM;
+
+    adapter->min_num = vcos_max(state->encoderPoolMin, port->buffer_num_min);
+    adapter->max_num = state->encoderPoolMax;
+    adapter->min_size = port->buffer_size_min;
+    adapter->num = state->video_encoder_pool->headers_num;
+    adapter->size = port->buffer_size;
+    encoder_pool_window_reset(adapter, get_microseconds64());
+    return MMAL_SUCCESS;
+}
+
+/**
+ * Destroy the pool adapter
+ *
+ * @param state Pointer to state control struct
+ */
+void encoder_pool_adapter_destroy(CAM_STATE *state) {
+    delete state->encoder_pool_adapter;
+    state->encoder_pool_adapter = nullptr;
+}
+
+/**
+ * Watch a buffer returned by the encoder, called by the encoder callback before the buffer is passed on
+ *
+ * @param state Pointer to state control struct
+ * @param buffer Buffer returned by the encoder, counted as held in the pipeline stats
+ */
+void encoder_pool_observe(CAM_STATE *state, MMAL_BUFFER_HEADER_T *buffer) {
+    ENCODER_POOL_ADAPTER *adapter = state->encoder_pool_adapter;
+    MMAL_POOL_T *pool = state->video_encoder_pool;
+    uint32_t away = pipeline_stats_held(state->pipeline_stats) + mmal_queue_length(pool->queue);
+    uint32_t at_encoder = pool->headers_num - vcos_min(pool->headers_num, away);
+    uint64_t now = get_microseconds64();
+
+    if (!buffer->length)
+        return;
+
+    if (!(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO)) { // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+        adapter->frame_bytes += buffer->length;
+        adapter->frame_buffers++;
+        if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) { // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+            adapter->max_frame = vcos_max(adapter->max_frame, adapter->frame_bytes);
+            adapter->max_frame_buffers = vcos_max(adapter->max_frame_buffers, adapter->frame_buffers);
+            adapter->frame_bytes = 0;
+            adapter->frame_buffers = 0;
+        }
+    }
+    adapter->min_at_encoder = vcos_min(adapter->min_at_encoder, at_encoder);
+
+    if (adapter->pending.load(std::memory_order_relaxed))
+        return;
+
+    // the encoder has nothing left to fill, the next frame would stall it
+    if (!at_encoder && adapter->num < adapter->max_num) {
+        encoder_pool_request(state, vcos_min(adapter->num + ENCODER_POOL_GROW, adapter->max_num), adapter->size);
+        return;
+    }
+    // one frame taking half the pool leaves too few buffers for the frames behind it
+    if (adapter->max_frame_buffers > adapter->num / 2 && adapter->size < ENCODER_POOL_MAX_BUFFER_SIZE) {
+        encoder_pool_request(state, adapter->num, vcos_min(adapter->size * 2, ENCODER_POOL_MAX_BUFFER_SIZE));
+        return;
+    }
+
+    if (now - adapter->window_start < ENCODER_POOL_WINDOW)
+        return;
+
+    uint32_t num = adapter->num, size = adapter->size;
+    if (adapter->min_at_encoder >= ENCODER_POOL_SLACK && num > adapter->min_num)
+        num--;
+    if (adapter->max_frame && adapter->max_frame < size / 4 && size / 2 >= adapter->min_size)
+        size /= 2;
+    if (num != adapter->num || size != adapter->size)
+        encoder_pool_request(state, num, size);
+    encoder_pool_window_reset(adapter, now);
+}
+
+/**
+ * Apply a pool size change asked for by the encoder callback. Capture thread only.
+ *
+ * @param state Pointer to state control struct
+ * @return MMAL_SUCCESS if all OK or nothing to do, MMAL_EAGAIN if buffers were held, something else on error
+ */
+MMAL_STATUS_T encoder_pool_apply(CAM_STATE *state) {
+    ENCODER_POOL_ADAPTER *adapter = state->encoder_pool_adapter;
+    MMAL_PORT_T *port = state->video_encoder_output_port;
+    MMAL_POOL_T *pool = state->video_encoder_pool;
+    MMAL_STATUS_T status = MMAL_SUCCESS, result;
+    int capturing = state->bCapturing;
+
+    if (!adapter || !adapter->pending.load())
+        return MMAL_SUCCESS;
+
+    uint32_t num = adapter->target_num.load(), size = adapter->target_size.load();
+
+    // frames held downstream would keep the pool from being resized, better not to drop frames for nothing
+    if (state->pipeline_stats && pipeline_stats_held(state->pipeline_stats)) {
+        encoder_pool_window_reset(adapter, get_microseconds64());
+        adapter->pending.store(0);
+        return MMAL_EAGAIN;
+    }
+
+    // no encoder settings change while its output port is cycled
+    vcos_mutex_lock(&state->encoder_control_lock);
+
+    // stop the camera and give the encoder two frame times to return the frame in hand
+    if (capturing) {
+        mmal_port_parameter_set_boolean(state->camera_video_port, MMAL_PARAMETER_CAPTURE, 0);
+        vcos_sleep(state->framerate ? 2000 / state->framerate : 100);
+    }
+    mmal_port_disable(port);
+
+    if (mmal_queue_length(pool->queue) != pool->headers_num) {
+        status = MMAL_EAGAIN;
+    } else if ((status = mmal_pool_resize(pool, num, size)) == MMAL_SUCCESS) {
+        port->buffer_num = num;
+        port->buffer_size = size;
+        adapter->num = num;
+        adapter->size = size;
+        adapter->resizes++;
+        if (state->common_settings.verbose)
+            vcos_log_info("Encoder pool resized to %u buffers of %u bytes", num, size);
+    } else {
+        vcos_log_error("%s: unable to resize the encoder pool: %s", __func__, mmal_status_to_string(status));
+    }
+    encoder_pool_window_reset(adapter, get_microseconds64());
+    adapter->pending.store(0);
+
+    if ((result = mmal_port_enable(port, encoder_buffer_callback)) != MMAL_SUCCESS ||
+        (result = send_encoder_buffers(state)) != MMAL_SUCCESS) {
+        vcos_log_error("%s: unable to restart the encoder output", __func__);
+        vcos_mutex_unlock(&state->encoder_control_lock);
+        return result;
+    }
+    if (capturing) {
+        // the stream picks up again with a keyframe, as after a pause
+        if (state->encoding == MMAL_ENCODING_H264) // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+            mmal_port_parameter_set_boolean(port, MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, 1);
+        if ((result = mmal_port_parameter_set_boolean(state->camera_video_port, MMAL_PARAMETER_CAPTURE, 1)) !=
+            MMAL_SUCCESS) {
+            vcos_log_error("%s: unable to restart capture", __func__);
+            vcos_mutex_unlock(&state->encoder_control_lock);
+            return result;
+        }
+    }
+    vcos_mutex_unlock(&state->encoder_control_lock);
+    return status;
+}
@@ -0,0 +1,282 @@
+//
+// Frame queue between the encoder callback and the user video callback.
+//
+// The encoder callback only takes a reference on the buffer header and pushes it into a
+// preallocated ring; a consumer thread delivers the frames to the callback and releases them.
+// The ring is a bounded queue with per-slot sequence numbers: there is a single producer,
+// and the producer may act as a second consumer to drop the oldest frame when full.
+//
+
+#include "cam.h"
+#include <atomic>
+#include <new>
+
+typedef struct {
+    MMAL_BUFFER_HEADER_T *buffer;
+    int64_t pts;
+} FRAME_QUEUE_ENTRY;
+
+typedef struct {
+    std::atomic<uint32_t> sequence;
+    FRAME_QUEUE_ENTRY entry;
+} FRAME_QUEUE_SLOT;
+
+struct frame_queue_s {
+    CAM_STATE *pstate;
+    FRAME_QUEUE_POLICY_T policy;
+    FRAME_QUEUE_SLOT *slots;
+    uint32_t mask;
+
+    alignas(64) std::atomic<uint32_t> head;     /// next slot to fill, only written by the producer
+    alignas(64) std::atomic<uint32_t> tail;     /// next slot to deliver
+
+    VCOS_SEMAPHORE_T available;                 /// posted for every queued frame
+    VCOS_SEMAPHORE_T space;                     /// posted when a blocked producer may continue
+    std::atomic<int> producer_waiting;
+    std::atomic<int> stop;
+    VCOS_THREAD_T thread;
+
+    std::atomic<uint64_t> frames_queued;
+    std::atomic<uint64_t> frames_delivered;
+    std::atomic<uint64_t> frames_dropped;
+    std::atomic<uint32_t> max_depth;
+};
+
+/**
+ * Take the oldest entry out of the ring
+ * @return !0 if an entry was taken, 0 if the ring is empty
+ */
+static int frame_queue_pop(FRAME_QUEUE *queue, FRAME_QUEUE_ENTRY *entry) {
+    uint32_t pos = queue->tail.load(std::memory_order_relaxed);
+
+    for (;;) {
+        FRAME_QUEUE_SLOT *slot = &queue->slots[pos & queue->mask];
+        auto diff = (int32_t) (slot->sequence.load(std::memory_order_acquire) - (pos + 1));
+
+        if (diff == 0) {
+            if (queue->tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = queue->tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    FRAME_QUEUE_SLOT *slot = &queue->slots[pos & queue->mask];
+    *entry = slot->entry;
+    slot->sequence.store(pos + queue->mask + 1, std::memory_order_release);
+
+    if (queue->producer_waiting.exchange(0))
+        vcos_semaphore_post(&queue->space);
+    return 1;
+}
+
+/**
+ * Put an entry in the ring. Only called by the producer.
+ * @return !0 if queued, 0 if the ring is full
+ */
+static int frame_queue_put(FRAME_QUEUE *queue, const FRAME_QUEUE_ENTRY *entry) {
+    uint32_t pos = queue->head.load(std::memory_order_relaxed);
+    FRAME_QUEUE_SLOT *slot = &queue->slots[pos & queue->mask];
+
+    if (slot->sequence.load(std::memory_order_acquire) != pos)
+        return 0;
+
+    slot->entry = *entry;
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    queue->head.store(pos + 1, std::memory_order_relaxed);
+
+    uint32_t depth = pos + 1 - queue->tail.load(std::memory_order_relaxed);
+    if (depth > queue->max_depth.load(std::memory_order_relaxed))
+        queue->max_depth.store(depth, std::memory_order_relaxed);
+
+    vcos_semaphore_post(&queue->available);
+    return 1;
+}
+
+/**
+ * Release a frame that will not be delivered
+ */
+static void frame_queue_drop(FRAME_QUEUE *queue, MMAL_BUFFER_HEADER_T *buffer) {
+    queue->frames_dropped.fetch_add(1, std::memory_order_relaxed);
+    mmal_buffer_header_release(buffer);
+}
+
+/**
+ * Consumer thread: delivers queued frames to the video callback
+ */
+static void *frame_queue_thread(void *arg) {
+    auto *queue = (FRAME_QUEUE *) arg;
+    FRAME_QUEUE_ENTRY entry;
+
+    for (;;) {
+        vcos_semaphore_wait(&queue->available);
+        if (queue->stop.load())
+            break;
+
+        // the producer may have dropped this frame already
+        if (!frame_queue_pop(queue, &entry))
+            continue;
+
+        mmal_buffer_header_mem_lock(entry.buffer);
+        deliver_frame(queue->pstate, entry.buffer, entry.pts);
+        mmal_buffer_header_mem_unlock(entry.buffer);
+        queue->frames_delivered.fetch_add(1, std::memory_order_relaxed);
+
+        // the pool callback sends the buffer back to the encoder once it is no longer referenced
+        mmal_buffer_header_release(entry.buffer);
+    }
+
+    return nullptr;
+}
+
+/**
+ * Create the frame queue and its consumer thread, if state->frameQueueSize is set
+ *
+ * @param state Pointer to state control struct
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T frame_queue_create(CAM_STATE *state) {
+    if (!state->frameQueueSize || state->frame_queue)
+        return MMAL_SUCCESS;
+
+    auto *queue = new(std::nothrow) FRAME_QUEUE();
+    if (!queue)
+        return MMAL_ENOMEM;
+
+    uint32_t size = 1;
+    while (size < state->frameQueueSize)
+        size <<= 1u;
+
+    queue->pstate = state;
+    queue->policy = (FRAME_QUEUE_POLICY_T) state->frameQueuePolicy;
+    queue->mask = size - 1;
+    queue->slots = new(std::nothrow) FRAME_QUEUE_SLOT[size];
+    if (!queue->slots) {
+        delete queue;
+        return MMAL_ENOMEM;
+    }
+    for (uint32_t i = 0; i < size; i++)
+        queue->slots[i].sequence.store(i, std::memory_order_relaxed);
+
+    if (vcos_semaphore_create(&queue->available, "cam-frames", 0) != VCOS_SUCCESS) {
+        delete[] queue->slots;
+        delete queue;
+        return MMAL_ENOMEM;
+    }
+    if (vcos_semaphore_create(&queue->space, "cam-frames-space", 0) != VCOS_SUCCESS) {
+        vcos_semaphore_delete(&queue->available);
+        delete[] queue->slots;
+        delete queue;
+        return MMAL_ENOMEM;
+    }
+    if (vcos_thread_create(&queue->thread, "cam-frames", nullptr, frame_queue_thread, queue) != VCOS_SUCCESS) {
+        vcos_log_error("%s: failed to create consumer thread", __func__);
+        vcos_semaphore_delete(&queue->space);
+        vcos_semaphore_delete(&queue->available);
+        delete[] queue->slots;
+        delete queue;
+        return MMAL_ENOMEM;
+    }
+
+    state->frame_queue = queue;
+    return MMAL_SUCCESS;
+}
+
+/**
+ * Stop the consumer thread and release any frames that were not delivered.
+ * The encoder output port must be disabled first.
+ *
+ * @param state Pointer to state control struct
+ */
+void frame_queue_destroy(CAM_STATE *state) {
+    FRAME_QUEUE *queue = state->frame_queue;
+    FRAME_QUEUE_ENTRY entry;
+
+    if (!queue)
+        return;
+
+    queue->stop.store(1);
+    vcos_semaphore_post(&queue->available);
+    vcos_semaphore_post(&queue->space);
+    vcos_thread_join(&queue->thread, nullptr);
+
+    while (frame_queue_pop(queue, &entry))
+        frame_queue_drop(queue, entry.buffer);
+
+    vcos_semaphore_delete(&queue->space);
+    vcos_semaphore_delete(&queue->available);
+    delete[] queue->slots;
+    delete queue;
+    state->frame_queue = nullptr;
+}
+
+/**
+ * Queue a frame for delivery, called from the encoder callback.
+ * A reference is taken on the buffer header, it is released once delivered or dropped.
+ *
+ * @param state Pointer to state control struct
+ * @param buffer Buffer header holding the frame
+ * @param pts Presentation time to pass to the video callback
+ * @return !0 if the frame was queued, 0 if it was dropped
+ */
+int frame_queue_push(CAM_STATE *state, MMAL_BUFFER_HEADER_T *buffer, int64_t pts) {
+    FRAME_QUEUE *queue = state->frame_queue;
+    FRAME_QUEUE_ENTRY entry = {buffer, pts};
+    FRAME_QUEUE_ENTRY oldest;
+
+    mmal_buffer_header_acquire(buffer);
+    queue->frames_queued.fetch_add(1, std::memory_order_relaxed);
+
+    while (!frame_queue_put(queue, &entry)) {
+        switch (queue->policy) {
+            case FRAME_QUEUE_DROP_OLDEST:
+                if (frame_queue_pop(queue, &oldest))
+                    frame_queue_drop(queue, oldest.buffer);
+                break;
+
+            case FRAME_QUEUE_BLOCK:
+                if (!queue->stop.load()) {
+                    queue->producer_waiting.store(1);
+                    // re-check after announcing ourselves, the consumer may have made room already
+                    if (!frame_queue_put(queue, &entry)) {
+                        vcos_semaphore_wait(&queue->space);
+                        continue;
+                    }
+                    queue->producer_waiting.store(0);
+                    return 1;
+                }
+                frame_queue_drop(queue, buffer);
+                return 0;
+
+            case FRAME_QUEUE_DROP_NEWEST:
+            default:
+                frame_queue_drop(queue, buffer);
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Read the frame queue counters
+ *
+ * @param state Pointer to state control struct
+ * @param stats Filled with the current counters
+ * @return MMAL_SUCCESS, or MMAL_ENOSYS if the frame queue is not in use
+ */
+MMAL_STATUS_T get_frame_queue_stats(CAM_STATE *state, FRAME_QUEUE_STATS *stats) {
+    FRAME_QUEUE *queue = state->frame_queue;
+
+    if (!queue)
+        return MMAL_ENOSYS;
+
+    stats->frames_queued = queue->frames_queued.load(std::memory_order_relaxed);
+    stats->frames_delivered = queue->frames_delivered.load(std::memory_order_relaxed);
+    stats->frames_dropped = queue->frames_dropped.load(std::memory_order_relaxed);
+    stats->depth = queue->head.load(std::memory_order_relaxed) - queue->tail.load(std::memory_order_relaxed);
+    stats->max_depth = queue->max_depth.load(std::memory_order_relaxed);
+    return MMAL_SUCCESS;
+}
@@ -0,0 +1,209 @@
+//
+// Incremental H264 Annex-B parser assembling complete access units from encoder buffers.
+//
+// The encoder may split a frame over several buffers (large frames, slices > 1), and sends the
+// stream headers in buffers of their own. Buffers are appended to the access unit being
+// assembled and searched for start codes; a new access unit starts at the first AUD, SPS, PPS or
+// SEI, or at the first slice with first_mb_in_slice == 0, after a slice of the current one
+// (a simplification of H264 7.4.1.2.3 that holds for the VideoCore encoder). A buffer flagged as
+// the end of a frame completes the access unit without waiting for the next one.
+// The latest SPS and PPS are kept so that late-joining consumers can start decoding at once.
+//
+
+#include "cam.h"
+#include <cstring>
+#include <new>
+
+/// Largest SPS or PPS kept, including the start code
+#define H264_PARAMETER_SET_MAX 128
+
+struct h264_assembler_s {
+    AccessUnitCallback cb;
+    std::vector<uint8_t> data;          /// access unit being assembled, possibly followed by the start of the next
+    std::vector<H264_NAL_UNIT> nals;    /// NAL units found in data, lengths are set when the access unit completes
+    uint32_t scan;                      /// data before this was searched for start codes
+    uint32_t nal_types;                 /// (1 << nal_unit_type) of the NAL units found
+    int has_slice;                      /// a slice of the access unit was found
+    int64_t pts;                        /// pts of the first buffer of the access unit
+    VCOS_MUTEX_T lock;                  /// protects the parameter sets
+    uint8_t sps[H264_PARAMETER_SET_MAX];
+    uint32_t sps_length;
+    uint8_t pps[H264_PARAMETER_SET_MAX];
+    uint32_t pps_length;
+};
+
+/**
+ * @return !0 if a NAL unit of this type, following a slice, starts a new access unit
+ */
+static int h264_starts_access_unit(uint8_t type) {
+    return (type >= H264_NAL_SEI && type <= H264_NAL_AUD) || (type >= 14 && type <= 18);
+}
+
+/**
+ * Remember a parameter set NAL unit, start code included
+ */
+static void h264_assembler_keep(H264_ASSEMBLER *assembler, const H264_NAL_UNIT *nal) {
+    uint8_t *set = nal->type == H264_NAL_SPS ? assembler->sps : assembler->pps;
+    uint32_t *length = nal->type == H264_NAL_SPS ? &assembler->sps_length : &assembler->pps_length;
+
+    if (nal->length > H264_PARAMETER_SET_MAX)
+        return;
+
+    vcos_mutex_lock(&assembler->lock);
+    memcpy(set, assembler->data.data() + nal->offset, nal->length);
+    *length = nal->length;
+    vcos_mutex_unlock(&assembler->lock);
+}
+
+/**
+ * Pass the first end bytes of data on as an access unit and keep the rest for the next one
+ */
+static void h264_assembler_emit(H264_ASSEMBLER *assembler, uint32_t end) {
+    uint32_t count = 0;
+    H264_ACCESS_UNIT unit;
+
+    while (count < assembler->nals.size() && assembler->nals[count].offset < end)
+        count++;
+    for (uint32_t i = 0; i < count; i++) {
+        H264_NAL_UNIT *nal = &assembler->nals[i];
+
+        nal->length = (i + 1 < count ? assembler->nals[i + 1].offset : end) - nal->offset;
+        if (nal->type == H264_NAL_SPS || nal->type == H264_NAL_PPS)
+            h264_assembler_keep(assembler, nal);
+    }
+
+    unit.data = assembler->data.data();
+    unit.length = end;
+    unit.pts = assembler->pts;
+    unit.nals = assembler->nals.data();
+    unit.nal_count = count;
+    unit.nal_types = assembler->nal_types;
+    unit.keyframe = (assembler->nal_types & (1u << H264_NAL_IDR)) != 0;
+    assembler->cb(&unit);
+
+    assembler->data.erase(assembler->data.begin(), assembler->data.begin() + end);
+    assembler->nals.erase(assembler->nals.begin(), assembler->nals.begin() + count);
+    for (auto &nal : assembler->nals)
+        nal.offset -= end;
+    assembler->scan = assembler->scan > end ? assembler->scan - end : 0;
+    assembler->nal_types = 0;
+    assembler->has_slice = 0;
+    assembler->pts = MMAL_TIME_UNKNOWN;
+}
+
+/**
+ * Create an access unit assembler
+ *
+ * @param cb Receives each complete access unit
+ * @return The assembler, or nullptr if out of memory
+ */
+H264_ASSEMBLER *h264_assembler_create(AccessUnitCallback cb) {
+    auto *assembler = new(std::nothrow) H264_ASSEMBLER();
+
+    if (!assembler)
+        return nullptr;
+
+    if (vcos_mutex_create(&assembler->lock, "cam-h264") != VCOS_SUCCESS) {
+        delete assembler;
+        return nullptr;
+    }
+    assembler->cb = std::move(cb);
+    assembler->pts = MMAL_TIME_UNKNOWN;
+    return assembler;
+}
+
+/**
+ * Destroy an access unit assembler, an incomplete access unit is dropped
+ *
+ * @param assembler Assembler to destroy, may be nullptr
+ */
+void h264_assembler_destroy(H264_ASSEMBLER *assembler) {
+    if (!assembler)
+        return;
+
+    vcos_mutex_delete(&assembler->lock);
+    delete assembler;
+}
+
+/**
+ * Add the next part of the stream, passing on the access units it completes
+ *
+ * @param assembler The access unit assembler
+ * @param data Annex-B data, any part of the stream
+ * @param length Number of bytes
+ * @param pts Presentation time of the data, MMAL_TIME_UNKNOWN if not known
+ * @param frame_end !0 if the data ends a frame (MMAL_BUFFER_HEADER_FLAG_FRAME_END)
+ */
+void h264_assembler_push(H264_ASSEMBLER *assembler, const uint8_t *data, uint32_t length, int64_t pts,
+                         int frame_end) {
+    uint32_t i = assembler->scan;
+
+    if (assembler->pts == MMAL_TIME_UNKNOWN)
+        assembler->pts = pts;
+    assembler->data.insert(assembler->data.end(), data, data + length);
+
+    auto size = (uint32_t) assembler->data.size();
+    while (i + 3 < size) {
+        const uint8_t *p = assembler->data.data();
+
+        // 00 00 01, skipping ahead when p[i + 2] rules out a start code at i, i + 1 and i + 2
+        if (p[i + 2] > 1) {
+            i += 3;
+            continue;
+        }
+        if (p[i] || p[i + 1] || p[i + 2] != 1) {
+            i++;
+            continue;
+        }
+
+        auto type = (uint8_t) (p[i + 3] & 0x1fu);
+        int slice = type == H264_NAL_SLICE || type == H264_NAL_IDR;
+        if (slice && i + 4 >= size)
+            break; // first_mb_in_slice is in the next part
+
+        // a zero byte in front makes it a 4 byte start code
+        uint32_t start = i;
+        if (i && !p[i - 1] && (assembler->nals.empty() || i - 1 > assembler->nals.back().offset + 3))
+            start = i - 1;
+
+        // first_mb_in_slice is ue(v), a leading 1 bit codes 0
+        if (assembler->has_slice && (h264_starts_access_unit(type) || (slice && (p[i + 4] & 0x80u)))) {
+            h264_assembler_emit(assembler, start);
+            i -= start;
+            start = 0;
+            size = (uint32_t) assembler->data.size();
+            assembler->pts = pts;
+        }
+
+        assembler->nals.push_back({start, 0, type});
+        assembler->nal_types |= 1u << type;
+        assembler->has_slice |= slice;
+        i += 4;
+    }
+    assembler->scan = i;
+
+    if (frame_end && assembler->has_slice)
+        h264_assembler_emit(assembler, size);
+}
+
+/**
+ * Copy the latest SPS and PPS, as Annex-B NAL units, for a consumer joining the stream
+ *
+ * @param assembler The access unit assembler
+ * @param data Buffer to copy them to
+ * @param size Size of the buffer
+ * @return Number of bytes copied, 0 if no SPS and PPS were seen yet or they do not fit
+ */
+uint32_t h264_assembler_parameter_sets(H264_ASSEMBLER *assembler, uint8_t *data, uint32_t size) {
+    uint32_t length = 0;
+
+    vcos_mutex_lock(&assembler->lock);
+    if (assembler->sps_length && assembler->pps_length && assembler->sps_length + assembler->pps_length <= size) {
+        memcpy(data, assembler->sps, assembler->sps_length);
+        memcpy(data + assembler->sps_length, assembler->pps, assembler->pps_length);
+        length = assembler->sps_length + assembler->pps_length;
+    }
+    vcos_mutex_unlock(&assembler->lock);
+
+    return length;
+}
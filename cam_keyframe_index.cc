@@ -0,0 +1,155 @@
+//
+// Index of the keyframes in the encoded stream, for circular buffer recording.
+//
+// The encoder callback passes every output buffer (side information excepted) through
+// keyframe_index_update(), which counts the stream bytes and records where each keyframe
+// starts. A keyframe that follows inline headers starts at the headers, so that the stream
+// can be decoded from any recorded offset. Only the last keyframeHistory keyframes are kept.
+//
+
+#include "cam.h"
+#include <new>
+
+struct keyframe_index_s {
+    KEYFRAME_INDEX_ENTRY *entries;
+    uint32_t size;              /// capacity of entries
+    uint32_t count;             /// keyframes in the index
+    uint32_t next;              /// entry the next keyframe is written to
+    uint64_t stream_offset;     /// bytes the encoder produced so far
+    uint64_t header_offset;     /// start of the headers preceding the next frame
+    int have_header;            /// the last buffer ended headers, the next frame starts at header_offset
+    int in_frame;               /// the last buffer did not end its frame
+};
+
+/**
+ * Create the keyframe index, if state->keyframeHistory is set
+ *
+ * @param state Pointer to state control struct
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T keyframe_index_create(CAM_STATE *state) {
+    if (!state->keyframeHistory || state->keyframe_index)
+        return MMAL_SUCCESS;
+
+    auto *index = new(std::nothrow) KEYFRAME_INDEX();
+    if (!index)
+        return MMAL_ENOMEM;
+
+    index->entries = new(std::nothrow) KEYFRAME_INDEX_ENTRY[state->keyframeHistory];
+    if (!index->entries) {
+        delete index;
+        return MMAL_ENOMEM;
+    }
+    index->size = state->keyframeHistory;
+
+    state->keyframe_index = index;
+    return MMAL_SUCCESS;
+}
+
+/**
+ * Destroy the keyframe index
+ *
+ * @param state Pointer to state control struct
+ */
+void keyframe_index_destroy(CAM_STATE *state) {
+    KEYFRAME_INDEX *index = state->keyframe_index;
+
+    if (!index)
+        return;
+
+    delete[] index->entries;
+    delete index;
+    state->keyframe_index = nullptr;
+}
+
+/**
+ * Account for an encoder output buffer, recording the offset of keyframes
+ *
+ * @param index The keyframe index
+ * @param buffer Encoder output buffer, without side information
+ */
+void keyframe_index_update(KEYFRAME_INDEX *index, MMAL_BUFFER_HEADER_T *buffer) {
+    uint32_t flags = buffer->flags;
+
+    if (flags & MMAL_BUFFER_HEADER_FLAG_CONFIG) { // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+        // inline headers: a keyframe that follows is decodable from here
+        if (!index->have_header)
+            index->header_offset = index->stream_offset;
+        index->have_header = 1;
+    } else {
+        if (!index->in_frame && (flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME)) { // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+            KEYFRAME_INDEX_ENTRY *entry = &index->entries[index->next];
+
+            entry->offset = index->have_header ? index->header_offset : index->stream_offset;
+            entry->pts = buffer->pts;
+            index->next = (index->next + 1) % index->size;
+            if (index->count < index->size)
+                index->count++;
+        }
+        index->have_header = 0;
+        index->in_frame = !(flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END); // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+    }
+
+    index->stream_offset += buffer->length;
+}
+
+/**
+ * Find the oldest keyframe that starts at or after an offset of the stream
+ *
+ * @param index The keyframe index
+ * @param min_offset Lowest acceptable offset
+ * @param entry Filled with the keyframe found
+ * @return !0 if a keyframe was found, 0 otherwise
+ */
+int keyframe_index_find(KEYFRAME_INDEX *index, uint64_t min_offset, KEYFRAME_INDEX_ENTRY *entry) {
+    uint32_t oldest = (index->next + index->size - index->count) % index->size;
+
+    for (uint32_t i = 0; i < index->count; i++) {
+        KEYFRAME_INDEX_ENTRY *candidate = &index->entries[(oldest + i) % index->size];
+
+        if (candidate->offset >= min_offset) {
+            *entry = *candidate;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Find the latest keyframe at or before a time that still starts at or after an offset of the stream.
+ * If every keyframe from that offset is later, the oldest of them is returned.
+ *
+ * @param index The keyframe index
+ * @param min_offset Lowest acceptable offset
+ * @param pts Time (STC) the keyframe should not be later than
+ * @param entry Filled with the keyframe found
+ * @return !0 if a keyframe was found, 0 otherwise
+ */
+int keyframe_index_find_before(KEYFRAME_INDEX *index, uint64_t min_offset, int64_t pts, KEYFRAME_INDEX_ENTRY *entry) {
+    uint32_t oldest = (index->next + index->size - index->count) % index->size;
+    int found = 0;
+
+    for (uint32_t i = 0; i < index->count; i++) {
+        KEYFRAME_INDEX_ENTRY *candidate = &index->entries[(oldest + i) % index->size];
+
+        if (candidate->offset < min_offset)
+            continue;
+        if (found && candidate->pts > pts)
+            break;
+        *entry = *candidate;
+        found = 1;
+    }
+
+    return found;
+}
+
+/**
+ * Number of bytes the encoder produced so far, the offset the next buffer starts at
+ *
+ * @param index The keyframe index
+ * @return The stream offset
+ */
+uint64_t keyframe_index_stream_offset(KEYFRAME_INDEX *index) {
+    return index->stream_offset;
+}
@@ -0,0 +1,206 @@
+//
+// Frame latency instrumentation: how old a frame is, measured from the time its exposure was
+// stamped by the sensor, when the encoder returns it and when the application callback is
+// entered and left.
+//
+// Frames carry STC (VideoCore system time counter) timestamps, MMAL_PARAM_TIMESTAMP_MODE_RAW_STC.
+// The STC is mapped to CLOCK_MONOTONIC_RAW (get_microseconds64) by reading it through
+// MMAL_PARAMETER_SYSTEM_TIME between two host clock readings, keeping the offset of the fastest
+// round trip. The mapping is refreshed when capture starts and whenever the statistics are read,
+// both on application threads: the VideoCore is never queried from the MMAL callback thread.
+//
+// Latencies go into log-linear histograms (as HdrHistogram): 16 buckets per power of two, so any
+// value is recorded within 1/16 (6%) of its true value, from 1us up to over an hour, in a few KB.
+// Recording is a couple of relaxed atomic increments and safe from any thread.
+//
+
+#include "cam.h"
+#include <atomic>
+#include <new>
+
+/// Sub-buckets per power of two, as a number of bits
+#define LATENCY_SUB_BUCKET_BITS 4u
+#define LATENCY_SUB_BUCKETS (1u << LATENCY_SUB_BUCKET_BITS)
+/// Buckets covering the whole uint32_t range
+#define LATENCY_BUCKETS ((32u - LATENCY_SUB_BUCKET_BITS + 1u) << LATENCY_SUB_BUCKET_BITS)
+/// STC readings per mapping refresh, the fastest is kept
+#define LATENCY_SYNC_SAMPLES 5
+
+typedef struct {
+    std::atomic<uint32_t> counts[LATENCY_BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint32_t> max;
+} LATENCY_HISTOGRAM;
+
+struct latency_tracker_s {
+    MMAL_PORT_T *control;                   /// camera control port, for MMAL_PARAMETER_SYSTEM_TIME
+    std::atomic<int64_t> offset;            /// host time minus STC time, in us
+    LATENCY_HISTOGRAM histograms[LATENCY_STAGE_COUNT];
+};
+
+/**
+ * @return Index of the bucket a latency falls into
+ */
+static uint32_t latency_bucket(uint32_t value) {
+    if (value < LATENCY_SUB_BUCKETS)
+        return value;
+
+    uint32_t shift = 31u - __builtin_clz(value) - LATENCY_SUB_BUCKET_BITS;
+    return ((shift + 1u) << LATENCY_SUB_BUCKET_BITS) + ((value >> shift) & (LATENCY_SUB_BUCKETS - 1u));
+}
+
+/**
+ * @return Largest latency that falls into a bucket
+ */
+static uint32_t latency_bucket_upper(uint32_t bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS)
+        return bucket;
+
+    uint32_t shift = (bucket >> LATENCY_SUB_BUCKET_BITS) - 1u;
+    uint64_t lower = (uint64_t) (LATENCY_SUB_BUCKETS + (bucket & (LATENCY_SUB_BUCKETS - 1u))) << shift;
+    return (uint32_t) vcos_min(lower + (1ull << shift) - 1, UINT32_MAX);
+}
+
+/**
+ * Refresh the STC to host time mapping. Blocks on the VideoCore, so not for the MMAL callback thread.
+ *
+ * @param tracker The latency tracker
+ * @return MMAL_SUCCESS if all OK, the error of the STC query otherwise (the previous mapping is kept)
+ */
+MMAL_STATUS_T latency_tracker_sync(LATENCY_TRACKER *tracker) {
+    uint64_t best_round_trip = UINT64_MAX;
+    int64_t offset = 0;
+
+    for (int i = 0; i < LATENCY_SYNC_SAMPLES; i++) {
+        uint64_t stc = 0, before = get_microseconds64();
+        MMAL_STATUS_T status = mmal_port_parameter_get_uint64(tracker->control, MMAL_PARAMETER_SYSTEM_TIME, &stc);
+        uint64_t after = get_microseconds64();
+
+        if (status != MMAL_SUCCESS) {
+            vcos_log_error("%s: unable to read the STC: %s", __func__, mmal_status_to_string(status));
+            return status;
+        }
+        // the STC was read somewhere within the round trip, the middle is the best guess
+        if (after - before < best_round_trip) {
+            best_round_trip = after - before;
+            offset = (int64_t) (before + (after - before) / 2) - (int64_t) stc;
+        }
+    }
+
+    tracker->offset.store(offset, std::memory_order_relaxed);
+    return MMAL_SUCCESS;
+}
+
+/**
+ * Create a latency tracker and map the STC to host time
+ *
+ * @param camera Camera component, its control port is used to read the STC
+ * @return The tracker, or nullptr if out of memory or the STC cannot be read
+ */
+LATENCY_TRACKER *latency_tracker_create(MMAL_COMPONENT_T *camera) {
+    auto *tracker = new(std::nothrow) LATENCY_TRACKER();
+
+    if (!tracker)
+        return nullptr;
+
+    tracker->control = camera->control;
+    if (latency_tracker_sync(tracker) != MMAL_SUCCESS) {
+        delete tracker;
+        return nullptr;
+    }
+    return tracker;
+}
+
+/**
+ * Destroy a latency tracker
+ *
+ * @param tracker Tracker to destroy, may be nullptr
+ */
+void latency_tracker_destroy(LATENCY_TRACKER *tracker) {
+    delete tracker;
+}
+
+/**
+ * Record how long ago, in host time, a frame was stamped by the sensor. Safe from any thread.
+ *
+ * @param tracker The latency tracker
+ * @param stage Point in the pipeline the frame has reached
+ * @param pts STC timestamp of the frame (as set by the camera), ignored if MMAL_TIME_UNKNOWN
+ */
+void latency_tracker_record(LATENCY_TRACKER *tracker, LATENCY_STAGE_T stage, int64_t pts) {
+    if (pts == MMAL_TIME_UNKNOWN)
+        return;
+
+    int64_t latency = (int64_t) get_microseconds64() - (pts + tracker->offset.load(std::memory_order_relaxed));
+    // a frame can't be from the future, that is the mapping error
+    auto value = (uint32_t) vcos_max(vcos_min(latency, (int64_t) UINT32_MAX), 0);
+    LATENCY_HISTOGRAM *histogram = &tracker->histograms[stage];
+
+    histogram->counts[latency_bucket(value)].fetch_add(1, std::memory_order_relaxed);
+    histogram->count.fetch_add(1, std::memory_order_relaxed);
+
+    uint32_t max = histogram->max.load(std::memory_order_relaxed);
+    while (value > max && !histogram->max.compare_exchange_weak(max, value, std::memory_order_relaxed));
+}
+
+/**
+ * Summarise a histogram. Frames recorded meanwhile may or may not be included.
+ */
+static void latency_histogram_summary(LATENCY_HISTOGRAM *histogram, LATENCY_SUMMARY *summary) {
+    static const double quantiles[] = {0.5, 0.9, 0.99};
+    uint32_t *values[] = {&summary->p50, &summary->p90, &summary->p99};
+    uint64_t seen = 0;
+    size_t q = 0;
+
+    summary->count = histogram->count.load(std::memory_order_relaxed);
+    summary->max = histogram->max.load(std::memory_order_relaxed);
+    summary->p50 = summary->p90 = summary->p99 = 0;
+
+    for (uint32_t bucket = 0; bucket < LATENCY_BUCKETS && q < vcos_countof(quantiles); bucket++) {
+        seen += histogram->counts[bucket].load(std::memory_order_relaxed);
+        while (q < vcos_countof(quantiles) && seen && (double) seen >= quantiles[q] * (double) summary->count) {
+            *values[q] = vcos_min(latency_bucket_upper(bucket), summary->max);
+            q++;
+        }
+    }
+}
+
+/**
+ * Read the latency percentiles of each stage, and refresh the STC mapping
+ *
+ * @param state Pointer to state control struct
+ * @param stats Filled with the latencies, in us from the sensor timestamp, of the frames since the last reset
+ * @return MMAL_SUCCESS, or MMAL_ENOSYS if latencyStats is not set
+ */
+MMAL_STATUS_T get_latency_stats(CAM_STATE *state, LATENCY_STATS *stats) {
+    LATENCY_TRACKER *tracker = state->latency_tracker;
+
+    if (!tracker)
+        return MMAL_ENOSYS;
+
+    for (uint32_t stage = 0; stage < LATENCY_STAGE_COUNT; stage++)
+        latency_histogram_summary(&tracker->histograms[stage], &stats->stages[stage]);
+
+    // the STC and the host clock drift apart slowly, catch up while on an application thread
+    latency_tracker_sync(tracker);
+    return MMAL_SUCCESS;
+}
+
+/**
+ * Forget the latencies recorded so far, e.g. after changing buffer counts
+ *
+ * @param state Pointer to state control struct
+ */
+void reset_latency_stats(CAM_STATE *state) {
+    LATENCY_TRACKER *tracker = state->latency_tracker;
+
+    if (!tracker)
+        return;
+
+    for (auto &histogram : tracker->histograms) {
+        for (auto &count : histogram.counts)
+            count.store(0, std::memory_order_relaxed);
+        histogram.count.store(0, std::memory_order_relaxed);
+        histogram.max.store(0, std::memory_order_relaxed);
+    }
+}
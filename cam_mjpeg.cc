@@ -0,0 +1,516 @@
+//
+// MJPEG streaming over HTTP (multipart/x-mixed-replace), for encoding = MMAL_ENCODING_MJPEG.
+//
+// The encoder callback takes references on the buffers of a frame and hands the complete frame
+// to the server thread, which serves all clients from one epoll loop. Frames are not copied:
+// every client sends the same encoder buffers, with a shared part header, using one sendmsg per
+// attempt. A client that is busy when a frame arrives skips to the newest frame once it is done;
+// a client still sending a frame older than the previous one is disconnected. At most
+// MJPEG_SERVER_FRAMES frames of up to MJPEG_FRAME_CHUNKS buffers are held at a time, which the
+// MJPEG_SERVER_BUFFERS extra encoder buffers cover, so slow clients never stall the encoder; a frame
+// spanning more buffers is dropped.
+//
+
+#include "cam.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/// Clients served if mjpegMaxClients was not set
+#define MJPEG_DEFAULT_CLIENTS 8
+/// Longest HTTP request accepted
+#define MJPEG_REQUEST_MAX 1024
+
+#define MJPEG_BOUNDARY "camframe"
+
+static const char mjpeg_response[] =
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: multipart/x-mixed-replace; boundary=" MJPEG_BOUNDARY "\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Connection: close\r\n\r\n";
+
+static const char mjpeg_part_end[] = "\r\n";
+
+typedef struct mjpeg_frame_s {
+    uint64_t sequence;
+    uint32_t references;                    /// only touched by the server thread
+    FrameRef chunks[MJPEG_FRAME_CHUNKS];
+    uint32_t chunk_num;
+    uint32_t length;
+    char header[128];                       /// part boundary and headers
+    uint32_t header_length;
+} MJPEG_FRAME;
+
+typedef struct {
+    int fd;                                 /// -1 if the slot is free
+    int streaming;                          /// the request was read, frames are being sent
+    int sent_response;                      /// the HTTP response header went out
+    MJPEG_FRAME *frame;                     /// frame being sent, nullptr if idle
+    size_t offset;                          /// bytes of frame (and response) sent
+    char request[MJPEG_REQUEST_MAX];
+    uint32_t request_length;
+} MJPEG_CLIENT;
+
+struct mjpeg_server_s {
+    int listen_fd;
+    int epoll_fd;
+    int event_fd;                           /// wakes the server thread for a new frame or to stop
+    VCOS_THREAD_T thread;
+
+    VCOS_MUTEX_T lock;                      /// protects pending and stop
+    MJPEG_FRAME *pending;                   /// newest frame, not yet taken by the server thread
+    int stop;
+
+    MJPEG_FRAME *assembling;                /// frame being received, only used by the encoder callback
+    uint64_t sequence;
+
+    MJPEG_FRAME *latest;                    /// newest frame taken by the server thread
+    MJPEG_CLIENT *clients;
+    uint32_t client_num;
+};
+
+static void mjpeg_frame_free(MJPEG_FRAME *frame) {
+    delete frame;
+}
+
+static void mjpeg_frame_unref(MJPEG_FRAME *frame) {
+    if (frame && !--frame->references)
+        mjpeg_frame_free(frame);
+}
+
+static void mjpeg_client_close(MJPEG_SERVER *server, MJPEG_CLIENT *client) {
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, client->fd, nullptr);
+    close(client->fd);
+    mjpeg_frame_unref(client->frame);
+    client->fd = -1;
+    client->frame = nullptr;
+}
+
+/**
+ * Start sending a frame to an idle client
+ */
+static void mjpeg_client_start(MJPEG_CLIENT *client, MJPEG_FRAME *frame) {
+    client->frame = frame;
+    client->offset = 0;
+    frame->references++;
+}
+
+/**
+ * Send as much of the current frame as the socket takes
+ * @return 0 if the client has to be closed
+ */
+static int mjpeg_client_send(MJPEG_SERVER *server, MJPEG_CLIENT *client) {
+    while (client->frame) {
+        MJPEG_FRAME *frame = client->frame;
+        struct iovec iov[MJPEG_FRAME_CHUNKS + 3];
+        struct msghdr msg = {};
+        size_t skip = client->offset;
+        int iovcnt = 0;
+
+        // response header (once), part header, the encoder buffers and the part end
+        if (!client->sent_response)
+            iov[iovcnt++] = {(void *) mjpeg_response, sizeof(mjpeg_response) - 1};
+        iov[iovcnt++] = {frame->header, frame->header_length};
+        for (uint32_t i = 0; i < frame->chunk_num; i++)
+            iov[iovcnt++] = {frame->chunks[i].data(), frame->chunks[i].length()};
+        iov[iovcnt++] = {(void *) mjpeg_part_end, sizeof(mjpeg_part_end) - 1};
+
+        // skip what went out before
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        while (msg.msg_iovlen && skip >= msg.msg_iov->iov_len) {
+            skip -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        msg.msg_iov->iov_base = (uint8_t *) msg.msg_iov->iov_base + skip;
+        msg.msg_iov->iov_len -= skip;
+
+        ssize_t sent = sendmsg(client->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        client->offset += sent;
+        size_t total = frame->header_length + frame->length + sizeof(mjpeg_part_end) - 1 +
+                       (client->sent_response ? 0 : sizeof(mjpeg_response) - 1);
+        if (client->offset < total)
+            continue;
+
+        // frame done, carry on with the newest one if it is newer
+        client->sent_response = 1;
+        client->frame = nullptr;
+        mjpeg_frame_unref(frame);
+        if (server->latest && server->latest->sequence > frame->sequence)
+            mjpeg_client_start(client, server->latest);
+    }
+
+    return 1;
+}
+
+/**
+ * Update the epoll registration of a client: wait for writability while a frame is being sent
+ */
+static void mjpeg_client_watch(MJPEG_SERVER *server, MJPEG_CLIENT *client) {
+    struct epoll_event event = {};
+
+    event.events = EPOLLIN | (client->frame ? (uint32_t) EPOLLOUT : 0u); // NOLINT(hicpp-signed-bitwise)
+    event.data.ptr = client;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+}
+
+static void mjpeg_server_accept(MJPEG_SERVER *server) {
+    for (;;) {
+        int fd = accept4(server->listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC); // NOLINT(hicpp-signed-bitwise)
+        MJPEG_CLIENT *client = nullptr;
+        struct epoll_event event = {};
+
+        if (fd < 0)
+            return;
+
+        for (uint32_t i = 0; i < server->client_num && !client; i++) {
+            if (server->clients[i].fd < 0)
+                client = &server->clients[i];
+        }
+        if (!client) {
+            close(fd);
+            continue;
+        }
+
+        client->fd = fd;
+        client->streaming = 0;
+        client->sent_response = 0;
+        client->frame = nullptr;
+        client->request_length = 0;
+        event.events = EPOLLIN;
+        event.data.ptr = client;
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            close(fd);
+            client->fd = -1;
+        }
+    }
+}
+
+/**
+ * Read from a client: the request before streaming, and only end of file after
+ * @return 0 if the client has to be closed
+ */
+static int mjpeg_client_read(MJPEG_CLIENT *client) {
+    char discard[256];
+
+    for (;;) {
+        char *data = client->streaming ? discard : client->request + client->request_length;
+        size_t size = client->streaming ? sizeof(discard) : MJPEG_REQUEST_MAX - 1 - client->request_length;
+        ssize_t length = recv(client->fd, data, size, MSG_DONTWAIT);
+
+        if (length == 0)
+            return 0;
+        if (length < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        if (client->streaming)
+            continue;
+
+        // any request gets the stream, once it is complete
+        client->request_length += length;
+        client->request[client->request_length] = 0;
+        if (strstr(client->request, "\r\n\r\n") || strstr(client->request, "\n\n")) {
+            client->streaming = 1;
+            return 1;
+        }
+        if (client->request_length == MJPEG_REQUEST_MAX - 1)
+            return 0;
+    }
+}
+
+/**
+ * Take the newest frame from the encoder callback and hand it to the clients
+ * @return 0 if the server is stopping
+ */
+static int mjpeg_server_take(MJPEG_SERVER *server) {
+    uint64_t value;
+    MJPEG_FRAME *frame;
+    int stop;
+
+    if (read(server->event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        return 1;
+
+    vcos_mutex_lock(&server->lock);
+    frame = server->pending;
+    server->pending = nullptr;
+    stop = server->stop;
+    vcos_mutex_unlock(&server->lock);
+
+    if (stop) {
+        if (frame)
+            mjpeg_frame_free(frame);
+        return 0;
+    }
+    if (!frame)
+        return 1;
+
+    frame->references = 1;
+    mjpeg_frame_unref(server->latest);
+    server->latest = frame;
+
+    for (uint32_t i = 0; i < server->client_num; i++) {
+        MJPEG_CLIENT *client = &server->clients[i];
+
+        if (client->fd < 0 || !client->streaming)
+            continue;
+
+        if (client->frame) {
+            // still on a frame before the previous one, too slow to keep up
+            if (client->frame->sequence + 1 < frame->sequence)
+                mjpeg_client_close(server, client);
+            continue;
+        }
+
+        mjpeg_client_start(client, frame);
+        if (!mjpeg_client_send(server, client))
+            mjpeg_client_close(server, client);
+        else
+            mjpeg_client_watch(server, client);
+    }
+
+    return 1;
+}
+
+static void *mjpeg_server_thread(void *arg) {
+    auto *server = (MJPEG_SERVER *) arg;
+    struct epoll_event events[16];
+
+    for (;;) {
+        int count = epoll_wait(server->epoll_fd, events, 16, -1);
+
+        if (count < 0 && errno != EINTR) {
+            vcos_log_error("MJPEG server: epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            auto *client = (MJPEG_CLIENT *) events[i].data.ptr;
+
+            if (events[i].data.ptr == server) {
+                if (!mjpeg_server_take(server))
+                    return nullptr;
+                continue;
+            }
+            if (!client) {
+                mjpeg_server_accept(server);
+                continue;
+            }
+            if (client->fd < 0)
+                continue; // closed earlier in this round
+
+            int keep = !(events[i].events & (EPOLLERR | EPOLLHUP)); // NOLINT(hicpp-signed-bitwise)
+            if (keep && (events[i].events & EPOLLIN)) {
+                int was_streaming = client->streaming;
+                keep = mjpeg_client_read(client);
+                // start the new client on the newest frame
+                if (keep && !was_streaming && client->streaming && server->latest)
+                    mjpeg_client_start(client, server->latest);
+            }
+            if (keep && client->frame)
+                keep = mjpeg_client_send(server, client);
+
+            if (keep)
+                mjpeg_client_watch(server, client);
+            else
+                mjpeg_client_close(server, client);
+        }
+    }
+
+    return nullptr;
+}
+
+/**
+ * Open the listening socket
+ * @return The socket, or -1 on error
+ */
+static int mjpeg_server_listen(CAM_STATE *state) {
+    struct sockaddr_in address = {};
+    int fd, on = 1;
+
+    address.sin_family = AF_INET;
+    address.sin_port = htons(state->mjpegPort);
+    if (inet_pton(AF_INET, state->mjpegAddress ? state->mjpegAddress : "127.0.0.1", &address.sin_addr) != 1) {
+        vcos_log_error("%s: invalid address %s", __func__, state->mjpegAddress);
+        return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0); // NOLINT(hicpp-signed-bitwise)
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(fd, 8) < 0) {
+        vcos_log_error("%s: unable to listen on port %u: %s", __func__, state->mjpegPort, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Create the MJPEG server and its thread, if state->mjpegPort is set
+ *
+ * @param state Pointer to state control struct
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T mjpeg_server_create(CAM_STATE *state) {
+    struct epoll_event event = {};
+
+    if (!state->mjpegPort || state->mjpeg_server)
+        return MMAL_SUCCESS;
+
+    if (state->encoding != MMAL_ENCODING_MJPEG) {
+        vcos_log_error("%s: the MJPEG server needs MJPEG encoding", __func__);
+        return MMAL_EINVAL;
+    }
+
+    auto *server = new(std::nothrow) MJPEG_SERVER();
+    if (!server)
+        return MMAL_ENOMEM;
+
+    server->client_num = state->mjpegMaxClients ? state->mjpegMaxClients : MJPEG_DEFAULT_CLIENTS;
+    server->clients = new(std::nothrow) MJPEG_CLIENT[server->client_num];
+    if (!server->clients) {
+        delete server;
+        return MMAL_ENOMEM;
+    }
+    for (uint32_t i = 0; i < server->client_num; i++) {
+        server->clients[i].fd = -1;
+        server->clients[i].frame = nullptr;
+    }
+
+    server->listen_fd = mjpeg_server_listen(state);
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); // NOLINT(hicpp-signed-bitwise)
+    if (server->listen_fd < 0 || server->epoll_fd < 0 || server->event_fd < 0)
+        goto error;
+
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &event) < 0)
+        goto error;
+    event.data.ptr = server;
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->event_fd, &event) < 0)
+        goto error;
+
+    if (vcos_mutex_create(&server->lock, "cam-mjpeg") != VCOS_SUCCESS)
+        goto error;
+    if (vcos_thread_create(&server->thread, "cam-mjpeg", nullptr, mjpeg_server_thread, server) != VCOS_SUCCESS) {
+        vcos_log_error("%s: failed to create server thread", __func__);
+        vcos_mutex_delete(&server->lock);
+        goto error;
+    }
+
+    state->mjpeg_server = server;
+    return MMAL_SUCCESS;
+
+error:
+    if (server->listen_fd >= 0)
+        close(server->listen_fd);
+    if (server->epoll_fd >= 0)
+        close(server->epoll_fd);
+    if (server->event_fd >= 0)
+        close(server->event_fd);
+    delete[] server->clients;
+    delete server;
+    return MMAL_EIO;
+}
+
+/**
+ * Stop the server thread, disconnect the clients and release the frames they held.
+ * The encoder output port must be disabled first.
+ *
+ * @param state Pointer to state control struct
+ */
+void mjpeg_server_destroy(CAM_STATE *state) {
+    MJPEG_SERVER *server = state->mjpeg_server;
+    uint64_t one = 1;
+
+    if (!server)
+        return;
+
+    vcos_mutex_lock(&server->lock);
+    server->stop = 1;
+    vcos_mutex_unlock(&server->lock);
+    if (write(server->event_fd, &one, sizeof(one)) < 0)
+        vcos_log_error("%s: unable to wake the server thread", __func__);
+    vcos_thread_join(&server->thread, nullptr);
+
+    for (uint32_t i = 0; i < server->client_num; i++) {
+        if (server->clients[i].fd >= 0)
+            mjpeg_client_close(server, &server->clients[i]);
+    }
+    mjpeg_frame_unref(server->latest);
+    if (server->pending)
+        mjpeg_frame_free(server->pending);
+    if (server->assembling)
+        mjpeg_frame_free(server->assembling);
+
+    vcos_mutex_delete(&server->lock);
+    close(server->listen_fd);
+    close(server->epoll_fd);
+    close(server->event_fd);
+    delete[] server->clients;
+    delete server;
+    state->mjpeg_server = nullptr;
+}
+
+/**
+ * Add an encoder output buffer to the frame being received, called from the encoder callback.
+ * A complete frame replaces the one the server thread has not taken yet, if any.
+ *
+ * @param state Pointer to state control struct
+ * @param buffer Encoder output buffer
+ */
+void mjpeg_server_push(CAM_STATE *state, MMAL_BUFFER_HEADER_T *buffer) {
+    MJPEG_SERVER *server = state->mjpeg_server;
+    MJPEG_FRAME *frame = server->assembling, *replaced;
+    uint64_t one = 1;
+
+    if (!frame) {
+        frame = server->assembling = new(std::nothrow) MJPEG_FRAME();
+        if (!frame)
+            return;
+    }
+
+    if (frame->chunk_num < MJPEG_FRAME_CHUNKS) {
+        frame->chunks[frame->chunk_num++] = FrameRef(buffer, buffer->pts);
+        frame->length += buffer->length;
+    } else {
+        // too large to send, it is dropped at its end
+        frame->length = 0;
+    }
+
+    if (!(buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)) // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+        return;
+
+    server->assembling = nullptr;
+    if (!frame->length) {
+        mjpeg_frame_free(frame);
+        return;
+    }
+
+    frame->sequence = ++server->sequence;
+    frame->header_length = (uint32_t) snprintf(frame->header, sizeof(frame->header),
+                                               "--" MJPEG_BOUNDARY "\r\nContent-Type: image/jpeg\r\n"
+                                               "Content-Length: %u\r\n\r\n", frame->length);
+
+    vcos_mutex_lock(&server->lock);
+    replaced = server->pending;
+    server->pending = frame;
+    vcos_mutex_unlock(&server->lock);
+
+    if (replaced)
+        mjpeg_frame_free(replaced);
+    if (write(server->event_fd, &one, sizeof(one)) < 0)
+        vcos_log_error("%s: unable to wake the server thread", __func__);
+}
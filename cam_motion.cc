@@ -0,0 +1,241 @@
+//
+// Motion detection on the inline motion vectors of the H264 encoder.
+//
+// A macroblock is active when its vector length and SAD both reach their thresholds and it is
+// inside the region mask. Each macroblock keeps a bit history, and only blocks that are active
+// in this frame and the previous one are counted, which filters out single frame noise. A frame
+// has motion when enough blocks are counted; motion starts after start_frames such frames in a
+// row and stops after stop_frames frames without.
+//
+// The per-macroblock pass uses NEON when the compiler targets it, eight blocks at a time, and
+// a scalar loop otherwise (ARMv6 Pi Zero/1) and for the remainder.
+//
+
+#include "cam.h"
+#include <cstring>
+#include <new>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define MOTION_USE_NEON 1
+#endif
+
+struct motion_detector_s {
+    MOTION_DETECT_PARAMETERS parameters;
+    MotionEventCallback event_cb;
+    uint32_t columns;           /// grid the mask and history were built for
+    uint32_t rows;
+    uint8_t *mask;              /// 0xFF for macroblocks to analyse, 0 otherwise (and for the padding column)
+    uint8_t *history;           /// active bit of each macroblock over the last frames
+    uint32_t motion_frames;     /// consecutive frames with motion
+    uint32_t still_frames;      /// consecutive frames without motion
+    int active;                 /// motion has started
+    int scalar;                 /// NEON is not used (motion_detector_use_neon)
+};
+
+/**
+ * Set up the mask and history for a grid, the padding column of each row is never analysed
+ * @return !0 if successful
+ */
+static int motion_detector_resize(MOTION_DETECTOR *detector, uint32_t columns, uint32_t rows) {
+    const uint8_t *region = detector->parameters.mask;
+    size_t count = (size_t) columns * rows;
+
+    free(detector->mask);
+    free(detector->history);
+    detector->mask = (uint8_t *) malloc(count);
+    detector->history = (uint8_t *) calloc(count, 1);
+    if (!detector->mask || !detector->history) {
+        free(detector->mask);
+        free(detector->history);
+        detector->mask = detector->history = nullptr;
+        detector->columns = detector->rows = 0;
+        return 0;
+    }
+
+    for (uint32_t y = 0; y < rows; y++) {
+        for (uint32_t x = 0; x < columns; x++) {
+            int analyse = x < columns - 1 && (!region || region[y * (columns - 1) + x]);
+            detector->mask[y * columns + x] = analyse ? 0xFF : 0;
+        }
+    }
+
+    detector->columns = columns;
+    detector->rows = rows;
+    return 1;
+}
+
+/**
+ * Update the history of a range of macroblocks
+ * @return number of blocks active in this frame and the previous one
+ */
+static uint32_t motion_count_scalar(const CAM_MOTION_VECTOR *vectors, const uint8_t *mask, uint8_t *history,
+                                    uint32_t count, uint32_t magnitude2, uint32_t sad) {
+    uint32_t blocks = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t length2 = vectors[i].x * vectors[i].x + vectors[i].y * vectors[i].y;
+        uint8_t active = length2 >= magnitude2 && vectors[i].sad >= sad && mask[i];
+
+        history[i] = (uint8_t) (history[i] << 1u) | active;
+        blocks += (history[i] & 3u) == 3u;
+    }
+
+    return blocks;
+}
+
+#ifdef MOTION_USE_NEON
+
+/**
+ * NEON version of motion_count_scalar, for a multiple of 8 macroblocks
+ */
+static uint32_t motion_count_neon(const CAM_MOTION_VECTOR *vectors, const uint8_t *mask, uint8_t *history,
+                                  uint32_t count, uint32_t magnitude2, uint32_t sad) {
+    const uint16x8_t magnitude2_threshold = vdupq_n_u16((uint16_t) vcos_min(magnitude2, 0xFFFFu));
+    const uint16x8_t sad_threshold = vdupq_n_u16((uint16_t) vcos_min(sad, 0xFFFFu));
+    // a SAD threshold beyond 16 bits is never reached, as in the scalar pass (a SAD of 0xFFFF included)
+    const uint16x8_t sad_reachable = vdupq_n_u16(sad > 0xFFFFu ? 0 : 0xFFFFu);
+    const uint8x8_t one = vdup_n_u8(1), three = vdup_n_u8(3);
+    uint16x4_t blocks = vdup_n_u16(0);
+
+    for (uint32_t i = 0; i < count; i += 8) {
+        // de-interleave x, y and the two SAD bytes of 8 blocks
+        uint8x8x4_t v = vld4_u8((const uint8_t *) &vectors[i]);
+        int8x8_t x = vreinterpret_s8_u8(v.val[0]), y = vreinterpret_s8_u8(v.val[1]);
+        uint16x8_t length2 = vaddq_u16(vreinterpretq_u16_s16(vmull_s8(x, x)), vreinterpretq_u16_s16(vmull_s8(y, y)));
+        uint16x8_t block_sad = vorrq_u16(vmovl_u8(v.val[2]), vshlq_n_u16(vmovl_u8(v.val[3]), 8));
+        uint16x8_t sad_pass = vandq_u16(vcgeq_u16(block_sad, sad_threshold), sad_reachable);
+        uint16x8_t pass = vandq_u16(vcgeq_u16(length2, magnitude2_threshold), sad_pass);
+        uint8x8_t active = vand_u8(vand_u8(vmovn_u16(pass), vld1_u8(&mask[i])), one);
+        uint8x8_t h = vorr_u8(vshl_n_u8(vld1_u8(&history[i]), 1), active);
+
+        vst1_u8(&history[i], h);
+        blocks = vpadal_u8(blocks, vand_u8(vceq_u8(vand_u8(h, three), three), one));
+    }
+
+    uint32x2_t sum = vpaddl_u16(blocks);
+    return vget_lane_u32(sum, 0) + vget_lane_u32(sum, 1);
+}
+
+#endif
+
+/**
+ * Create a motion detector
+ *
+ * @param parameters Thresholds, filter lengths and region mask, copied (the mask itself is not)
+ * @param event_cb Called when motion starts and stops, may be empty
+ * @return The detector, or nullptr if out of memory
+ */
+MOTION_DETECTOR *motion_detector_create(const MOTION_DETECT_PARAMETERS *parameters, MotionEventCallback event_cb) {
+    auto *detector = new(std::nothrow) MOTION_DETECTOR();
+
+    if (!detector)
+        return nullptr;
+
+    detector->parameters = *parameters;
+    detector->event_cb = std::move(event_cb);
+    return detector;
+}
+
+/**
+ * Destroy a motion detector
+ *
+ * @param detector Detector to destroy, may be nullptr
+ */
+void motion_detector_destroy(MOTION_DETECTOR *detector) {
+    if (!detector)
+        return;
+
+    free(detector->mask);
+    free(detector->history);
+    delete detector;
+}
+
+/**
+ * Analyse the motion vectors of a frame
+ *
+ * @param detector The motion detector
+ * @param timestamp Time of the frame, passed on to the event callback
+ * @param vectors Motion vectors, rows of columns macroblocks including the padding column
+ * @param columns Macroblocks per row, including the padding column
+ * @param rows Number of rows
+ * @return Number of macroblocks with motion in this frame (after the temporal filter)
+ */
+uint32_t motion_detector_process(MOTION_DETECTOR *detector, int64_t timestamp, const CAM_MOTION_VECTOR *vectors,
+                                 uint32_t columns, uint32_t rows) {
+    const MOTION_DETECT_PARAMETERS *parameters = &detector->parameters;
+    uint32_t magnitude2 = parameters->magnitude_threshold * parameters->magnitude_threshold;
+    uint32_t count = columns * rows, done = 0, blocks = 0;
+
+    if ((columns != detector->columns || rows != detector->rows) && !motion_detector_resize(detector, columns, rows))
+        return 0;
+
+#ifdef MOTION_USE_NEON
+    if (!detector->scalar) {
+        done = count & ~7u;
+        blocks = motion_count_neon(vectors, detector->mask, detector->history, done, magnitude2,
+                                   parameters->sad_threshold);
+    }
+#endif
+    blocks += motion_count_scalar(vectors + done, detector->mask + done, detector->history + done, count - done,
+                                  magnitude2, parameters->sad_threshold);
+
+    if (blocks >= parameters->min_blocks) {
+        detector->motion_frames++;
+        detector->still_frames = 0;
+    } else {
+        detector->still_frames++;
+        detector->motion_frames = 0;
+    }
+
+    if (!detector->active && detector->motion_frames >= vcos_max(parameters->start_frames, 1u)) {
+        detector->active = 1;
+        if (detector->event_cb)
+            detector->event_cb(MOTION_EVENT_START, timestamp, blocks);
+    } else if (detector->active && detector->still_frames >= vcos_max(parameters->stop_frames, 1u)) {
+        detector->active = 0;
+        if (detector->event_cb)
+            detector->event_cb(MOTION_EVENT_STOP, timestamp, blocks);
+    }
+
+    return blocks;
+}
+
+/**
+ * @param detector The motion detector
+ * @return !0 between a motion start and stop event
+ */
+int motion_detector_active(MOTION_DETECTOR *detector) {
+    return detector->active;
+}
+
+/**
+ * Use NEON for the per-macroblock pass or not, e.g. to check it against the scalar one
+ *
+ * @param detector The motion detector
+ * @param enable !0 to use NEON where the build targets it (the default), 0 for the scalar pass
+ * @return !0 if NEON is used from now on
+ */
+int motion_detector_use_neon(MOTION_DETECTOR *detector, int enable) {
+#ifdef MOTION_USE_NEON
+    detector->scalar = !enable;
+    return enable;
+#else
+    (void) enable;
+    detector->scalar = 1;
+    return 0;
+#endif
+}
+
+/**
+ * @param detector The motion detector
+ * @param[out] columns Macroblocks per row of the last frame, including the padding column
+ * @param[out] rows Rows of the last frame
+ * @return The history of each macroblock of the last frame: bit 0 is set if it was active in that frame, bit 1
+ *         in the one before. nullptr before the first frame
+ */
+const uint8_t *motion_detector_history(MOTION_DETECTOR *detector, uint32_t *columns, uint32_t *rows) {
+    *columns = detector->columns;
+    *rows = detector->rows;
+    return detector->history;
+}
@@ -0,0 +1,488 @@
+//
+// Fragmented MP4 (ISO BMFF, CMAF style) muxer for the H264 stream.
+//
+// The muxer is fed complete access units (see cam_h264.cc). Each file (or sink segment) starts
+// with an init segment (ftyp/moov) built from the SPS/PPS of its first keyframe, followed by
+// moof/mdat fragments. A fragment is closed by the first frame after it reached the fragment
+// duration, whose pts also gives the duration of its last sample. Sample data is converted to
+// length prefixed NAL units (SPS, PPS and AUD go to the avcC box instead) in the fragment
+// buffer, and a fragment goes out with one vectored write of its header and that buffer.
+// New files are only started at keyframes, when the segment number has changed.
+//
+
+#include "cam.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+
+/// Media timescale, the usual 90kHz of video
+#define MP4_TIMESCALE 90000
+/// Sample duration used until two frames were seen
+#define MP4_DEFAULT_DURATION (MP4_TIMESCALE / VIDEO_FRAME_RATE_NUM)
+/// Largest SPS or PPS accepted
+#define MP4_PARAMETER_SET_MAX 128
+/// Longest output file name
+#define MP4_FILENAME_MAX 256
+
+/// sample_flags of trun: sample_depends_on 2 (sync sample), or 1 with sample_is_non_sync_sample
+#define MP4_SAMPLE_SYNC 0x02000000u
+#define MP4_SAMPLE_NON_SYNC 0x01010000u
+
+typedef struct {
+    uint32_t size;
+    uint32_t flags;
+    int64_t time;               /// decode time, MP4_TIMESCALE
+} MP4_SAMPLE;
+
+struct mp4_muxer_s {
+    uint32_t width;
+    uint32_t height;
+    int64_t fragment_duration;          /// MP4_TIMESCALE
+    Mp4SinkCallback sink;
+    const char *filename;               /// file name, with a %d for the segment number to write a file per segment
+    int fd;
+    int segment;                        /// segment being written, -1 before the first keyframe
+    uint32_t sequence;                  /// moof sequence number
+    uint8_t sps[MP4_PARAMETER_SET_MAX];
+    uint32_t sps_length;
+    uint8_t pps[MP4_PARAMETER_SET_MAX];
+    uint32_t pps_length;
+    std::vector<MP4_SAMPLE> samples;    /// samples of the fragment
+    std::vector<uint8_t> mdat;          /// their data
+    std::vector<uint8_t> header;        /// boxes being built
+    int64_t last_duration;
+};
+
+static void put8(std::vector<uint8_t> &b, uint32_t v) {
+    b.push_back((uint8_t) v);
+}
+
+static void put16(std::vector<uint8_t> &b, uint32_t v) {
+    put8(b, v >> 8u);
+    put8(b, v);
+}
+
+static void put32(std::vector<uint8_t> &b, uint32_t v) {
+    put16(b, v >> 16u);
+    put16(b, v);
+}
+
+static void put64(std::vector<uint8_t> &b, uint64_t v) {
+    put32(b, (uint32_t) (v >> 32u));
+    put32(b, (uint32_t) v);
+}
+
+static void put_zero(std::vector<uint8_t> &b, size_t count) {
+    b.insert(b.end(), count, 0);
+}
+
+/**
+ * Start a box, its size is filled in by box_end()
+ * @return Offset of the box
+ */
+static size_t box_start(std::vector<uint8_t> &b, const char *type, int full = 0, uint32_t version_flags = 0) {
+    size_t offset = b.size();
+
+    put32(b, 0);
+    b.insert(b.end(), type, type + 4);
+    if (full)
+        put32(b, version_flags);
+    return offset;
+}
+
+static void box_end(std::vector<uint8_t> &b, size_t offset) {
+    auto size = (uint32_t) (b.size() - offset);
+
+    b[offset] = (uint8_t) (size >> 24u);
+    b[offset + 1] = (uint8_t) (size >> 16u);
+    b[offset + 2] = (uint8_t) (size >> 8u);
+    b[offset + 3] = (uint8_t) size;
+}
+
+static void put_matrix(std::vector<uint8_t> &b) {
+    static const uint32_t unity[9] = {0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000};
+
+    for (uint32_t v : unity)
+        put32(b, v);
+}
+
+/**
+ * Build the init segment: ftyp and moov with a single video track
+ */
+static void mp4_build_init(MP4_MUXER *muxer, std::vector<uint8_t> &b) {
+    size_t ftyp, moov, trak, mdia, minf, dinf, dref, stbl, stsd, avc1, avcc, mvex, box;
+
+    ftyp = box_start(b, "ftyp");
+    b.insert(b.end(), {'i', 's', 'o', 'm'});
+    put32(b, 0x200);
+    b.insert(b.end(), {'i', 's', 'o', 'm', 'i', 's', 'o', '6', 'a', 'v', 'c', '1', 'c', 'm', 'f', 'c'});
+    box_end(b, ftyp);
+
+    moov = box_start(b, "moov");
+
+    box = box_start(b, "mvhd", 1);
+    put32(b, 0);                    // creation_time
+    put32(b, 0);                    // modification_time
+    put32(b, 1000);                 // timescale
+    put32(b, 0);                    // duration, unknown for fragmented files
+    put32(b, 0x00010000);           // rate
+    put16(b, 0x0100);               // volume
+    put_zero(b, 10);
+    put_matrix(b);
+    put_zero(b, 24);                // pre_defined
+    put32(b, 2);                    // next_track_ID
+    box_end(b, box);
+
+    trak = box_start(b, "trak");
+    box = box_start(b, "tkhd", 1, 3); // enabled, in movie
+    put32(b, 0);
+    put32(b, 0);
+    put32(b, 1);                    // track_ID
+    put32(b, 0);
+    put32(b, 0);                    // duration
+    put_zero(b, 8);
+    put16(b, 0);                    // layer
+    put16(b, 0);                    // alternate_group
+    put16(b, 0);                    // volume
+    put16(b, 0);
+    put_matrix(b);
+    put32(b, muxer->width << 16u);
+    put32(b, muxer->height << 16u);
+    box_end(b, box);
+
+    mdia = box_start(b, "mdia");
+    box = box_start(b, "mdhd", 1);
+    put32(b, 0);
+    put32(b, 0);
+    put32(b, MP4_TIMESCALE);
+    put32(b, 0);
+    put16(b, 0x55c4);               // language "und"
+    put16(b, 0);
+    box_end(b, box);
+
+    box = box_start(b, "hdlr", 1);
+    put32(b, 0);
+    b.insert(b.end(), {'v', 'i', 'd', 'e'});
+    put_zero(b, 12);
+    b.insert(b.end(), {'V', 'i', 'd', 'e', 'o', 'H', 'a', 'n', 'd', 'l', 'e', 'r', 0});
+    box_end(b, box);
+
+    minf = box_start(b, "minf");
+    box = box_start(b, "vmhd", 1, 1);
+    put_zero(b, 8);                 // graphicsmode, opcolor
+    box_end(b, box);
+
+    dinf = box_start(b, "dinf");
+    dref = box_start(b, "dref", 1);
+    put32(b, 1);
+    box = box_start(b, "url ", 1, 1); // data in this file
+    box_end(b, box);
+    box_end(b, dref);
+    box_end(b, dinf);
+
+    stbl = box_start(b, "stbl");
+    stsd = box_start(b, "stsd", 1);
+    put32(b, 1);
+    avc1 = box_start(b, "avc1");
+    put_zero(b, 6);
+    put16(b, 1);                    // data_reference_index
+    put_zero(b, 16);
+    put16(b, muxer->width);
+    put16(b, muxer->height);
+    put32(b, 0x00480000);           // 72 dpi
+    put32(b, 0x00480000);
+    put32(b, 0);
+    put16(b, 1);                    // frame_count
+    put_zero(b, 32);                // compressorname
+    put16(b, 0x0018);               // depth
+    put16(b, 0xffff);
+
+    avcc = box_start(b, "avcC");
+    put8(b, 1);                     // configurationVersion
+    put8(b, muxer->sps[1]);         // profile_idc
+    put8(b, muxer->sps[2]);         // constraint flags
+    put8(b, muxer->sps[3]);         // level_idc
+    put8(b, 0xff);                  // 4 byte NAL unit lengths
+    put8(b, 0xe1);                  // 1 SPS
+    put16(b, muxer->sps_length);
+    b.insert(b.end(), muxer->sps, muxer->sps + muxer->sps_length);
+    put8(b, 1);                     // 1 PPS
+    put16(b, muxer->pps_length);
+    b.insert(b.end(), muxer->pps, muxer->pps + muxer->pps_length);
+    if (muxer->sps[1] == 100 || muxer->sps[1] == 110 || muxer->sps[1] == 122 || muxer->sps[1] == 144) {
+        put8(b, 0xfd);              // chroma_format 4:2:0, as output by the encoder
+        put8(b, 0xf8);              // 8 bit luma
+        put8(b, 0xf8);              // 8 bit chroma
+        put8(b, 0);                 // no SPS extensions
+    }
+    box_end(b, avcc);
+    box_end(b, avc1);
+    box_end(b, stsd);
+
+    // samples are all in the fragments
+    box = box_start(b, "stts", 1);
+    put32(b, 0);
+    box_end(b, box);
+    box = box_start(b, "stsc", 1);
+    put32(b, 0);
+    box_end(b, box);
+    box = box_start(b, "stsz", 1);
+    put32(b, 0);
+    put32(b, 0);
+    box_end(b, box);
+    box = box_start(b, "stco", 1);
+    put32(b, 0);
+    box_end(b, box);
+    box_end(b, stbl);
+    box_end(b, minf);
+    box_end(b, mdia);
+    box_end(b, trak);
+
+    mvex = box_start(b, "mvex");
+    box = box_start(b, "trex", 1);
+    put32(b, 1);                    // track_ID
+    put32(b, 1);                    // default_sample_description_index
+    put32(b, 0);
+    put32(b, 0);
+    put32(b, 0);
+    box_end(b, box);
+    box_end(b, mvex);
+
+    box_end(b, moov);
+}
+
+/**
+ * Pass data to the sink, or write it to the current file
+ * @return MMAL_SUCCESS if all OK, MMAL_EIO otherwise
+ */
+static MMAL_STATUS_T mp4_output(MP4_MUXER *muxer, struct iovec *iov, int iovcnt) {
+    if (muxer->sink)
+        return muxer->sink(muxer->segment, iov, iovcnt) ? MMAL_SUCCESS : MMAL_EIO;
+
+    while (iovcnt) {
+        ssize_t written = writev(muxer->fd, iov, iovcnt);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            vcos_log_error("MP4 write failed: %s", strerror(errno));
+            return MMAL_EIO;
+        }
+        // skip what was written, a short write leaves part of an iovec
+        while (iovcnt && (size_t) written >= iov->iov_len) {
+            written -= (ssize_t) iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt) {
+            iov->iov_base = (uint8_t *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return MMAL_SUCCESS;
+}
+
+/**
+ * Write the pending samples as a moof/mdat fragment
+ *
+ * @param next_time Decode time of the following sample, for the duration of the last one
+ */
+static MMAL_STATUS_T mp4_write_fragment(MP4_MUXER *muxer, int64_t next_time) {
+    std::vector<uint8_t> &b = muxer->header;
+    size_t moof, traf, box, data_offset;
+    struct iovec iov[2];
+
+    if (muxer->samples.empty())
+        return MMAL_SUCCESS;
+
+    b.clear();
+    moof = box_start(b, "moof");
+    box = box_start(b, "mfhd", 1);
+    put32(b, ++muxer->sequence);
+    box_end(b, box);
+
+    traf = box_start(b, "traf");
+    box = box_start(b, "tfhd", 1, 0x020000); // default-base-is-moof
+    put32(b, 1);
+    box_end(b, box);
+    box = box_start(b, "tfdt", 1, 0x01000000); // version 1, 64 bit time
+    put64(b, (uint64_t) muxer->samples[0].time);
+    box_end(b, box);
+
+    // data-offset, sample-duration, sample-size and sample-flags present
+    box = box_start(b, "trun", 1, 0x000701);
+    put32(b, (uint32_t) muxer->samples.size());
+    data_offset = b.size();
+    put32(b, 0);
+    for (size_t i = 0; i < muxer->samples.size(); i++) {
+        int64_t end = i + 1 < muxer->samples.size() ? muxer->samples[i + 1].time : next_time;
+        int64_t duration = end - muxer->samples[i].time;
+
+        put32(b, duration > 0 ? (uint32_t) duration : 0);
+        put32(b, muxer->samples[i].size);
+        put32(b, muxer->samples[i].flags);
+    }
+    box_end(b, box);
+    box_end(b, traf);
+    box_end(b, moof);
+
+    // mdat header, the data follows straight from the fragment buffer
+    auto data_start = (uint32_t) (b.size() + 8);
+    b[data_offset] = (uint8_t) (data_start >> 24u);
+    b[data_offset + 1] = (uint8_t) (data_start >> 16u);
+    b[data_offset + 2] = (uint8_t) (data_start >> 8u);
+    b[data_offset + 3] = (uint8_t) data_start;
+    put32(b, (uint32_t) (muxer->mdat.size() + 8));
+    b.insert(b.end(), {'m', 'd', 'a', 't'});
+
+    iov[0] = {b.data(), b.size()};
+    iov[1] = {muxer->mdat.data(), muxer->mdat.size()};
+    muxer->samples.clear();
+    muxer->mdat.clear();
+
+    return mp4_output(muxer, iov, 2);
+}
+
+/**
+ * Start the next segment: a new file if writing files, then the init segment
+ */
+static MMAL_STATUS_T mp4_start_segment(MP4_MUXER *muxer, int segment) {
+    std::vector<uint8_t> &b = muxer->header;
+    struct iovec iov;
+
+    if (!muxer->sink) {
+        char name[MP4_FILENAME_MAX];
+
+        // a single file only gets one init segment
+        if (muxer->fd >= 0 && !strchr(muxer->filename, '%')) {
+            muxer->segment = segment;
+            return MMAL_SUCCESS;
+        }
+
+        if (muxer->fd >= 0)
+            close(muxer->fd);
+        snprintf(name, sizeof(name), muxer->filename, segment);
+        muxer->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666); // NOLINT(hicpp-signed-bitwise)
+        if (muxer->fd < 0) {
+            vcos_log_error("%s: unable to open %s: %s", __func__, name, strerror(errno));
+            return MMAL_EIO;
+        }
+    }
+
+    muxer->segment = segment;
+    b.clear();
+    mp4_build_init(muxer, b);
+    iov = {b.data(), b.size()};
+    return mp4_output(muxer, &iov, 1);
+}
+
+/**
+ * Create an MP4 muxer
+ *
+ * @param width Width of the video
+ * @param height Height of the video
+ * @param fragment_duration Minimum duration of a fragment in ms, 0 for a fragment per frame
+ * @param filename File to write to, a %d in it is replaced by the segment number and starts a file per segment.
+ *                 Not copied, must stay valid. Unused if sink is set
+ * @param sink Receives the output instead of a file, may be empty
+ * @return The muxer, or nullptr if out of memory
+ */
+MP4_MUXER *mp4_muxer_create(uint32_t width, uint32_t height, uint32_t fragment_duration, const char *filename,
+                            Mp4SinkCallback sink) {
+    if (!sink && !filename) {
+        vcos_log_error("%s: no file name or sink specified", __func__);
+        return nullptr;
+    }
+
+    auto *muxer = new(std::nothrow) MP4_MUXER();
+    if (!muxer)
+        return nullptr;
+
+    muxer->width = width;
+    muxer->height = height;
+    muxer->fragment_duration = (int64_t) fragment_duration * MP4_TIMESCALE / 1000;
+    muxer->filename = filename;
+    muxer->sink = std::move(sink);
+    muxer->fd = -1;
+    muxer->segment = -1;
+    muxer->last_duration = MP4_DEFAULT_DURATION;
+    return muxer;
+}
+
+/**
+ * Write the last fragment and destroy the muxer
+ *
+ * @param muxer Muxer to destroy, may be nullptr
+ */
+void mp4_muxer_destroy(MP4_MUXER *muxer) {
+    if (!muxer)
+        return;
+
+    if (!muxer->samples.empty())
+        mp4_write_fragment(muxer, muxer->samples.back().time + muxer->last_duration);
+    if (muxer->fd >= 0)
+        close(muxer->fd);
+    delete muxer;
+}
+
+/**
+ * Add an access unit to the MP4 output. Frames before the first keyframe with SPS/PPS are skipped.
+ *
+ * @param muxer The MP4 muxer
+ * @param unit Access unit, pts in microseconds
+ * @param segment Segment the access unit belongs to, a new segment starts at the next keyframe
+ * @return MMAL_SUCCESS if all OK, MMAL_EIO if the output failed
+ */
+MMAL_STATUS_T mp4_muxer_write(MP4_MUXER *muxer, const H264_ACCESS_UNIT *unit, int segment) {
+    MMAL_STATUS_T status = MMAL_SUCCESS;
+    int64_t time;
+
+    // the parameter sets go to the init segment
+    for (uint32_t i = 0; i < unit->nal_count; i++) {
+        const H264_NAL_UNIT *nal = &unit->nals[i];
+        uint32_t code = unit->data[nal->offset + 2] == 1 ? 3 : 4;
+
+        if ((nal->type == H264_NAL_SPS || nal->type == H264_NAL_PPS) && nal->length - code <= MP4_PARAMETER_SET_MAX) {
+            int sps = nal->type == H264_NAL_SPS;
+            memcpy(sps ? muxer->sps : muxer->pps, unit->data + nal->offset + code, nal->length - code);
+            *(sps ? &muxer->sps_length : &muxer->pps_length) = nal->length - code;
+        }
+    }
+
+    if (unit->pts != MMAL_TIME_UNKNOWN)
+        time = unit->pts * MP4_TIMESCALE / 1000000;
+    else if (!muxer->samples.empty())
+        time = muxer->samples.back().time + muxer->last_duration;
+    else
+        time = 0;
+
+    if (!muxer->samples.empty() && time > muxer->samples.back().time)
+        muxer->last_duration = time - muxer->samples.back().time;
+
+    if (unit->keyframe && segment != muxer->segment && muxer->sps_length >= 4 && muxer->pps_length) {
+        if ((status = mp4_write_fragment(muxer, time)) == MMAL_SUCCESS)
+            status = mp4_start_segment(muxer, segment);
+    } else if (!muxer->samples.empty() && time - muxer->samples[0].time >= muxer->fragment_duration) {
+        status = mp4_write_fragment(muxer, time);
+    }
+
+    if (status != MMAL_SUCCESS || muxer->segment < 0)
+        return status;
+
+    // length prefixed NAL units
+    MP4_SAMPLE sample = {0, unit->keyframe ? MP4_SAMPLE_SYNC : MP4_SAMPLE_NON_SYNC, time};
+    for (uint32_t i = 0; i < unit->nal_count; i++) {
+        const H264_NAL_UNIT *nal = &unit->nals[i];
+        uint32_t code = unit->data[nal->offset + 2] == 1 ? 3 : 4;
+        uint32_t length = nal->length - code;
+
+        if (nal->type == H264_NAL_SPS || nal->type == H264_NAL_PPS || nal->type == H264_NAL_AUD)
+            continue;
+        put32(muxer->mdat, length);
+        muxer->mdat.insert(muxer->mdat.end(), unit->data + nal->offset + code, unit->data + nal->offset + nal->length);
+        sample.size += 4 + length;
+    }
+    muxer->samples.push_back(sample);
+
+    return MMAL_SUCCESS;
+}
@@ -0,0 +1,217 @@
+//
+// Camera control parameters applied as a change set.
+//
+// Every camera parameter is a synchronous round trip to the VideoCore. A CAM_PARAMETER_CACHE
+// remembers what a camera component was last set to, so that live changes only send the
+// parameters that differ from it. Nothing is assumed of a new camera component: its cache starts
+// out empty, so the first change set (at creation) sends every parameter, as set_all_parameters
+// does, and seeds the cache with those the camera took.
+//
+// The outcome is reported per parameter; a parameter that failed is forgotten by the cache, so it
+// is sent again with the next change set.
+//
+
+#include "cam.h"
+
+/**
+ * @return !0 if a parameter differs between two parameter blocks
+ */
+static int camera_parameter_differs(CAM_PARAMETER_T id, const CAM_PARAMETERS *a, const CAM_PARAMETERS *b) {
+    switch (id) {
+        case CAM_PARAMETER_SATURATION:
+            return a->saturation != b->saturation;
+        case CAM_PARAMETER_SHARPNESS:
+            return a->sharpness != b->sharpness;
+        case CAM_PARAMETER_CONTRAST:
+            return a->contrast != b->contrast;
+        case CAM_PARAMETER_BRIGHTNESS:
+            return a->brightness != b->brightness;
+        case CAM_PARAMETER_ISO:
+            return a->ISO != b->ISO;
+        case CAM_PARAMETER_VIDEO_STABILISATION:
+            return a->videoStabilisation != b->videoStabilisation;
+        case CAM_PARAMETER_EXPOSURE_COMPENSATION:
+            return a->exposureCompensation != b->exposureCompensation;
+        case CAM_PARAMETER_EXPOSURE_MODE:
+            return a->exposureMode != b->exposureMode;
+        case CAM_PARAMETER_FLICKER_AVOID_MODE:
+            return a->flickerAvoidMode != b->flickerAvoidMode;
+        case CAM_PARAMETER_METERING_MODE:
+            return a->exposureMeterMode != b->exposureMeterMode;
+        case CAM_PARAMETER_AWB_MODE:
+            return a->awbMode != b->awbMode;
+        case CAM_PARAMETER_AWB_GAINS:
+            return a->awb_gains_r != b->awb_gains_r || a->awb_gains_b != b->awb_gains_b;
+        case CAM_PARAMETER_ROTATION:
+            return a->rotation != b->rotation;
+        case CAM_PARAMETER_FLIPS:
+            return a->hflip != b->hflip || a->vflip != b->vflip;
+        case CAM_PARAMETER_ROI:
+            return a->roi.x != b->roi.x || a->roi.y != b->roi.y || a->roi.w != b->roi.w || a->roi.h != b->roi.h;
+        case CAM_PARAMETER_SHUTTER_SPEED:
+            return a->shutter_speed != b->shutter_speed;
+        case CAM_PARAMETER_DRC:
+            return a->drc_level != b->drc_level;
+        case CAM_PARAMETER_STATS_PASS:
+            return a->stats_pass != b->stats_pass;
+        case CAM_PARAMETER_GAINS:
+            return a->analog_gain != b->analog_gain || a->digital_gain != b->digital_gain;
+        case CAM_PARAMETER_SETTINGS_EVENTS:
+            return a->settings != b->settings;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Send a parameter to the camera
+ *
+ * @return 0 if successful, non-zero otherwise (as the set_* functions)
+ */
+static int camera_parameter_apply(CAM_PARAMETER_T id, MMAL_COMPONENT_T *camera, const CAM_PARAMETERS *params) {
+    switch (id) {
+        case CAM_PARAMETER_SATURATION:
+            return set_saturation(camera, params->saturation);
+        case CAM_PARAMETER_SHARPNESS:
+            return set_sharpness(camera, params->sharpness);
+        case CAM_PARAMETER_CONTRAST:
+            return set_contrast(camera, params->contrast);
+        case CAM_PARAMETER_BRIGHTNESS:
+            return set_brightness(camera, params->brightness);
+        case CAM_PARAMETER_ISO:
+            return set_ISO(camera, params->ISO);
+        case CAM_PARAMETER_VIDEO_STABILISATION:
+            return set_video_stabilisation(camera, params->videoStabilisation);
+        case CAM_PARAMETER_EXPOSURE_COMPENSATION:
+            return set_exposure_compensation(camera, params->exposureCompensation);
+        case CAM_PARAMETER_EXPOSURE_MODE:
+            return set_exposure_mode(camera, params->exposureMode);
+        case CAM_PARAMETER_FLICKER_AVOID_MODE:
+            return set_flicker_avoid_mode(camera, params->flickerAvoidMode);
+        case CAM_PARAMETER_METERING_MODE:
+            return set_metering_mode(camera, params->exposureMeterMode);
+        case CAM_PARAMETER_AWB_MODE:
+            return set_awb_mode(camera, params->awbMode);
+        case CAM_PARAMETER_AWB_GAINS:
+            return set_awb_gains(camera, params->awb_gains_r, params->awb_gains_b);
+        case CAM_PARAMETER_ROTATION:
+            return set_rotation(camera, params->rotation);
+        case CAM_PARAMETER_FLIPS:
+            return set_flips(camera, params->hflip, params->vflip);
+        case CAM_PARAMETER_ROI:
+            return set_ROI(camera, params->roi);
+        case CAM_PARAMETER_SHUTTER_SPEED:
+            return set_shutter_speed(camera, params->shutter_speed);
+        case CAM_PARAMETER_DRC:
+            return set_DRC(camera, params->drc_level);
+        case CAM_PARAMETER_STATS_PASS:
+            return set_stats_pass(camera, params->stats_pass);
+        case CAM_PARAMETER_GAINS:
+            return set_gains(camera, params->analog_gain, params->digital_gain);
+        case CAM_PARAMETER_SETTINGS_EVENTS: {
+            MMAL_PARAMETER_CHANGE_EVENT_REQUEST_T change_event_request =
+                    {
+                            {MMAL_PARAMETER_CHANGE_EVENT_REQUEST, sizeof(MMAL_PARAMETER_CHANGE_EVENT_REQUEST_T)},
+                            MMAL_PARAMETER_CAMERA_SETTINGS, params->settings ? 1 : 0
+                    };
+
+            MMAL_STATUS_T status = mmal_port_parameter_set(camera->control, &change_event_request.hdr);
+            if (status != MMAL_SUCCESS) {
+                vcos_log_error("No camera settings events");
+            }
+            return status;
+        }
+        default:
+            return 1;
+    }
+}
+
+/**
+ * Forget what the camera was set to, so the next change set sends every parameter
+ *
+ * @param cache The cache of a camera component that has just been created
+ */
+void camera_parameter_cache_reset(CAM_PARAMETER_CACHE *cache) {
+    memset(&cache->applied, 0, sizeof(cache->applied));
+    cache->known = 0;
+}
+
+/**
+ * Apply a change set to a camera: the parameters that differ from what the camera was last set to
+ *
+ * @param camera Pointer to camera component
+ * @param cache What the camera was last set to, updated with the parameters that were taken.
+ *              Parameters it does not know are sent, so an empty cache sends every one.
+ *              nullptr to send every parameter, as set_all_parameters
+ * @param params Pointer to parameter block containing parameters
+ * @param result Filled with the parameters sent and the status of each
+ * @return Number of parameters that could not be set, 0 if all OK
+ */
+int apply_camera_parameters(MMAL_COMPONENT_T *camera, CAM_PARAMETER_CACHE *cache, const CAM_PARAMETERS *params,
+                            CAM_PARAMETER_RESULT *result) {
+    uint64_t start = get_microseconds64();
+    // a camera nothing is known of yet, as a newly created one
+    int fresh = !cache || !cache->known;
+    int failures = 0;
+
+    memset(result, 0, sizeof(*result));
+
+    for (uint32_t i = 0; i < CAM_PARAMETER_COUNT; i++) {
+        auto id = (CAM_PARAMETER_T) i;
+        uint32_t bit = 1u << i;
+
+        if (cache && (cache->known & bit)) {
+            if (!camera_parameter_differs(id, &cache->applied, params))
+                continue;
+        } else if (fresh && id == CAM_PARAMETER_SETTINGS_EVENTS && !params->settings) {
+            // a full set only asks for the events, a new camera does not send them unless asked to
+            if (cache)
+                cache->known |= bit;
+            continue;
+        }
+
+        result->sent |= bit;
+        result->status[i] = camera_parameter_apply(id, camera, params);
+        if (result->status[i]) {
+            result->failed |= bit;
+            failures++;
+        }
+        if (!cache)
+            continue;
+        // the camera may be anywhere after a failure, so the parameter is sent again next time
+        if (result->status[i]) {
+            cache->known &= ~bit;
+        } else {
+            cache->known |= bit;
+        }
+    }
+
+    // unsent parameters were the same already, and failed ones are no longer known
+    if (cache)
+        cache->applied = *params;
+
+    result->duration = get_microseconds64() - start;
+    return failures;
+}
+
+/**
+ * Change the camera parameters while the camera runs, sending only those that changed.
+ * Parameters set with the individual set_* functions in the meantime are not known to the cache.
+ *
+ * @param state Pointer to state control struct, state->camera_parameters becomes params
+ * @param params The parameters the camera should have
+ * @param result Filled with the parameters sent and the status of each, may be nullptr
+ * @return MMAL_SUCCESS if all OK, MMAL_EINVAL if a parameter could not be set, MMAL_ENOSYS without a camera
+ */
+MMAL_STATUS_T set_camera_parameters(CAM_STATE *state, const CAM_PARAMETERS *params, CAM_PARAMETER_RESULT *result) {
+    CAM_PARAMETER_RESULT local;
+    int failures;
+
+    if (!state->camera_component)
+        return MMAL_ENOSYS;
+
+    failures = apply_camera_parameters(state->camera_component, &state->camera_parameters_applied, params,
+                                       result ? result : &local);
+    state->camera_parameters = *params;
+    return failures ? MMAL_EINVAL : MMAL_SUCCESS;
+}
@@ -0,0 +1,245 @@
+//
+// Closed-loop rate control: steers the bitrate of the running encoder so the stream fits the
+// throughput a link can carry.
+//
+// A controller thread wakes up every RATE_CONTROL_PERIOD, takes the bytes the encoder callback
+// counted in the pipeline stats since the last time, and smooths them into a byte rate. The
+// target (rateControlTarget, updated with set_rate_control_target as the uplink estimate
+// changes) and the backlog reported by the consumer (report_rate_control_queue) decide:
+//  - over the target by more than 10%, or a backlog of more than half a second at the target
+//    rate: the bitrate drops multiplicatively, in proportion to the overshoot; a drop of more
+//    than a quarter is made at a keyframe, so the stream catches up with a small frame at once;
+//  - under 85% of the target with no backlog for a second, and not right after a drop: the bitrate
+//    climbs by 5% of the target at a time, but only as long as the encoder uses what it has.
+// In between nothing changes, so the bitrate doesn't hunt around the target. Small steps are
+// left to the encoder's own rate control within the current GOP.
+//
+
+#include "cam.h"
+#include <atomic>
+#include <new>
+
+/// Time between two control steps, in ms
+#define RATE_CONTROL_PERIOD 250
+/// Steps after a drop during which the bitrate does not climb
+#define RATE_CONTROL_HOLD 8
+/// Steps under the target before the bitrate climbs
+#define RATE_CONTROL_CLIMB_AFTER 4
+/// Lowest bitrate if rateControlMin is not set
+#define RATE_CONTROL_DEFAULT_MIN 250000
+/// Backlogs, in ms of data at the target rate, above which the bitrate drops and below which it may climb
+#define RATE_CONTROL_BACKLOG_HIGH 500
+#define RATE_CONTROL_BACKLOG_LOW 100
+
+#define RATE_CONTROL_EVENT_STOP (1u << 0u)
+
+struct rate_controller_s {
+    CAM_STATE *pstate;
+    std::atomic<uint32_t> target;       /// bytes/s
+    std::atomic<uint32_t> backlog;      /// bytes queued downstream, as last reported
+    int min_bitrate;
+    int max_bitrate;
+
+    // controller thread
+    uint64_t last_bytes;
+    uint64_t last_time;
+    double rate;                        /// smoothed bytes/s, 0 until the first step
+    uint32_t hold;                      /// steps left before the bitrate may climb
+    uint32_t under;                     /// steps in a row under the target
+    uint32_t backlog_at_drop;
+
+    VCOS_EVENT_FLAGS_T events;
+    VCOS_THREAD_T thread;
+};
+
+/**
+ * Work out the next bitrate from the measured rate and the backlog
+ *
+ * @param bitrate Current bitrate
+ * @param[out] keyframe Set if the change is large enough to be made at a keyframe
+ * @return The new bitrate, or bitrate to keep it
+ */
+static int rate_controller_decide(RATE_CONTROLLER *controller, int bitrate, int *keyframe) {
+    double target = controller->target.load(std::memory_order_relaxed);
+    double backlog = controller->backlog.load(std::memory_order_relaxed);
+    double rate = controller->rate;
+    int next = bitrate;
+
+    *keyframe = 0;
+    if (controller->hold)
+        controller->hold--;
+    if (!target)
+        return bitrate;
+
+    // a backlog takes a while to drain after a drop, only one that still grows calls for another
+    int backlogged = backlog > target * RATE_CONTROL_BACKLOG_HIGH / 1000 &&
+                     (!controller->hold || backlog > controller->backlog_at_drop);
+
+    if (rate > target * 1.10 || backlogged) {
+        // scale down to 90% of the target, and faster still to drain a backlog
+        double factor = rate > 0 ? target * 0.90 / rate : 1.0;
+        if (backlogged)
+            factor = vcos_min(factor, 0.70);
+        next = (int) (bitrate * vcos_max(vcos_min(factor, 0.95), 0.50));
+        controller->hold = RATE_CONTROL_HOLD;
+        controller->under = 0;
+        controller->backlog_at_drop = (uint32_t) backlog;
+    } else if (rate < target * 0.85 && backlog < target * RATE_CONTROL_BACKLOG_LOW / 1000) {
+        // raising the bitrate only helps if the encoder spends most of it (it doesn't on a still scene)
+        if (++controller->under >= RATE_CONTROL_CLIMB_AFTER && !controller->hold && rate * 8 > bitrate * 0.70) {
+            next = vcos_max(bitrate, (int) vcos_min(bitrate + target * 8 * 0.05, target * 8 * 0.95));
+            controller->under = 0;
+        }
+    } else {
+        controller->under = 0;
+    }
+
+    next = vcos_min(vcos_max(next, controller->min_bitrate), controller->max_bitrate);
+    *keyframe = next < bitrate - bitrate / 4;
+    return next;
+}
+
+/**
+ * One control step: measure, decide, apply
+ */
+static void rate_controller_step(RATE_CONTROLLER *controller) {
+    CAM_STATE *state = controller->pstate;
+    CAM_PIPELINE_STATS stats;
+    uint64_t now = get_microseconds64();
+
+    if (get_pipeline_stats(state, &stats) != MMAL_SUCCESS)
+        return;
+
+    uint64_t bytes = stats.bytes - controller->last_bytes, elapsed = now - controller->last_time;
+    controller->last_bytes = stats.bytes;
+    controller->last_time = now;
+
+    // nothing to measure while paused, start afresh on resume
+    if (!state->bCapturing || !elapsed) {
+        controller->rate = 0;
+        return;
+    }
+    double rate = (double) bytes * 1000000 / (double) elapsed;
+    // about a second of smoothing, so the keyframes of a GOP don't count as congestion
+    controller->rate = controller->rate > 0 ? controller->rate + (rate - controller->rate) / 4 : rate;
+
+    // the bitrate is read and changed under the lock, so a change made by the application in between is not lost
+    vcos_mutex_lock(&state->encoder_control_lock);
+    int keyframe, previous = state->bitrate, bitrate = rate_controller_decide(controller, previous, &keyframe);
+    MMAL_STATUS_T status = MMAL_SUCCESS;
+
+    if (bitrate != previous) {
+        ENCODER_CONTROL control{};
+        control.flags = ENCODER_CONTROL_BITRATE | (keyframe ? 0 : ENCODER_CONTROL_NO_KEYFRAME);
+        control.bitrate = bitrate;
+        status = encoder_control_apply(state, &control);
+    }
+    vcos_mutex_unlock(&state->encoder_control_lock);
+
+    if (bitrate == previous || status != MMAL_SUCCESS)
+        return;
+    // the stream follows the bitrate, so the measurement does too rather than lagging behind for a second
+    controller->rate = controller->rate * bitrate / previous;
+    if (state->common_settings.verbose)
+        vcos_log_info("Rate control: %.0f bytes/s for a target of %u, bitrate %d", controller->rate,
+                      controller->target.load(std::memory_order_relaxed), bitrate);
+}
+
+static void *rate_controller_thread(void *arg) {
+    auto *controller = (RATE_CONTROLLER *) arg;
+    VCOS_UNSIGNED events = 0;
+
+    for (;;) {
+        VCOS_STATUS_T status = vcos_event_flags_get(&controller->events, RATE_CONTROL_EVENT_STOP, VCOS_OR_CONSUME,
+                                                    RATE_CONTROL_PERIOD, &events);
+        if (status == VCOS_SUCCESS && (events & RATE_CONTROL_EVENT_STOP))
+            break;
+        rate_controller_step(controller);
+    }
+    return nullptr;
+}
+
+/**
+ * Create the rate controller and its thread, if state->rateControlTarget is set.
+ * The bitrate set up by init() is where the controller starts from.
+ *
+ * @param state Pointer to state control struct
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T rate_controller_create(CAM_STATE *state) {
+    if (!state->rateControlTarget || state->rate_controller)
+        return MMAL_SUCCESS;
+
+    if (!state->bitrate) {
+        vcos_log_error("%s: rate control needs a bitrate to start from", __func__);
+        return MMAL_EINVAL;
+    }
+
+    auto *controller = new(std::nothrow) RATE_CONTROLLER();
+    if (!controller)
+        return MMAL_ENOMEM;
+
+    controller->pstate = state;
+    controller->target.store(state->rateControlTarget);
+    controller->min_bitrate = state->rateControlMin ? state->rateControlMin : RATE_CONTROL_DEFAULT_MIN;
+    controller->max_bitrate = vcos_max(state->rateControlMax ? state->rateControlMax : state->bitrate,
+                                       controller->min_bitrate);
+    controller->last_time = get_microseconds64();
+
+    if (vcos_event_flags_create(&controller->events, "cam-rate") != VCOS_SUCCESS) {
+        delete controller;
+        return MMAL_ENOMEM;
+    }
+    if (vcos_thread_create(&controller->thread, "cam-rate", nullptr, rate_controller_thread, controller) !=
+        VCOS_SUCCESS) {
+        vcos_log_error("%s: failed to create the rate control thread", __func__);
+        vcos_event_flags_delete(&controller->events);
+        delete controller;
+        return MMAL_ENOMEM;
+    }
+
+    state->rate_controller = controller;
+    return MMAL_SUCCESS;
+}
+
+/**
+ * Stop the rate controller, before the encoder is destroyed. The bitrate stays where it got to.
+ *
+ * @param state Pointer to state control struct
+ */
+void rate_controller_destroy(CAM_STATE *state) {
+    RATE_CONTROLLER *controller = state->rate_controller;
+
+    if (!controller)
+        return;
+
+    vcos_event_flags_set(&controller->events, RATE_CONTROL_EVENT_STOP, VCOS_OR);
+    vcos_thread_join(&controller->thread, nullptr);
+    vcos_event_flags_delete(&controller->events);
+    delete controller;
+    state->rate_controller = nullptr;
+}
+
+/**
+ * Change the throughput the bitrate is steered to, e.g. as the uplink bandwidth estimate changes. Any thread.
+ *
+ * @param state Pointer to state control struct
+ * @param bytes_per_second The new target, 0 to hold the bitrate where it is
+ */
+void set_rate_control_target(CAM_STATE *state, uint32_t bytes_per_second) {
+    state->rateControlTarget = bytes_per_second;
+    if (state->rate_controller)
+        state->rate_controller->target.store(bytes_per_second, std::memory_order_relaxed);
+}
+
+/**
+ * Report how much of the stream is waiting downstream (socket send queue, upload queue, ...), for the
+ * controller to back off before the link drops data. Any thread, as often as convenient.
+ *
+ * @param state Pointer to state control struct
+ * @param queued_bytes Bytes accepted from the callbacks and not sent yet
+ */
+void report_rate_control_queue(CAM_STATE *state, uint32_t queued_bytes) {
+    if (state->rate_controller)
+        state->rate_controller->backlog.store(queued_bytes, std::memory_order_relaxed);
+}
@@ -0,0 +1,347 @@
+//
+// Raw frame taps: a video splitter between the camera and the encoder, with outputs delivering the
+// frames uncompressed to the application while the encoder keeps running.
+//
+// camera video (opaque) -> splitter -> output 0 (opaque) -> encoder
+//                                   -> output 1 (I420/RGB24/BGR24) -> raw_frame_cb
+//                                   -> output 2 (opaque) -> ISP (I420, analysisWidth x analysisHeight) -> analysis_cb
+//
+// The raw frame branch converts at full resolution; the analysis branch has the ISP scale the
+// frames down on the GPU, so a small analysis stream costs no ARM time.
+// Frames are delivered in the output buffers themselves, allocated in memory shared with the
+// VideoCore (MMAL_PARAMETER_ZERO_COPY), and go back to their port once the last FrameRef to them
+// is released. Frames skipped by the decimation are returned straight away. Like the encoder pool,
+// a branch pool is only freed once the application released its frames (FRAME_RELEASE_TIMEOUT).
+//
+
+#include "cam.h"
+#include <new>
+
+/// Output of the splitter feeding the encoder
+#define RAW_FRAME_ENCODER_OUTPUT 0
+/// Output of the splitter delivering the full resolution raw frames
+#define RAW_FRAME_TAP_OUTPUT 1
+/// Output of the splitter feeding the ISP of the analysis branch
+#define RAW_FRAME_ANALYSIS_OUTPUT 2
+
+/// A raw frame output delivering to the application
+typedef struct {
+    MMAL_COMPONENT_T *isp;              /// scaler between the splitter and port, nullptr for a direct splitter output
+    MMAL_CONNECTION_T *connection;      /// splitter output to ISP input
+    MMAL_PORT_T *port;                  /// output delivering the frames
+    MMAL_POOL_T *pool;                  /// buffers of port
+    RAW_FRAME_FORMAT format;
+    uint32_t interval;                  /// deliver every interval-th frame
+    uint32_t count;                     /// frames received on port
+    int64_t starttime;                  /// pts of the first frame, MMAL_TIME_UNKNOWN until then
+    RawFrameCallback cb;
+} RAW_FRAME_BRANCH;
+
+struct raw_frame_tap_s {
+    MMAL_COMPONENT_T *splitter;
+    MMAL_CONNECTION_T *connection;      /// camera video port to splitter input
+    RAW_FRAME_BRANCH raw;               /// full resolution frames, if rawFrameEncoding is set
+    RAW_FRAME_BRANCH analysis;          /// scaled frames, if analysisWidth is set
+};
+
+/**
+ * Raw frame output buffer callback, passes every interval-th frame on to the branch callback.
+ * Runs on the MMAL callback thread.
+ *
+ * @param port Output port of the branch
+ * @param buffer Buffer holding the frame
+ */
+static void raw_frame_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+    auto *branch = (RAW_FRAME_BRANCH *) port->userdata;
+
+    if (branch && buffer->length && branch->count++ % branch->interval == 0) {
+        int64_t pts = buffer->pts;
+
+        if (pts != MMAL_TIME_UNKNOWN) {
+            if (branch->starttime == MMAL_TIME_UNKNOWN)
+                branch->starttime = pts;
+            pts -= branch->starttime;
+        }
+        branch->cb(FrameRef(buffer, pts), &branch->format);
+    }
+
+    // the pool callback sends the buffer back to the port once the application released it as well
+    mmal_buffer_header_release(buffer);
+}
+
+/**
+ * Copy the format of a component input to one of its outputs, with another encoding
+ *
+ * @param port Output port
+ * @param encoding Encoding of the output
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+static MMAL_STATUS_T raw_frame_output_format(MMAL_PORT_T *port, MMAL_FOURCC_T encoding) {
+    mmal_format_copy(port->format, port->component->input[0]->format);
+    port->format->encoding = encoding;
+    port->format->encoding_variant = 0;
+    return mmal_port_format_commit(port);
+}
+
+/**
+ * Set up the buffers of a branch output and start delivering its frames. The format of the port must be committed.
+ *
+ * @param branch Branch to start, with its port, interval and callback set
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+static MMAL_STATUS_T raw_frame_branch_start(RAW_FRAME_BRANCH *branch) {
+    MMAL_PORT_T *port = branch->port;
+    MMAL_BUFFER_HEADER_T *buffer;
+    MMAL_STATUS_T status;
+
+    branch->format.encoding = port->format->encoding;
+    branch->format.width = port->format->es->video.crop.width;
+    branch->format.height = port->format->es->video.crop.height;
+    branch->format.stride = mmal_encoding_width_to_stride(port->format->encoding, port->format->es->video.width);
+    branch->format.slice_height = port->format->es->video.height;
+    branch->starttime = MMAL_TIME_UNKNOWN;
+
+    // map the buffers the VideoCore writes the frames to, rather than copying them over
+    if ((status = mmal_port_parameter_set_boolean(port, MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE)) != MMAL_SUCCESS) {
+        vcos_log_error("%s: unable to enable zero copy on %s", __func__, port->name);
+        return status;
+    }
+    port->buffer_num = vcos_max(port->buffer_num_recommended, RAW_FRAME_BUFFERS);
+    port->buffer_size = vcos_max(port->buffer_size_recommended, port->buffer_size_min);
+
+    branch->pool = mmal_port_pool_create(port, port->buffer_num, port->buffer_size);
+    if (!branch->pool) {
+        vcos_log_error("%s: failed to create the buffer pool for %s", __func__, port->name);
+        return MMAL_ENOMEM;
+    }
+    mmal_pool_callback_set(branch->pool, port_pool_release_callback, port);
+
+    port->userdata = (struct MMAL_PORT_USERDATA_T *) branch;
+    if ((status = mmal_port_enable(port, raw_frame_callback)) != MMAL_SUCCESS) {
+        vcos_log_error("%s: unable to enable %s", __func__, port->name);
+        return status;
+    }
+
+    // the buffers cycle between the port and the application from now on
+    while ((buffer = mmal_queue_get(branch->pool->queue))) {
+        if ((status = mmal_port_send_buffer(port, buffer)) != MMAL_SUCCESS) {
+            vcos_log_error("%s: unable to send a buffer to %s", __func__, port->name);
+            mmal_buffer_header_release(buffer);
+            return status;
+        }
+    }
+    return MMAL_SUCCESS;
+}
+
+/**
+ * Set up the analysis branch: an ISP scaling the opaque frames of a splitter output to I420
+ *
+ * @param state Pointer to the state data
+ * @param source Splitter output feeding the ISP
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+static MMAL_STATUS_T raw_frame_analysis_create(CAM_STATE *state, MMAL_PORT_T *source) {
+    RAW_FRAME_BRANCH *branch = &state->raw_frame_tap->analysis;
+    MMAL_STATUS_T status;
+    MMAL_PORT_T *port;
+
+    if ((status = create_backend_component(CAM_COMPONENT_ISP, &branch->isp)) != MMAL_SUCCESS) {
+        branch->isp = nullptr;
+        vcos_log_error("%s: unable to create the ISP", __func__);
+        return status;
+    }
+    if (!branch->isp->input_num || !branch->isp->output_num) {
+        vcos_log_error("%s: ISP doesn't have input/output ports", __func__);
+        return MMAL_ENOSYS;
+    }
+
+    mmal_format_copy(branch->isp->input[0]->format, source->format);
+    branch->isp->input[0]->buffer_num = source->buffer_num;
+    if ((status = mmal_port_format_commit(branch->isp->input[0])) != MMAL_SUCCESS) {
+        vcos_log_error("%s: unable to set the ISP input format", __func__);
+        return status;
+    }
+
+    // the ISP scales to the size of its output
+    port = branch->port = branch->isp->output[0];
+    mmal_format_copy(port->format, branch->isp->input[0]->format);
+    port->format->encoding = MMAL_ENCODING_I420; // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+    port->format->encoding_variant = 0;
+    port->format->es->video.width = VCOS_ALIGN_UP(state->analysisWidth, 32); // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+    port->format->es->video.height = VCOS_ALIGN_UP(state->analysisHeight, 16); // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+    port->format->es->video.crop.x = 0;
+    port->format->es->video.crop.y = 0;
+    port->format->es->video.crop.width = (int32_t) state->analysisWidth;
+    port->format->es->video.crop.height = (int32_t) state->analysisHeight;
+    if ((status = mmal_port_format_commit(port)) != MMAL_SUCCESS) {
+        vcos_log_error("%s: unable to set the ISP output format", __func__);
+        return status;
+    }
+
+    if ((status = mmal_component_enable(branch->isp)) != MMAL_SUCCESS) {
+        vcos_log_error("%s: unable to enable the ISP", __func__);
+        return status;
+    }
+    if ((status = connect_ports(source, branch->isp->input[0], &branch->connection)) != MMAL_SUCCESS) {
+        branch->connection = nullptr;
+        vcos_log_error("%s: unable to connect the video splitter to the ISP", __func__);
+        return status;
+    }
+
+    branch->interval = state->analysisInterval ? state->analysisInterval : 1;
+    branch->cb = state->callback_data.analysis_cb;
+    return raw_frame_branch_start(branch);
+}
+
+/**
+ * Insert a splitter behind the camera video port and set up its raw frame outputs, if state->rawFrameEncoding or
+ * state->analysisWidth is set.
+ * The encoder must then be connected to raw_frame_tap_encoder_port() instead of the camera video port.
+ *
+ * @param state Pointer to the state data, the camera component must have been created
+ * @return MMAL_SUCCESS if all OK, MMAL_EINVAL if an encoding or size is not supported or its callback is not set
+ */
+MMAL_STATUS_T raw_frame_tap_create(CAM_STATE *state) {
+    MMAL_FOURCC_T encoding = state->rawFrameEncoding;
+    MMAL_STATUS_T status;
+    RAW_FRAME_TAP *tap;
+
+    if ((!encoding && !state->analysisWidth) || state->raw_frame_tap)
+        return MMAL_SUCCESS;
+
+    if (encoding && ((encoding != MMAL_ENCODING_I420 && encoding != MMAL_ENCODING_RGB24 && // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+                      encoding != MMAL_ENCODING_BGR24) || !state->callback_data.raw_frame_cb)) { // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+        vcos_log_error("%s: raw frames need an I420, RGB24 or BGR24 encoding and a raw_frame_cb", __func__);
+        return MMAL_EINVAL;
+    }
+    if (state->analysisWidth &&
+        (!state->analysisHeight || state->analysisWidth > state->common_settings.width ||
+         state->analysisHeight > state->common_settings.height || !state->callback_data.analysis_cb)) {
+        vcos_log_error("%s: the analysis stream needs a size no larger than the video and an analysis_cb", __func__);
+        return MMAL_EINVAL;
+    }
+
+    tap = state->raw_frame_tap = new(std::nothrow) RAW_FRAME_TAP();
+    if (!tap)
+        return MMAL_ENOMEM;
+
+    if ((status = create_backend_component(CAM_COMPONENT_SPLITTER, &tap->splitter)) != MMAL_SUCCESS) {
+        tap->splitter = nullptr;
+        vcos_log_error("%s: unable to create the video splitter", __func__);
+        goto error;
+    }
+    if (tap->splitter->output_num <= RAW_FRAME_ANALYSIS_OUTPUT) {
+        vcos_log_error("%s: video splitter doesn't have enough output ports", __func__);
+        status = MMAL_ENOSYS;
+        goto error;
+    }
+
+    // the splitter takes the opaque frames of the camera, the encoder and the ISP still get them as they are
+    mmal_format_copy(tap->splitter->input[0]->format, state->camera_video_port->format);
+    tap->splitter->input[0]->buffer_num = state->camera_video_port->buffer_num;
+    if ((status = mmal_port_format_commit(tap->splitter->input[0])) != MMAL_SUCCESS ||
+        (status = raw_frame_output_format(tap->splitter->output[RAW_FRAME_ENCODER_OUTPUT],
+                                          MMAL_ENCODING_OPAQUE)) != MMAL_SUCCESS || // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+        (encoding && (status = raw_frame_output_format(tap->splitter->output[RAW_FRAME_TAP_OUTPUT],
+                                                       encoding)) != MMAL_SUCCESS) ||
+        (state->analysisWidth && (status = raw_frame_output_format(tap->splitter->output[RAW_FRAME_ANALYSIS_OUTPUT],
+                                                                   MMAL_ENCODING_OPAQUE)) != MMAL_SUCCESS)) { // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+        vcos_log_error("%s: unable to set the video splitter format", __func__);
+        goto error;
+    }
+
+    if ((status = mmal_component_enable(tap->splitter)) != MMAL_SUCCESS) {
+        vcos_log_error("%s: unable to enable the video splitter", __func__);
+        goto error;
+    }
+
+    if (encoding) {
+        tap->raw.port = tap->splitter->output[RAW_FRAME_TAP_OUTPUT];
+        tap->raw.interval = state->rawFrameInterval ? state->rawFrameInterval : 1;
+        tap->raw.cb = state->callback_data.raw_frame_cb;
+        if ((status = raw_frame_branch_start(&tap->raw)) != MMAL_SUCCESS)
+            goto error;
+    }
+    if (state->analysisWidth &&
+        (status = raw_frame_analysis_create(state, tap->splitter->output[RAW_FRAME_ANALYSIS_OUTPUT])) != MMAL_SUCCESS)
+        goto error;
+
+    if ((status = connect_ports(state->camera_video_port, tap->splitter->input[0], &tap->connection)) !=
+        MMAL_SUCCESS) {
+        tap->connection = nullptr;
+        vcos_log_error("%s: unable to connect the camera to the video splitter", __func__);
+        goto error;
+    }
+
+    return MMAL_SUCCESS;
+
+    error:
+    raw_frame_tap_destroy(state);
+    return status;
+}
+
+/**
+ * Tear down a branch, its connection to the splitter must be gone
+ */
+static void raw_frame_branch_destroy(RAW_FRAME_BRANCH *branch) {
+    check_disable_port(branch->port);
+    if (branch->connection)
+        mmal_connection_destroy(branch->connection);
+    if (branch->isp)
+        mmal_component_disable(branch->isp);
+    if (branch->pool) {
+        uint32_t held = 0;
+
+        // with the port disabled, every buffer the application does not hold is back in the pool
+        for (int waited = 0; (held = branch->pool->headers_num - mmal_queue_length(branch->pool->queue)) &&
+                             waited < FRAME_RELEASE_TIMEOUT; waited += 10)
+            vcos_sleep(10);
+
+        if (held) {
+            // the buffers go back to the queue of a pool that is never freed, rather than to a destroyed port
+            vcos_log_error("%s: %u frames of %s still held, their buffers are not freed", __func__, held,
+                           branch->port->name);
+            mmal_pool_callback_set(branch->pool, nullptr, nullptr);
+        } else {
+            mmal_port_pool_destroy(branch->port, branch->pool);
+        }
+        branch->pool = nullptr;
+    }
+    if (branch->isp)
+        mmal_component_destroy(branch->isp);
+}
+
+/**
+ * Remove the splitter and its raw frame outputs. Waits FRAME_RELEASE_TIMEOUT for frames still held by the
+ * application, and leaves the buffers of frames held beyond that allocated.
+ *
+ * @param state Pointer to the state data, the encoder must have been disconnected from the splitter
+ */
+void raw_frame_tap_destroy(CAM_STATE *state) {
+    RAW_FRAME_TAP *tap = state->raw_frame_tap;
+
+    if (!tap)
+        return;
+
+    if (tap->connection)
+        mmal_connection_destroy(tap->connection);
+    raw_frame_branch_destroy(&tap->analysis);
+    raw_frame_branch_destroy(&tap->raw);
+    if (tap->splitter) {
+        mmal_component_disable(tap->splitter);
+        mmal_component_destroy(tap->splitter);
+    }
+    delete tap;
+    state->raw_frame_tap = nullptr;
+}
+
+/**
+ * @param state Pointer to the state data
+ * @return The port the encoder is to be connected to: the splitter if there is a raw frame tap, the camera otherwise
+ */
+MMAL_PORT_T *raw_frame_tap_encoder_port(CAM_STATE *state) {
+    if (!state->raw_frame_tap)
+        return state->camera_video_port;
+
+    return state->raw_frame_tap->splitter->output[RAW_FRAME_ENCODER_OUTPUT];
+}
@@ -0,0 +1,324 @@
+//
+// RTP packetization of the H264 stream (RFC 6184), sent over UDP or a unix datagram socket.
+//
+// The sender is fed complete access units (see cam_h264.cc). NAL units that fit the MTU go out
+// as single NAL unit packets, larger ones are split into FU-A fragments; the marker bit is set
+// on the last packet of each access unit. The latest SPS and PPS are sent in front of every IDR
+// picture that does not carry them, so receivers can join at any keyframe. Packets are built as
+// a header plus a pointer into the access unit and sent in batches with sendmmsg, without
+// copying the payload. The socket is non-blocking: packets that do not fit in the socket buffer
+// are dropped and counted rather than holding up the encoder callback.
+//
+
+#include "cam.h"
+#include <cerrno>
+#include <cstring>
+#include <netdb.h>
+#include <new>
+#include <sys/un.h>
+
+/// Payload size used if rtpMtu was not set
+#define RTP_DEFAULT_MTU 1400
+/// Dynamic payload type used if rtpPayloadType was not set
+#define RTP_DEFAULT_PAYLOAD_TYPE 96
+/// Packets per sendmmsg
+#define RTP_BATCH 32
+#define RTP_HEADER_SIZE 12
+/// Largest SPS or PPS resent
+#define RTP_PARAMETER_SET_MAX 128
+
+#define RTP_NAL_FU_A 28
+
+struct rtp_sender_s {
+    int fd;
+    uint32_t mtu;                       /// largest RTP payload
+    uint8_t payload_type;
+    uint32_t ssrc;
+    uint16_t sequence;
+    uint32_t timestamp;                 /// of the last access unit, 90kHz
+    uint32_t timestamp_base;
+
+    uint8_t sps[RTP_PARAMETER_SET_MAX];
+    uint32_t sps_length;
+    uint8_t pps[RTP_PARAMETER_SET_MAX];
+    uint32_t pps_length;
+
+    struct mmsghdr messages[RTP_BATCH];
+    struct iovec iov[RTP_BATCH][2];     /// header, payload
+    uint8_t headers[RTP_BATCH][RTP_HEADER_SIZE + 2];
+    uint32_t packet_num;                /// packets in the batch
+
+    RTP_STATS stats;
+};
+
+/**
+ * Send the batched packets
+ * @return MMAL_SUCCESS if all OK (dropped packets included), MMAL_EIO on a socket error
+ */
+static MMAL_STATUS_T rtp_flush(RTP_SENDER *sender) {
+    uint32_t done = 0;
+
+    while (done < sender->packet_num) {
+        int sent = sendmmsg(sender->fd, sender->messages + done, sender->packet_num - done, MSG_DONTWAIT);
+
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            // no room or nobody listening: a live stream just loses these packets
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS || errno == ECONNREFUSED) {
+                sender->stats.packets_dropped += sender->packet_num - done;
+                break;
+            }
+            vcos_log_error("RTP send failed: %s", strerror(errno));
+            sender->packet_num = 0;
+            return MMAL_EIO;
+        }
+        done += sent;
+        sender->stats.packets_sent += sent;
+    }
+
+    sender->packet_num = 0;
+    return MMAL_SUCCESS;
+}
+
+/**
+ * Add a packet to the batch
+ *
+ * @param header_extra FU indicator and header for FU-A fragments, nullptr otherwise
+ * @param marker !0 for the last packet of an access unit
+ */
+static MMAL_STATUS_T rtp_packet(RTP_SENDER *sender, const uint8_t *header_extra, const uint8_t *payload,
+                                uint32_t length, int marker) {
+    MMAL_STATUS_T status;
+
+    if (sender->packet_num == RTP_BATCH && (status = rtp_flush(sender)) != MMAL_SUCCESS)
+        return status;
+
+    uint32_t n = sender->packet_num++;
+    uint8_t *header = sender->headers[n];
+    uint32_t header_length = RTP_HEADER_SIZE;
+
+    header[0] = 0x80;               // version 2
+    header[1] = (uint8_t) (sender->payload_type | (marker ? 0x80u : 0u));
+    header[2] = (uint8_t) (sender->sequence >> 8u);
+    header[3] = (uint8_t) sender->sequence;
+    header[4] = (uint8_t) (sender->timestamp >> 24u);
+    header[5] = (uint8_t) (sender->timestamp >> 16u);
+    header[6] = (uint8_t) (sender->timestamp >> 8u);
+    header[7] = (uint8_t) sender->timestamp;
+    header[8] = (uint8_t) (sender->ssrc >> 24u);
+    header[9] = (uint8_t) (sender->ssrc >> 16u);
+    header[10] = (uint8_t) (sender->ssrc >> 8u);
+    header[11] = (uint8_t) sender->ssrc;
+    if (header_extra) {
+        header[12] = header_extra[0];
+        header[13] = header_extra[1];
+        header_length += 2;
+    }
+    sender->sequence++;
+
+    sender->iov[n][0] = {header, header_length};
+    sender->iov[n][1] = {(void *) payload, length};
+    memset(&sender->messages[n], 0, sizeof(sender->messages[n]));
+    sender->messages[n].msg_hdr.msg_iov = sender->iov[n];
+    sender->messages[n].msg_hdr.msg_iovlen = 2;
+    sender->stats.bytes_sent += header_length + length;
+    return MMAL_SUCCESS;
+}
+
+/**
+ * Packetize one NAL unit, without its start code
+ */
+static MMAL_STATUS_T rtp_nal(RTP_SENDER *sender, const uint8_t *nal, uint32_t length, int last) {
+    MMAL_STATUS_T status = MMAL_SUCCESS;
+    uint8_t fu[2];
+
+    if (!length)
+        return MMAL_SUCCESS;
+    if (length <= sender->mtu)
+        return rtp_packet(sender, nullptr, nal, length, last);
+
+    // FU-A: the NAL header is replaced by the FU indicator and header
+    fu[0] = (uint8_t) ((nal[0] & 0xe0u) | RTP_NAL_FU_A);
+    fu[1] = (uint8_t) (0x80u | (nal[0] & 0x1fu));   // start bit
+    nal++;
+    length--;
+    while (length && status == MMAL_SUCCESS) {
+        uint32_t part = length < sender->mtu - 2 ? length : sender->mtu - 2;
+
+        if (part == length)
+            fu[1] |= 0x40u;                         // end bit
+        status = rtp_packet(sender, fu, nal, part, last && part == length);
+        fu[1] &= 0x7fu;
+        nal += part;
+        length -= part;
+    }
+
+    return status;
+}
+
+/**
+ * Open a datagram socket connected to the destination
+ * @return The socket, or -1 on error
+ */
+static int rtp_connect(const char *destination) {
+    int fd = -1;
+
+    if (destination[0] == '/') {
+        struct sockaddr_un address = {};
+
+        address.sun_family = AF_UNIX;
+        if (strlen(destination) >= sizeof(address.sun_path))
+            return -1;
+        strcpy(address.sun_path, destination);
+        fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0); // NOLINT(hicpp-signed-bitwise)
+        if (fd >= 0 && connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+            close(fd);
+            fd = -1;
+        }
+        return fd;
+    }
+
+    // host:port, the last colon separates the port so that IPv6 addresses work in [brackets]
+    char host[256];
+    const char *colon = strrchr(destination, ':');
+    struct addrinfo hints = {}, *result, *ai;
+
+    if (!colon || colon == destination || (size_t) (colon - destination) >= sizeof(host))
+        return -1;
+    memcpy(host, destination, colon - destination);
+    host[colon - destination] = 0;
+    if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+        memmove(host, host + 1, strlen(host));
+        host[strlen(host) - 1] = 0;
+    }
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host, colon + 1, &hints, &result) != 0)
+        return -1;
+    for (ai = result; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol); // NOLINT(hicpp-signed-bitwise)
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(result);
+    return fd;
+}
+
+/**
+ * Create an RTP sender
+ *
+ * @param destination "host:port" for UDP, or the path of a unix datagram socket
+ * @param mtu Largest RTP payload, 0 for the default (1400)
+ * @param payload_type RTP payload type, 0 for the default (96)
+ * @return The sender, or nullptr if the destination could not be opened
+ */
+RTP_SENDER *rtp_sender_create(const char *destination, uint32_t mtu, uint8_t payload_type) {
+    auto *sender = new(std::nothrow) RTP_SENDER();
+
+    if (!sender)
+        return nullptr;
+
+    sender->fd = rtp_connect(destination);
+    if (sender->fd < 0) {
+        vcos_log_error("%s: unable to open RTP destination %s: %s", __func__, destination, strerror(errno));
+        delete sender;
+        return nullptr;
+    }
+
+    // FU-A needs room for more than its 2 header bytes
+    sender->mtu = mtu > 2 ? mtu : RTP_DEFAULT_MTU;
+    sender->payload_type = payload_type ? payload_type : RTP_DEFAULT_PAYLOAD_TYPE;
+
+    // random SSRC, sequence and timestamp offsets (RFC 3550 5.1)
+    uint64_t seed = get_microseconds64() ^ ((uint64_t) getpid() << 32u);
+    sender->ssrc = (uint32_t) (seed * 6364136223846793005ull >> 32u);
+    sender->sequence = (uint16_t) (seed * 2862933555777941757ull >> 48u);
+    sender->timestamp_base = (uint32_t) (seed * 3202034522624059733ull >> 32u);
+    sender->timestamp = sender->timestamp_base;
+    return sender;
+}
+
+/**
+ * Destroy an RTP sender
+ *
+ * @param sender Sender to destroy, may be nullptr
+ */
+void rtp_sender_destroy(RTP_SENDER *sender) {
+    if (!sender)
+        return;
+
+    close(sender->fd);
+    delete sender;
+}
+
+/**
+ * Send an access unit
+ *
+ * @param sender The RTP sender
+ * @param unit Access unit, pts in microseconds
+ * @return MMAL_SUCCESS if all OK (packets may have been dropped), MMAL_EIO on a socket error
+ */
+MMAL_STATUS_T rtp_sender_send(RTP_SENDER *sender, const H264_ACCESS_UNIT *unit) {
+    MMAL_STATUS_T status = MMAL_SUCCESS;
+    uint32_t last = 0;
+
+    if (unit->pts != MMAL_TIME_UNKNOWN)
+        sender->timestamp = sender->timestamp_base + (uint32_t) (unit->pts * 9 / 100);
+
+    for (uint32_t i = 0; i < unit->nal_count; i++) {
+        const H264_NAL_UNIT *nal = &unit->nals[i];
+        uint32_t code = unit->data[nal->offset + 2] == 1 ? 3 : 4;
+
+        if (nal->type == H264_NAL_SPS || nal->type == H264_NAL_PPS) {
+            int sps = nal->type == H264_NAL_SPS;
+            if (nal->length - code <= RTP_PARAMETER_SET_MAX) {
+                memcpy(sps ? sender->sps : sender->pps, unit->data + nal->offset + code, nal->length - code);
+                *(sps ? &sender->sps_length : &sender->pps_length) = nal->length - code;
+            }
+        }
+        if (nal->type != H264_NAL_AUD)
+            last = i;
+    }
+
+    // resend the parameter sets in front of an IDR picture that comes without them
+    if (unit->keyframe && !(unit->nal_types & ((1u << H264_NAL_SPS) | (1u << H264_NAL_PPS))) &&
+        sender->sps_length && sender->pps_length) {
+        status = rtp_nal(sender, sender->sps, sender->sps_length, 0);
+        if (status == MMAL_SUCCESS)
+            status = rtp_nal(sender, sender->pps, sender->pps_length, 0);
+    }
+
+    for (uint32_t i = 0; i < unit->nal_count && status == MMAL_SUCCESS; i++) {
+        const H264_NAL_UNIT *nal = &unit->nals[i];
+        uint32_t code = unit->data[nal->offset + 2] == 1 ? 3 : 4;
+
+        // access unit delimiters carry nothing a receiver needs
+        if (nal->type == H264_NAL_AUD)
+            continue;
+        status = rtp_nal(sender, unit->data + nal->offset + code, nal->length - code, i == last);
+    }
+
+    if (status == MMAL_SUCCESS)
+        status = rtp_flush(sender);
+    sender->packet_num = 0;
+    return status;
+}
+
+/**
+ * Read the RTP counters
+ *
+ * @param state Pointer to state control struct
+ * @param stats Filled with the current counters
+ * @return MMAL_SUCCESS, or MMAL_ENOSYS if RTP output is not in use
+ */
+MMAL_STATUS_T get_rtp_stats(CAM_STATE *state, RTP_STATS *stats) {
+    if (!state->rtp_sender)
+        return MMAL_ENOSYS;
+
+    *stats = state->rtp_sender->stats;
+    return MMAL_SUCCESS;
+}
@@ -0,0 +1,396 @@
+//
+// Recording of the encoded video to files, split into segments.
+//
+// The encoder callback only copies each buffer into a ring and, when encoder_buffer_callback
+// has moved on to the next segmentNumber, records a switch at that point of the stream; the
+// switch always falls on a CONFIG or keyframe buffer. A writer thread drains the ring in large
+// writes, rotates files at the switches and opens the file of the following segment ahead of
+// time. New files are preallocated with fallocate (to the expected segment size) and trimmed
+// when closed, so opening, allocating and closing files never happens on the MMAL thread.
+// A segment that starts at a keyframe without inline headers gets the last headers first.
+// If the disk falls so far behind that the ring fills up, data is dropped up to the next
+// keyframe, so that the file stays decodable.
+//
+
+#include "cam.h"
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+
+/// Ring size used if recordBufferSize was not set
+#define SEGMENT_WRITER_BUFFER (8u << 20u)
+/// Data the writer thread waits for before writing, unless a switch or the flush interval comes first
+#define SEGMENT_WRITER_BATCH (256u << 10u)
+/// Longest time (ms) data stays in the ring
+#define SEGMENT_WRITER_FLUSH_INTERVAL 200
+/// Segment switches pending at a time
+#define SEGMENT_WRITER_SWITCHES 8
+/// Largest stream headers (SPS/PPS) kept
+#define SEGMENT_WRITER_HEADER_MAX 256
+/// Longest file name
+#define SEGMENT_WRITER_FILENAME_MAX 256
+
+#define SEGMENT_EVENT_DATA (1u << 0u)
+#define SEGMENT_EVENT_STOP (1u << 1u)
+
+typedef struct {
+    uint64_t offset;                    /// stream offset the segment starts at
+    int segment;
+} SEGMENT_SWITCH;
+
+struct segment_writer_s {
+    CAM_STATE *pstate;
+    uint8_t *data;
+    uint32_t size;
+    alignas(64) std::atomic<uint64_t> head;     /// bytes put in the ring, only written by the encoder callback
+    alignas(64) std::atomic<uint64_t> tail;     /// bytes written out, only written by the writer thread
+    SEGMENT_SWITCH switches[SEGMENT_WRITER_SWITCHES];
+    std::atomic<uint32_t> switch_head;
+    std::atomic<uint32_t> switch_tail;
+    VCOS_EVENT_FLAGS_T events;
+    VCOS_THREAD_T thread;
+    std::atomic<int> stop;
+    std::atomic<uint64_t> bytes_dropped;
+
+    // encoder callback side
+    int segment;                        /// segment the ring is being filled for
+    int dropping;                       /// skipping data up to the next keyframe
+    uint8_t headers[SEGMENT_WRITER_HEADER_MAX];
+    uint32_t headers_length;
+    int in_headers;                     /// the last buffer was a header buffer
+    int in_frame;                       /// the last buffer did not end its frame
+    uint64_t signalled;                 /// head when the writer was last woken
+
+    // writer thread side
+    int fd;
+    int fd_segment;
+    uint64_t file_length;
+    int next_fd;                        /// file of the following segment, opened ahead
+    int next_segment;
+    int failed;
+};
+
+/**
+ * @return !0 if the file name has a segment number in it, so that each segment gets a file
+ */
+static int segment_writer_numbered(CAM_STATE *state) {
+    return strchr(state->common_settings.filename, '%') != nullptr;
+}
+
+/**
+ * Open (create) the file of a segment, without truncating it
+ * @return The file descriptor, or -1 on error
+ */
+static int segment_writer_open(SEGMENT_WRITER *writer, int segment) {
+    char name[SEGMENT_WRITER_FILENAME_MAX];
+    int fd;
+
+    snprintf(name, sizeof(name), writer->pstate->common_settings.filename, segment);
+    fd = open(name, O_WRONLY | O_CREAT | O_CLOEXEC, 0666); // NOLINT(hicpp-signed-bitwise)
+    if (fd < 0)
+        vcos_log_error("%s: unable to open %s: %s", __func__, name, strerror(errno));
+    return fd;
+}
+
+/**
+ * Close the current file, trimming the space preallocated beyond what was written
+ */
+static void segment_writer_close(SEGMENT_WRITER *writer) {
+    if (writer->fd < 0)
+        return;
+
+    if (ftruncate(writer->fd, (off_t) writer->file_length) < 0)
+        vcos_log_error("%s: unable to trim segment %d: %s", __func__, writer->fd_segment, strerror(errno));
+    close(writer->fd);
+    writer->fd = -1;
+}
+
+/**
+ * Make a segment the current one: use the file opened ahead if it is the right one, empty it
+ * and preallocate the expected segment size
+ */
+static int segment_writer_activate(SEGMENT_WRITER *writer, int segment) {
+    CAM_STATE *state = writer->pstate;
+
+    segment_writer_close(writer);
+
+    if (writer->next_fd >= 0 && writer->next_segment == segment) {
+        writer->fd = writer->next_fd;
+        writer->next_fd = -1;
+    } else {
+        writer->fd = segment_writer_open(writer, segment);
+    }
+    writer->fd_segment = segment;
+    writer->file_length = 0;
+    if (writer->fd < 0)
+        return 0;
+
+    if (ftruncate(writer->fd, 0) < 0)
+        vcos_log_error("%s: unable to truncate segment %d: %s", __func__, segment, strerror(errno));
+    if (state->segmentSize && state->bitrate) {
+        // keep the size at what was written, the rest is trimmed on close anyway
+        auto expected = (off_t) ((uint64_t) state->bitrate / 8 * state->segmentSize / 1000);
+        fallocate(writer->fd, FALLOC_FL_KEEP_SIZE, 0, expected); // NOLINT(hicpp-signed-bitwise)
+    }
+    return 1;
+}
+
+/**
+ * Open the file of the segment expected next, while the current one is written
+ */
+static void segment_writer_open_ahead(SEGMENT_WRITER *writer) {
+    CAM_STATE *state = writer->pstate;
+    int next = writer->fd_segment + 1;
+
+    if (state->segmentWrap && next > state->segmentWrap)
+        next = 1;
+    if (writer->next_fd >= 0 || next == writer->fd_segment || !segment_writer_numbered(state))
+        return;
+
+    writer->next_fd = segment_writer_open(writer, next);
+    writer->next_segment = next;
+}
+
+/**
+ * Write out the ring up to its head, rotating files at the switches
+ */
+static void segment_writer_drain(SEGMENT_WRITER *writer) {
+    uint64_t tail = writer->tail.load(std::memory_order_relaxed);
+    uint64_t head = writer->head.load(std::memory_order_acquire);
+
+    while (tail < head || writer->switch_tail.load() != writer->switch_head.load(std::memory_order_acquire)) {
+        uint32_t pending_switch = writer->switch_tail.load(std::memory_order_relaxed);
+        uint64_t end = head;
+
+        if (pending_switch != writer->switch_head.load(std::memory_order_acquire)) {
+            SEGMENT_SWITCH *next = &writer->switches[pending_switch % SEGMENT_WRITER_SWITCHES];
+
+            if (next->offset <= tail) {
+                if (segment_writer_numbered(writer->pstate))
+                    writer->failed |= !segment_writer_activate(writer, next->segment);
+                writer->switch_tail.store(pending_switch + 1, std::memory_order_release);
+                continue;
+            }
+            if (next->offset < end)
+                end = next->offset;
+        }
+        if (tail == end)
+            break;
+
+        // contiguous part of the ring
+        uint32_t pos = (uint32_t) (tail % writer->size);
+        uint32_t length = (uint32_t) (end - tail < writer->size - pos ? end - tail : writer->size - pos);
+
+        if (writer->fd >= 0 && !writer->failed) {
+            const uint8_t *data = writer->data + pos;
+            uint32_t left = length;
+
+            while (left) {
+                ssize_t written = write(writer->fd, data, left);
+                if (written < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    vcos_log_error("Failed to write segment %d: %s - aborting", writer->fd_segment, strerror(errno));
+                    writer->failed = 1;
+                    capture_request_abort(writer->pstate);
+                    break;
+                }
+                data += written;
+                left -= (uint32_t) written;
+                writer->file_length += written;
+            }
+        }
+
+        tail += length;
+        writer->tail.store(tail, std::memory_order_release);
+        head = writer->head.load(std::memory_order_acquire);
+    }
+}
+
+static void *segment_writer_thread(void *arg) {
+    auto *writer = (SEGMENT_WRITER *) arg;
+    VCOS_UNSIGNED events;
+
+    while (!writer->stop.load()) {
+        vcos_event_flags_get(&writer->events, SEGMENT_EVENT_DATA | SEGMENT_EVENT_STOP, VCOS_OR_CONSUME,
+                             SEGMENT_WRITER_FLUSH_INTERVAL, &events);
+        segment_writer_drain(writer);
+        segment_writer_open_ahead(writer);
+    }
+
+    segment_writer_drain(writer);
+    return nullptr;
+}
+
+/**
+ * Copy into the ring
+ */
+static void segment_writer_put(SEGMENT_WRITER *writer, const uint8_t *data, uint32_t length) {
+    uint64_t head = writer->head.load(std::memory_order_relaxed);
+    uint32_t pos = (uint32_t) (head % writer->size);
+    uint32_t first = length < writer->size - pos ? length : writer->size - pos;
+
+    memcpy(writer->data + pos, data, first);
+    memcpy(writer->data, data + first, length - first);
+    writer->head.store(head + length, std::memory_order_release);
+}
+
+/**
+ * Create the segment writer and its thread, if state->recordFile is set.
+ * The file of the first segment is opened here.
+ *
+ * @param state Pointer to state control struct
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T segment_writer_create(CAM_STATE *state) {
+    if (!state->recordFile || state->segment_writer)
+        return MMAL_SUCCESS;
+
+    if (!state->common_settings.filename || state->mp4Mux) {
+        vcos_log_error("%s: recording needs a file name, and cannot be combined with mp4Mux", __func__);
+        return MMAL_EINVAL;
+    }
+
+    auto *writer = new(std::nothrow) SEGMENT_WRITER();
+    if (!writer)
+        return MMAL_ENOMEM;
+
+    writer->pstate = state;
+    writer->size = state->recordBufferSize ? state->recordBufferSize : SEGMENT_WRITER_BUFFER;
+    writer->data = (uint8_t *) malloc(writer->size);
+    writer->fd = writer->next_fd = -1;
+    writer->segment = state->segmentNumber;
+    if (!writer->data) {
+        delete writer;
+        return MMAL_ENOMEM;
+    }
+
+    if (!segment_writer_activate(writer, state->segmentNumber)) {
+        free(writer->data);
+        delete writer;
+        return MMAL_EIO;
+    }
+
+    if (vcos_event_flags_create(&writer->events, "cam-segments") != VCOS_SUCCESS) {
+        segment_writer_close(writer);
+        free(writer->data);
+        delete writer;
+        return MMAL_ENOMEM;
+    }
+    if (vcos_thread_create(&writer->thread, "cam-segments", nullptr, segment_writer_thread, writer) != VCOS_SUCCESS) {
+        vcos_log_error("%s: failed to create writer thread", __func__);
+        vcos_event_flags_delete(&writer->events);
+        segment_writer_close(writer);
+        free(writer->data);
+        delete writer;
+        return MMAL_ENOMEM;
+    }
+
+    state->segment_writer = writer;
+    return MMAL_SUCCESS;
+}
+
+/**
+ * Write out what is left in the ring, stop the writer thread and close the files.
+ * The encoder output port must be disabled first.
+ *
+ * @param state Pointer to state control struct
+ */
+void segment_writer_destroy(CAM_STATE *state) {
+    SEGMENT_WRITER *writer = state->segment_writer;
+
+    if (!writer)
+        return;
+
+    writer->stop.store(1);
+    vcos_event_flags_set(&writer->events, SEGMENT_EVENT_STOP, VCOS_OR);
+    vcos_thread_join(&writer->thread, nullptr);
+
+    if (writer->bytes_dropped.load())
+        vcos_log_error("%s: %llu bytes were dropped, the disk could not keep up", __func__,
+                       (unsigned long long) writer->bytes_dropped.load());
+
+    segment_writer_close(writer);
+    if (writer->next_fd >= 0)
+        close(writer->next_fd);
+    vcos_event_flags_delete(&writer->events);
+    free(writer->data);
+    delete writer;
+    state->segment_writer = nullptr;
+}
+
+/**
+ * Queue an encoder output buffer for writing, called from the encoder callback after the segment
+ * number was updated
+ *
+ * @param state Pointer to state control struct
+ * @param buffer Encoder output buffer, without side information
+ */
+void segment_writer_write(CAM_STATE *state, MMAL_BUFFER_HEADER_T *buffer) {
+    SEGMENT_WRITER *writer = state->segment_writer;
+    const uint8_t *data = buffer->data + buffer->offset;
+    uint32_t length = buffer->length;
+    int config = (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG) != 0; // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+    int keyframe = (buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME) != 0; // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+    int start = config || (keyframe && !writer->in_headers && !writer->in_frame);
+    int switched = 0;
+    uint32_t prefix = 0;
+
+    // keep the latest headers for segments that start without them
+    if (config) {
+        if (!writer->in_headers)
+            writer->headers_length = 0;
+        if (writer->headers_length + length <= SEGMENT_WRITER_HEADER_MAX) {
+            memcpy(writer->headers + writer->headers_length, data, length);
+            writer->headers_length += length;
+        }
+    }
+    writer->in_headers = config;
+    if (!config)
+        writer->in_frame = !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END); // NOLINT(hicpp-signed-bitwise) (controlled in MMAL library)
+
+    if (state->segmentNumber != writer->segment) {
+        uint32_t switch_head = writer->switch_head.load(std::memory_order_relaxed);
+
+        if (switch_head - writer->switch_tail.load(std::memory_order_acquire) < SEGMENT_WRITER_SWITCHES) {
+            SEGMENT_SWITCH *next = &writer->switches[switch_head % SEGMENT_WRITER_SWITCHES];
+
+            next->offset = writer->head.load(std::memory_order_relaxed);
+            next->segment = state->segmentNumber;
+            writer->switch_head.store(switch_head + 1, std::memory_order_release);
+            writer->segment = state->segmentNumber;
+            switched = 1;
+            if (!config && segment_writer_numbered(state))
+                prefix = writer->headers_length;
+        }
+    }
+
+    // after a drop only a keyframe can resume the stream
+    if (writer->dropping && !start) {
+        writer->bytes_dropped += length;
+        return;
+    }
+
+    uint64_t used = writer->head.load(std::memory_order_relaxed) - writer->tail.load(std::memory_order_acquire);
+    if (used + prefix + length > writer->size) {
+        if (!writer->dropping)
+            vcos_log_error("%s: recording buffer full, dropping video up to the next keyframe", __func__);
+        writer->dropping = 1;
+        writer->bytes_dropped += length;
+        return;
+    }
+    writer->dropping = 0;
+
+    if (prefix)
+        segment_writer_put(writer, writer->headers, prefix);
+    segment_writer_put(writer, data, length);
+
+    // wake the writer for a batch worth of data, or to rotate
+    uint64_t head = writer->head.load(std::memory_order_relaxed);
+    if (switched || head - writer->signalled >= SEGMENT_WRITER_BATCH) {
+        writer->signalled = head;
+        vcos_event_flags_set(&writer->events, SEGMENT_EVENT_DATA, VCOS_OR);
+    }
+}
@@ -0,0 +1,324 @@
+//
+// Pipeline telemetry: counters and gauges of the video pipeline, updated without locks from the
+// MMAL callback thread and whichever threads release frames, and readable at any time.
+//
+// Rates (fps, bytes per second) are measured over windows of a second by the encoder callback
+// thread, the only writer of the frame counters, and published when a window closes.
+// Optionally, a thread serves a text snapshot to every client connecting to a unix socket
+// (statsSocket), one "name value" line per field:
+//
+//   socat - UNIX-CONNECT:/run/cam.stats
+//
+
+#include "cam.h"
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <sys/un.h>
+
+/// Length of the windows over which rates are measured, in us
+#define PIPELINE_STATS_WINDOW 1000000
+/// Largest text snapshot
+#define PIPELINE_STATS_TEXT_SIZE 2048
+
+struct pipeline_stats_s {
+    std::atomic<uint32_t> buffers_held;
+    std::atomic<uint64_t> frames_delivered;
+    std::atomic<uint64_t> frames_dropped;
+    std::atomic<uint64_t> buffer_return_failures;
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> callbacks;
+    std::atomic<uint64_t> callback_time;
+    std::atomic<uint32_t> callback_time_max;
+    std::atomic<uint32_t> fps_milli;            /// frames per 1000s over the last window
+    std::atomic<uint64_t> bytes_per_second;     /// over the last window
+
+    // current window, encoder callback thread only
+    uint64_t window_start;
+    uint64_t window_frames;
+    uint64_t window_bytes;
+
+    // text export
+    int listen_fd;
+    char *path;
+    VCOS_THREAD_T thread;
+    int thread_running;
+};
+
+/**
+ * Close the rate window if it is over, called for every frame by the encoder callback thread
+ */
+static void pipeline_stats_window(PIPELINE_STATS *stats, uint64_t frames, uint64_t bytes) {
+    uint64_t now = get_microseconds64();
+
+    stats->window_frames += frames;
+    stats->window_bytes += bytes;
+    if (!stats->window_start) {
+        stats->window_start = now;
+    } else if (now - stats->window_start >= PIPELINE_STATS_WINDOW) {
+        uint64_t elapsed = now - stats->window_start;
+
+        stats->fps_milli.store((uint32_t) (stats->window_frames * 1000000000ull / elapsed), std::memory_order_relaxed);
+        stats->bytes_per_second.store(stats->window_bytes * 1000000ull / elapsed, std::memory_order_relaxed);
+        stats->window_start = now;
+        stats->window_frames = 0;
+        stats->window_bytes = 0;
+    }
+}
+
+/**
+ * Count a buffer returned by the encoder, which the pipeline holds until released. Encoder callback thread.
+ *
+ * @param stats The pipeline stats
+ * @param length Bytes of encoded stream in the buffer, 0 for side information (motion vectors)
+ */
+void pipeline_stats_buffer(PIPELINE_STATS *stats, uint32_t length) {
+    stats->buffers_held.fetch_add(1, std::memory_order_relaxed);
+    stats->bytes.fetch_add(length, std::memory_order_relaxed);
+    pipeline_stats_window(stats, 0, length);
+}
+
+/**
+ * Count an encoder buffer released by the pipeline. Any thread.
+ *
+ * @param stats The pipeline stats
+ * @param returned !0 if the buffer went back to the encoder, 0 if that failed while the port was enabled
+ */
+void pipeline_stats_release(PIPELINE_STATS *stats, int returned) {
+    stats->buffers_held.fetch_sub(1, std::memory_order_relaxed);
+    if (!returned)
+        stats->buffer_return_failures.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * @param stats The pipeline stats
+ * @return Encoder buffers currently held by the pipeline
+ */
+uint32_t pipeline_stats_held(PIPELINE_STATS *stats) {
+    return stats->buffers_held.load(std::memory_order_relaxed);
+}
+
+/**
+ * Count a frame handed on for delivery, or dropped for having no new timestamp. Encoder callback thread.
+ *
+ * @param stats The pipeline stats
+ * @param delivered !0 if the frame is delivered, 0 if it is dropped
+ */
+void pipeline_stats_frame(PIPELINE_STATS *stats, int delivered) {
+    if (!delivered) {
+        stats->frames_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    stats->frames_delivered.fetch_add(1, std::memory_order_relaxed);
+    pipeline_stats_window(stats, 1, 0);
+}
+
+/**
+ * Count the time spent in the application's video callback. Any thread.
+ *
+ * @param stats The pipeline stats
+ * @param duration Time spent in the callback, in us
+ */
+void pipeline_stats_callback(PIPELINE_STATS *stats, uint64_t duration) {
+    auto value = (uint32_t) vcos_min(duration, UINT32_MAX);
+    uint32_t max = stats->callback_time_max.load(std::memory_order_relaxed);
+
+    stats->callbacks.fetch_add(1, std::memory_order_relaxed);
+    stats->callback_time.fetch_add(duration, std::memory_order_relaxed);
+    while (value > max && !stats->callback_time_max.compare_exchange_weak(max, value, std::memory_order_relaxed));
+}
+
+/**
+ * Take a snapshot of the pipeline counters and gauges. Safe from any thread, between init() and destroy().
+ *
+ * @param state Pointer to state control struct
+ * @param snapshot Filled with the current values
+ * @return MMAL_SUCCESS, or MMAL_ENOSYS if the video pipeline is not initialised
+ */
+MMAL_STATUS_T get_pipeline_stats(CAM_STATE *state, CAM_PIPELINE_STATS *snapshot) {
+    PIPELINE_STATS *stats = state->pipeline_stats;
+
+    if (!stats)
+        return MMAL_ENOSYS;
+
+    memset(snapshot, 0, sizeof(*snapshot));
+    if (state->video_encoder_pool) {
+        snapshot->encoder_pool_size = state->video_encoder_pool->headers_num;
+        snapshot->encoder_pool_free = mmal_queue_length(state->video_encoder_pool->queue);
+    }
+    if (state->encoder_pool) {
+        snapshot->still_pool_size = state->encoder_pool->headers_num;
+        snapshot->still_pool_free = mmal_queue_length(state->encoder_pool->queue);
+    }
+    snapshot->buffers_held = stats->buffers_held.load(std::memory_order_relaxed);
+    // whatever is neither idle nor held by the pipeline is queued at the encoder
+    snapshot->buffers_in_flight = snapshot->encoder_pool_size -
+                                  vcos_min(snapshot->encoder_pool_size,
+                                           snapshot->encoder_pool_free + snapshot->buffers_held);
+    snapshot->frames_delivered = stats->frames_delivered.load(std::memory_order_relaxed);
+    snapshot->frames_dropped = stats->frames_dropped.load(std::memory_order_relaxed);
+    snapshot->buffer_return_failures = stats->buffer_return_failures.load(std::memory_order_relaxed);
+    snapshot->bytes = stats->bytes.load(std::memory_order_relaxed);
+    snapshot->bytes_per_second = stats->bytes_per_second.load(std::memory_order_relaxed);
+    snapshot->fps = stats->fps_milli.load(std::memory_order_relaxed) / 1000.0;
+    snapshot->callbacks = stats->callbacks.load(std::memory_order_relaxed);
+    snapshot->callback_time = stats->callback_time.load(std::memory_order_relaxed);
+    snapshot->callback_time_max = stats->callback_time_max.load(std::memory_order_relaxed);
+    return MMAL_SUCCESS;
+}
+
+/**
+ * Format a snapshot as text, one "name value" line per field
+ *
+ * @return Number of characters written, excluding the terminating 0
+ */
+static int pipeline_stats_format(const CAM_PIPELINE_STATS *s, char *text, size_t size) {
+    int length = snprintf(text, size,
+                          "encoder_pool_size %u\nencoder_pool_free %u\nbuffers_held %u\nbuffers_in_flight %u\n"
+                          "still_pool_size %u\nstill_pool_free %u\n"
+                          "frames_delivered %llu\nframes_dropped %llu\nbuffer_return_failures %llu\n"
+                          "bytes %llu\nbytes_per_second %llu\nfps %.3f\n"
+                          "callbacks %llu\ncallback_time_us %llu\ncallback_time_max_us %u\n",
+                          s->encoder_pool_size, s->encoder_pool_free, s->buffers_held, s->buffers_in_flight,
+                          s->still_pool_size, s->still_pool_free,
+                          (unsigned long long) s->frames_delivered, (unsigned long long) s->frames_dropped,
+                          (unsigned long long) s->buffer_return_failures, (unsigned long long) s->bytes,
+                          (unsigned long long) s->bytes_per_second, s->fps, (unsigned long long) s->callbacks,
+                          (unsigned long long) s->callback_time, s->callback_time_max);
+
+    return vcos_min(length, (int) size - 1);
+}
+
+/**
+ * Text export thread: writes a snapshot to each client and closes the connection
+ */
+static void *pipeline_stats_thread(void *arg) {
+    auto *state = (CAM_STATE *) arg;
+    PIPELINE_STATS *stats = state->pipeline_stats;
+    char text[PIPELINE_STATS_TEXT_SIZE];
+
+    for (;;) {
+        int fd = accept4(stats->listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            // shut down by pipeline_stats_destroy
+            break;
+        }
+
+        CAM_PIPELINE_STATS snapshot;
+        if (get_pipeline_stats(state, &snapshot) == MMAL_SUCCESS) {
+            int length = pipeline_stats_format(&snapshot, text, sizeof(text));
+            if (send(fd, text, (size_t) length, MSG_NOSIGNAL) != length)
+                vcos_log_trace("%s: short write to a stats client", __func__);
+        }
+        close(fd);
+    }
+    return nullptr;
+}
+
+/**
+ * Start serving text snapshots on the unix socket state->statsSocket
+ */
+static MMAL_STATUS_T pipeline_stats_listen(CAM_STATE *state) {
+    PIPELINE_STATS *stats = state->pipeline_stats;
+    struct sockaddr_un address{};
+
+    if (strlen(state->statsSocket) >= sizeof(address.sun_path)) {
+        vcos_log_error("%s: socket path too long: %s", __func__, state->statsSocket);
+        return MMAL_EINVAL;
+    }
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, state->statsSocket, sizeof(address.sun_path) - 1);
+
+    stats->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (stats->listen_fd < 0) {
+        vcos_log_error("%s: unable to create the stats socket: %s", __func__, strerror(errno));
+        return MMAL_EIO;
+    }
+    // a socket left behind by a previous run would make bind fail
+    unlink(state->statsSocket);
+    if (bind(stats->listen_fd, (struct sockaddr *) &address, sizeof(address)) < 0 ||
+        listen(stats->listen_fd, 4) < 0) {
+        vcos_log_error("%s: unable to listen on %s: %s", __func__, state->statsSocket, strerror(errno));
+        return MMAL_EIO;
+    }
+    stats->path = strdup(state->statsSocket);
+
+    if (vcos_thread_create(&stats->thread, "cam-stats", nullptr, pipeline_stats_thread, state) != VCOS_SUCCESS) {
+        vcos_log_error("%s: unable to create the stats thread", __func__);
+        return MMAL_ENOMEM;
+    }
+    stats->thread_running = 1;
+    return MMAL_SUCCESS;
+}
+
+/**
+ * Create the pipeline stats of a video capture, and the text export if state->statsSocket is set
+ *
+ * @param state Pointer to state control struct
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T pipeline_stats_create(CAM_STATE *state) {
+    MMAL_STATUS_T status;
+
+    if (state->pipeline_stats)
+        return MMAL_SUCCESS;
+
+    state->pipeline_stats = new(std::nothrow) PIPELINE_STATS();
+    if (!state->pipeline_stats)
+        return MMAL_ENOMEM;
+    state->pipeline_stats->listen_fd = -1;
+
+    if (state->statsSocket && (status = pipeline_stats_listen(state)) != MMAL_SUCCESS) {
+        pipeline_stats_destroy(state);
+        return status;
+    }
+    return MMAL_SUCCESS;
+}
+
+/**
+ * Stop the text export, before destroy() frees the pools it reports on. The counters stay alive until
+ * pipeline_stats_destroy(), for the buffers released in the meantime.
+ *
+ * @param state Pointer to state control struct
+ */
+void pipeline_stats_stop_export(CAM_STATE *state) {
+    PIPELINE_STATS *stats = state->pipeline_stats;
+
+    if (!stats)
+        return;
+
+    if (stats->listen_fd >= 0) {
+        // wakes the thread up from accept
+        shutdown(stats->listen_fd, SHUT_RDWR);
+        if (stats->thread_running)
+            vcos_thread_join(&stats->thread, nullptr);
+        stats->thread_running = 0;
+        close(stats->listen_fd);
+        stats->listen_fd = -1;
+    }
+    if (stats->path) {
+        unlink(stats->path);
+        free(stats->path);
+        stats->path = nullptr;
+    }
+}
+
+/**
+ * Stop the text export and free the pipeline stats
+ *
+ * @param state Pointer to state control struct
+ */
+void pipeline_stats_destroy(CAM_STATE *state) {
+    PIPELINE_STATS *stats = state->pipeline_stats;
+
+    if (!stats)
+        return;
+
+    pipeline_stats_stop_export(state);
+    delete stats;
+    state->pipeline_stats = nullptr;
+}
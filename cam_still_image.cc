@@ -0,0 +1,243 @@
+//
+// Reusable memory for still images assembled by the still encoder callback, and the
+// scatter-gather alternative that hands out the encoder buffers themselves.
+//
+// The pool keeps the arenas of images that have been released and hands them to the
+// following captures, so a steady stream of stills does not allocate. Arenas are sized
+// from the largest image seen so far, an image only grows (geometrically) when it is
+// larger than every image before it.
+//
+
+#include "cam.h"
+#include <cstring>
+#include <utility>
+
+/// Number of released arenas kept for reuse
+#define STILL_IMAGE_POOL_ARENAS 2
+
+struct still_image_pool_s {
+    VCOS_MUTEX_T lock;
+    uint8_t *arena_data[STILL_IMAGE_POOL_ARENAS];
+    size_t arena_capacity[STILL_IMAGE_POOL_ARENAS];
+    uint32_t arena_num;
+    size_t size_hint;           /// capacity of new arenas, the largest image seen so far
+    uint32_t references;        /// StillImage handles bound to the pool
+    int destroyed;              /// set by still_image_pool_destroy, freed with the last reference
+};
+
+static void still_image_pool_free(STILL_IMAGE_POOL *pool) {
+    for (uint32_t i = 0; i < pool->arena_num; i++)
+        free(pool->arena_data[i]);
+    vcos_mutex_delete(&pool->lock);
+    free(pool);
+}
+
+/**
+ * Take an arena out of the pool, or allocate one of the learned size
+ * @return !0 if successful
+ */
+static int still_image_pool_get(STILL_IMAGE_POOL *pool, uint8_t **data, size_t *capacity) {
+    size_t size;
+
+    vcos_mutex_lock(&pool->lock);
+    if (pool->arena_num) {
+        pool->arena_num--;
+        *data = pool->arena_data[pool->arena_num];
+        *capacity = pool->arena_capacity[pool->arena_num];
+        vcos_mutex_unlock(&pool->lock);
+        return 1;
+    }
+    size = pool->size_hint;
+    vcos_mutex_unlock(&pool->lock);
+
+    *data = (uint8_t *) malloc(size);
+    *capacity = *data ? size : 0;
+    return *data != nullptr;
+}
+
+/**
+ * Return an arena to the pool and learn from the size of the image it held
+ */
+static void still_image_pool_put(STILL_IMAGE_POOL *pool, uint8_t *data, size_t capacity, size_t length) {
+    vcos_mutex_lock(&pool->lock);
+    if (length > pool->size_hint)
+        pool->size_hint = length;
+
+    // arenas that are too small would only be grown again
+    if (!pool->destroyed && pool->arena_num < STILL_IMAGE_POOL_ARENAS && capacity >= pool->size_hint) {
+        pool->arena_data[pool->arena_num] = data;
+        pool->arena_capacity[pool->arena_num] = capacity;
+        pool->arena_num++;
+        data = nullptr;
+    }
+    vcos_mutex_unlock(&pool->lock);
+
+    free(data);
+}
+
+/**
+ * Drop a reference on the pool, freeing it if it was destroyed and this was the last one
+ */
+static void still_image_pool_unref(STILL_IMAGE_POOL *pool) {
+    int free_pool;
+
+    vcos_mutex_lock(&pool->lock);
+    pool->references--;
+    free_pool = pool->destroyed && !pool->references;
+    vcos_mutex_unlock(&pool->lock);
+
+    if (free_pool)
+        still_image_pool_free(pool);
+}
+
+/**
+ * Create a still image pool
+ *
+ * @param size_hint Initial size of the arenas, typically the still encoder output buffer size
+ * @return The pool, or nullptr if it could not be created
+ */
+STILL_IMAGE_POOL *still_image_pool_create(size_t size_hint) {
+    auto *pool = (STILL_IMAGE_POOL *) calloc(1, sizeof(STILL_IMAGE_POOL));
+
+    if (!pool)
+        return nullptr;
+
+    if (vcos_mutex_create(&pool->lock, "cam-still-pool") != VCOS_SUCCESS) {
+        free(pool);
+        return nullptr;
+    }
+    pool->size_hint = size_hint;
+    return pool;
+}
+
+/**
+ * Destroy a still image pool. Images that are still held keep the pool alive until they are released.
+ *
+ * @param pool Pool to destroy, may be nullptr
+ */
+void still_image_pool_destroy(STILL_IMAGE_POOL *pool) {
+    int free_pool;
+
+    if (!pool)
+        return;
+
+    vcos_mutex_lock(&pool->lock);
+    pool->destroyed = 1;
+    free_pool = !pool->references;
+    vcos_mutex_unlock(&pool->lock);
+
+    if (free_pool)
+        still_image_pool_free(pool);
+}
+
+StillImage::StillImage(STILL_IMAGE_POOL *pool) : pool_(pool) {
+    if (pool_) {
+        vcos_mutex_lock(&pool_->lock);
+        pool_->references++;
+        vcos_mutex_unlock(&pool_->lock);
+    }
+}
+
+StillImage::StillImage(StillImage &&other) noexcept
+        : pool_(other.pool_), data_(other.data_), length_(other.length_), capacity_(other.capacity_) {
+    other.pool_ = nullptr;
+    other.data_ = nullptr;
+    other.length_ = other.capacity_ = 0;
+}
+
+StillImage &StillImage::operator=(StillImage &&other) noexcept {
+    if (this != &other) {
+        reset();
+        std::swap(pool_, other.pool_);
+        std::swap(data_, other.data_);
+        std::swap(length_, other.length_);
+        std::swap(capacity_, other.capacity_);
+    }
+    return *this;
+}
+
+StillImage::~StillImage() {
+    reset();
+}
+
+/**
+ * Append encoded data to the image, taking an arena from the pool for the first chunk
+ *
+ * @param data Data to append
+ * @param length Number of bytes to append
+ * @return true if successful, false if out of memory
+ */
+bool StillImage::append(const uint8_t *data, size_t length) {
+    if (!data_ && pool_ && !still_image_pool_get(pool_, &data_, &capacity_))
+        return false;
+
+    if (length_ + length > capacity_) {
+        size_t capacity = capacity_ * 2;
+        if (capacity < length_ + length)
+            capacity = length_ + length;
+
+        auto *grown = (uint8_t *) realloc(data_, capacity);
+        if (!grown)
+            return false;
+        data_ = grown;
+        capacity_ = capacity;
+    }
+
+    memcpy(data_ + length_, data, length);
+    length_ += length;
+    return true;
+}
+
+void StillImage::reset() {
+    if (pool_) {
+        if (data_)
+            still_image_pool_put(pool_, data_, capacity_, length_);
+        still_image_pool_unref(pool_);
+    } else {
+        free(data_);
+    }
+    pool_ = nullptr;
+    data_ = nullptr;
+    length_ = capacity_ = 0;
+}
+
+StillChunks::StillChunks(StillChunks &&other) noexcept
+        : buffers_(std::move(other.buffers_)), iov_(std::move(other.iov_)), length_(other.length_) {
+    other.buffers_.clear();
+    other.iov_.clear();
+    other.length_ = 0;
+}
+
+StillChunks &StillChunks::operator=(StillChunks &&other) noexcept {
+    if (this != &other) {
+        reset();
+        buffers_.swap(other.buffers_);
+        iov_.swap(other.iov_);
+        std::swap(length_, other.length_);
+    }
+    return *this;
+}
+
+StillChunks::~StillChunks() {
+    reset();
+}
+
+/**
+ * Add an encoder output buffer to the image, taking a reference on it
+ *
+ * @param buffer Buffer header holding the next part of the image
+ */
+void StillChunks::add(MMAL_BUFFER_HEADER_T *buffer) {
+    mmal_buffer_header_acquire(buffer);
+    buffers_.push_back(buffer);
+    iov_.push_back({buffer->data + buffer->offset, buffer->length});
+    length_ += buffer->length;
+}
+
+void StillChunks::reset() {
+    for (auto buffer : buffers_)
+        mmal_buffer_header_release(buffer);
+    buffers_.clear();
+    iov_.clear();
+    length_ = 0;
+}